@@ -26,8 +26,10 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 
+#include "createsocket.hh"
+
 int
-createUNIXSocket(const char *name)
+createUNIXSocket(const char *name, int type)
 {
   struct sockaddr_un control;
   control.sun_family = AF_UNIX;
@@ -38,7 +40,7 @@ createUNIXSocket(const char *name)
   strcpy(control.sun_path, name);
 
   unlink(control.sun_path);
-  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  int sock = socket(AF_UNIX, type, 0);
   if (sock<0) {
     perror ("failed to create unix domain socket");
     return -1;
@@ -0,0 +1,72 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <time.h>
+
+#include "deadline.hh"
+
+unsigned long long
+monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+armDeadline(deadline_t *d, unsigned seconds)
+{
+  d->when = monotonicMs() + (unsigned long long)seconds * 1000;
+}
+
+void
+armDeadlineMs(deadline_t *d, unsigned ms)
+{
+  d->when = monotonicMs() + ms;
+}
+
+void
+disarmDeadline(deadline_t *d)
+{
+  d->when = 0;
+}
+
+bool
+deadlineExpired(const deadline_t *d)
+{
+  return d->when != 0 && monotonicMs() >= d->when;
+}
+
+/**
+ * Return the time left in milliseconds in the form expected by poll():
+ * -1 when the deadline isn't armed and 0 when it has already passed.
+ */
+int
+deadlineRemaining(const deadline_t *d)
+{
+  if (d->when == 0)
+    return -1;
+  unsigned long long now = monotonicMs();
+  if (now >= d->when)
+    return 0;
+  unsigned long long left = d->when - now;
+  if (left > 0x7fffffff)
+    left = 0x7fffffff;
+  return (int)left;
+}
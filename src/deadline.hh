@@ -0,0 +1,38 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * A point in time on the monotonic clock after which an operation is
+ * considered to have timed out.
+ */
+struct deadline_t
+{
+  deadline_t() {
+    when = 0;
+  }
+  unsigned long long when; // milliseconds, 0 when not armed
+};
+
+unsigned long long monotonicMs();
+
+void armDeadline(deadline_t *d, unsigned seconds);
+void armDeadlineMs(deadline_t *d, unsigned ms);
+void disarmDeadline(deadline_t *d);
+bool deadlineExpired(const deadline_t *d);
+int deadlineRemaining(const deadline_t *d);
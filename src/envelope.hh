@@ -0,0 +1,81 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+
+/*
+ * Each queued message consists of a .dat file with the message and an .env
+ * file with the envelope. The .env file starts with a header of
+ * ENV_HEADER_SIZE bytes followed by the envelope entries:
+ *   F<sender>\0T<recipient>\0...\0
+ *
+ * Byte 0 of the header holds the flags below, the other bytes are reserved
+ * and zero. With ENV_TRACE set, the header is followed by an envtrace_t
+ * and then the envelope entries.
+ *
+ * mailgrave-send overwrites the 'T' of a recipient in place once its
+ * delivery is settled: 'D' marks a delivered and 'X' a permanently failed
+ * recipient. Only recipients still marked with 'T' are tried again. When
+ * none is left, the sender gets a bounce naming the 'X' recipients and the
+ * message is removed.
+ */
+
+static const unsigned ENV_HEADER_SIZE = 8;
+
+// the .dat file is already in SMTP wire format: every line ends with CRLF
+// and every '.' at the beginning of a line is doubled
+static const unsigned char ENV_WIRE = 0x01;
+
+// the .dat file contains no line beginning with '.', thus the wire format
+// and the plain message are the same
+static const unsigned char ENV_NODOTS = 0x02;
+
+// the header is followed by an envtrace_t
+static const unsigned char ENV_TRACE = 0x04;
+
+// When the message passed each stage, in microseconds on the wall clock,
+// see trace.hh. mailgrave-queue stamps the first three, mailgrave-send
+// the others on each attempt.
+struct envtrace_t
+{
+  uint64_t accepted;    // a client began to hand the message over, or 0
+  uint64_t queued;      // mailgrave-queue began to store it
+  uint64_t stored;      // it was written to the queue, not yet synced
+  uint64_t first;       // the first attempt, or 0
+  uint64_t last;        // the latest attempt, or 0
+  uint64_t attempts;
+};
+
+// mailgrave-remote answers a job with one of these per recipient, in the
+// order of the envelope. Missing answers count as RCPT_DEFERRED.
+static const unsigned char RCPT_DEFERRED = 0;
+static const unsigned char RCPT_DONE = 1;
+static const unsigned char RCPT_FAILED = 2;
+
+// Clients hand a message to mailgrave-queue by sending the envelope as
+// above, optionally preceded by A<time>\0 with the decimal time at which
+// they accepted the message, followed by the message, and shutting down
+// their side of the connection. The queue answers with one byte, 1 when
+// the message was queued and 0 otherwise.
+//
+// A connection starting with QUEUE_BATCH carries any number of messages,
+// each preceded by the decimal length of its envelope and message and a
+// '\n'. The queue answers every message with one byte as above. Clients
+// don't have to wait for the answer before sending the next message.
+static const char QUEUE_BATCH = 'B';
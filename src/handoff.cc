@@ -0,0 +1,200 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "handoff.hh"
+
+using std::string;
+
+/**
+ * Pass the open queue file 'fd' and the envelope to the peer.
+ *
+ * \param sock
+ *   connected SOCK_SEQPACKET socket
+ * \param fd
+ *   descriptor of the .dat file, the peer reads it from the current offset
+ * \param count
+ *   number of recipients in 'envelope'
+ */
+bool
+sendHandoff(int sock, int fd, uint32_t flags, unsigned count,
+            const string &envelope)
+{
+  handoff_t header;
+  header.magic  = HANDOFF_MAGIC;
+  header.flags  = flags;
+  header.count  = count;
+  header.length = envelope.size();
+
+  size_t n = envelope.size();
+  if (n > HANDOFF_RECORD - sizeof(header))
+    n = HANDOFF_RECORD - sizeof(header);
+
+  iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len  = sizeof(header);
+  iov[1].iov_base = const_cast<char*>(envelope.data());
+  iov[1].iov_len  = n;
+
+  union {
+    cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+    if (errno==EINTR)
+      continue;
+    perror("sendHandoff: sendmsg");
+    return false;
+  }
+
+  // the remaining envelope, if any, follows as plain records
+  for(size_t i = n; i < envelope.size(); i += n) {
+    n = envelope.size() - i;
+    if (n > HANDOFF_RECORD)
+      n = HANDOFF_RECORD;
+    if (send(sock, envelope.data()+i, n, MSG_NOSIGNAL) != (ssize_t)n) {
+      if (errno==EINTR) {
+        n = 0;
+        continue;
+      }
+      perror("sendHandoff: send");
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Receive a job sent with sendHandoff.
+ *
+ * \param fd
+ *   out: the received descriptor, owned by the caller on success
+ */
+bool
+recvHandoff(int sock, int *fd, uint32_t *flags, unsigned *count,
+            string *envelope)
+{
+  char buffer[HANDOFF_RECORD];
+  handoff_t header;
+
+  *fd = -1;
+  envelope->clear();
+
+  union {
+    cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len  = sizeof(buffer);
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  ssize_t l;
+  while((l=recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+    if (errno==EINTR)
+      continue;
+    perror("recvHandoff: recvmsg");
+    return false;
+  }
+
+  for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg;
+      cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type  == SCM_RIGHTS &&
+        cmsg->cmsg_len   == CMSG_LEN(sizeof(int)))
+    {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  if (*fd < 0) {
+    fprintf(stderr, "recvHandoff: job without file descriptor\n");
+    return false;
+  }
+  if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+    fprintf(stderr, "recvHandoff: truncated record\n");
+    goto error;
+  }
+  if ((size_t)l < sizeof(header)) {
+    fprintf(stderr, "recvHandoff: short header\n");
+    goto error;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  if (header.magic != HANDOFF_MAGIC) {
+    fprintf(stderr, "recvHandoff: bad magic\n");
+    goto error;
+  }
+  envelope->reserve(header.length);
+  envelope->append(buffer+sizeof(header), l-sizeof(header));
+
+  while(envelope->size() < header.length) {
+    l = recv(sock, buffer, sizeof(buffer), 0);
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<=0) {
+      fprintf(stderr, "recvHandoff: incomplete envelope\n");
+      goto error;
+    }
+    envelope->append(buffer, l);
+  }
+  if (envelope->size() != header.length) {
+    fprintf(stderr, "recvHandoff: envelope size mismatch\n");
+    goto error;
+  }
+
+  *flags = header.flags;
+  *count = header.count;
+  return true;
+
+error:
+  close(*fd);
+  *fd = -1;
+  return false;
+}
@@ -0,0 +1,46 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Header of a job handed from mailgrave-send to mailgrave-remote over a
+ * SOCK_SEQPACKET socket. The first record carries this header, the
+ * descriptor of the queue's .dat file (SCM_RIGHTS) and the start of the
+ * envelope, further records carry the rest of the envelope.
+ *
+ * The envelope has the same layout as on the stream socket:
+ *   <host>\0<sender>\0<recipient>\0...\0
+ */
+struct handoff_t
+{
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t count;   // number of recipients
+  uint32_t length;  // size of the envelope in bytes
+};
+
+static const uint32_t HANDOFF_MAGIC = 0x4d474831; // "MGH1"
+static const size_t HANDOFF_RECORD = 65536;
+
+bool sendHandoff(int sock, int fd, uint32_t flags, unsigned count,
+                 const std::string &envelope);
+bool recvHandoff(int sock, int *fd, uint32_t *flags, unsigned *count,
+                 std::string *envelope);
@@ -0,0 +1,272 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/mman.h>
+
+#include "health.hh"
+#include "log.hh"
+
+static const unsigned health_threshold = 3;
+static const unsigned backoff_min = 60;
+static const unsigned backoff_max = 60 * 60;
+static const unsigned health_load = 75;   // percent of the slots in use
+                                          // before slots are reclaimed
+
+static healthheader_t *header = 0;
+static healthentry_t *slots = 0;
+static bool writer = false;
+static bool full = false;               // logged that the table is full
+
+/**
+ * Map the health file into memory.
+ *
+ * \param writable
+ *   true for mailgrave-remote, which creates the file when needed
+ * \return
+ *   false when the file can't be mapped, the caller continues without
+ */
+bool
+mapHealth(const char *file, bool writable)
+{
+  void *p;
+  int fd = open(file, writable ? O_RDWR|O_CREAT : O_RDONLY, 00644);
+  if (fd<0) {
+    if (writable || errno!=ENOENT)
+      perror("failed to open health file");
+    return false;
+  }
+  if (writable && ftruncate(fd, HEALTH_SIZE)!=0) {
+    perror("failed to resize health file");
+    close(fd);
+    return false;
+  }
+  p = mmap(0, HEALTH_SIZE, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+           MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED) {
+    perror("failed to mmap health file");
+    return false;
+  }
+  header = (healthheader_t*)p;
+  slots = (healthentry_t*)p + 1;
+  writer = writable;
+  if (writable) {
+    if (header->magic!=HEALTH_MAGIC) {
+      memset(p, 0, HEALTH_SIZE);
+      header->slots = HEALTH_SIZE / sizeof(healthentry_t) - 1;
+      header->magic = HEALTH_MAGIC;
+    }
+    // probes of a previous run won't finish
+    for(uint32_t i=0; i<header->slots; ++i) {
+      if (slots[i].state==HEALTH_PROBE)
+        slots[i].state = HEALTH_DOWN;
+    }
+  } else
+  if (header->magic!=HEALTH_MAGIC) {
+    munmap(p, HEALTH_SIZE);
+    header = 0;
+    slots = 0;
+    return false;
+  }
+  return true;
+}
+
+void
+setHealthRelay(const char *relay)
+{
+  if (!header || !writer)
+    return;
+  strncpy(header->relay, relay ? relay : "", sizeof(header->relay)-1);
+}
+
+/**
+ * The relay mailgrave-remote uses or 0 when it delivers directly.
+ */
+const char*
+healthRelay()
+{
+  if (!header || !header->relay[0])
+    return 0;
+  return header->relay;
+}
+
+/**
+ * The name is only kept for the log, entries are told apart by the hash
+ * of the whole name alone.
+ */
+static uint64_t
+hashName(const char *name)
+{
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  for(; *name; ++name) {
+    h ^= (unsigned char)tolower((unsigned char)*name);
+    h *= 1099511628211ull;
+  }
+  return h ? h : 1;
+}
+
+/**
+ * True when the entry holds nothing worth keeping: the destination is up
+ * and either had no failures or wasn't heard of for long, or it was down
+ * and nobody tried it long after it could have been probed.
+ */
+static bool
+reclaimable(const healthentry_t *e, time_t now)
+{
+  if (e->state==HEALTH_UP)
+    return e->failures==0 || e->changed + backoff_max < now;
+  return e->state==HEALTH_DOWN && e->retry + backoff_max < now;
+}
+
+/**
+ * Find the entry for the destination 'name', which is created when
+ * 'create' is set and the caller is the writer.
+ *
+ * A reclaimed slot is overwritten where it is, thus it stays on the probe
+ * sequences of the other entries.
+ */
+healthentry_t*
+findHealth(const char *name, bool create)
+{
+  if (!header)
+    return 0;
+  uint64_t h = hashName(name);
+  uint32_t n = header->slots;
+  time_t now = time(0);
+  healthentry_t *e = 0, *reclaim = 0;
+  for(uint32_t i=0; i<n; ++i) {
+    healthentry_t *x = &slots[(h + i) % n];
+    uint64_t xh = __atomic_load_n(&x->hash, __ATOMIC_ACQUIRE);
+    if (xh==h)
+      return x;
+    if (xh==0) {
+      e = x;
+      break;
+    }
+    if (!reclaim && create && writer && reclaimable(x, now))
+      reclaim = x;
+  }
+  if (!create || !writer)
+    return 0;
+  if (reclaim && (!e || header->used * 100 >= n * health_load)) {
+    e = reclaim;
+  } else
+  if (e) {
+    ++header->used;
+  } else {
+    if (!full)
+      LOG(LEVEL_ERROR, "health: table is full, not tracking '%s'\n", name);
+    full = true;
+    return 0;
+  }
+  full = false;
+  __atomic_store_n(&e->hash, 0, __ATOMIC_RELAXED);
+  e->state = HEALTH_UP;
+  e->failures = 0;
+  e->retry = 0;
+  e->changed = now;
+  e->window = 0;
+  memset(e->name, 0, sizeof(e->name));
+  strncpy(e->name, name, sizeof(e->name)-1);
+  __atomic_store_n(&e->hash, h, __ATOMIC_RELEASE);
+  return e;
+}
+
+/**
+ * True when 'h' still is the entry of 'name', its slot may have been
+ * reclaimed for another destination since it was found.
+ */
+bool
+healthMatches(const healthentry_t *h, const char *name)
+{
+  return __atomic_load_n(&h->hash, __ATOMIC_ACQUIRE)==hashName(name);
+}
+
+/**
+ * True when no attempt should be made to deliver to 'name' now.
+ */
+bool
+healthDown(const char *name, time_t now)
+{
+  healthentry_t *e = findHealth(name, false);
+  return e && e->state!=HEALTH_UP && now < e->retry;
+}
+
+/**
+ * The earliest time a destination which is down may be probed again,
+ * 0 when all are up.
+ */
+time_t
+healthNextRetry(time_t now)
+{
+  time_t next = 0;
+  if (!header)
+    return 0;
+  for(uint32_t i=0; i<header->slots; ++i) {
+    const healthentry_t *e = &slots[i];
+    if (e->hash && e->state==HEALTH_DOWN && e->retry>now &&
+        (next==0 || e->retry<next))
+      next = e->retry;
+  }
+  return next;
+}
+
+void
+healthSuccess(healthentry_t *h)
+{
+  if (!h)
+    return;
+  if (h->state!=HEALTH_UP)
+    LOG(LEVEL_INFO, "health: '%s' is up again\n", h->name);
+  h->failures = 0;
+  h->retry = 0;
+  h->changed = time(0);
+  h->state = HEALTH_UP;
+}
+
+/**
+ * Count a failure to connect. A failed probe doubles the time until the
+ * next one.
+ */
+void
+healthFailure(healthentry_t *h, time_t now)
+{
+  if (!h)
+    return;
+  ++h->failures;
+  h->changed = now;
+  if (h->state==HEALTH_UP && h->failures < health_threshold)
+    return;
+  unsigned shift = h->failures - health_threshold;
+  if (shift>6)
+    shift = 6;
+  unsigned backoff = backoff_min << shift;
+  if (backoff>backoff_max)
+    backoff = backoff_max;
+  h->retry = now + backoff;
+  h->state = HEALTH_DOWN;
+  LOG(LEVEL_INFO, "health: '%s' is down, next attempt in %us\n", h->name, backoff);
+}
@@ -0,0 +1,78 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Health of the destinations mailgrave-remote delivers to, kept in a
+ * file which is mapped into memory by mailgrave-remote, which updates
+ * it, and by mailgrave-send, which skips messages for destinations
+ * known to be down.
+ *
+ * A destination goes HEALTH_DOWN after 'health_threshold' consecutive
+ * failures to connect. Until 'retry' no connections are made, then a
+ * single session probes the destination (HEALTH_PROBE) and either brings
+ * it back up or doubles the backoff.
+ *
+ * The table has a fixed number of slots and outlives mailgrave-remote.
+ * When it fills up, the slots of destinations with nothing to remember,
+ * up without failures or not heard of for long, are given to new ones.
+ */
+
+enum {
+  HEALTH_UP,
+  HEALTH_DOWN,
+  HEALTH_PROBE
+};
+
+struct healthentry_t
+{
+  uint64_t hash;        // of the whole name, 0 when the slot is unused
+  uint32_t state;
+  uint32_t failures;    // consecutive failures
+  int64_t retry;        // time() when the next probe may start
+  int64_t changed;      // time() of the last success or failure
+  uint32_t window;      // sessions mailgrave-remote currently allows
+  char name[28];        // for the log, may be truncated
+};
+
+struct healthheader_t
+{
+  uint32_t magic;
+  uint32_t slots;
+  uint32_t used;        // slots with a destination
+  char relay[52];       // all messages go here when not empty
+};
+
+static const uint32_t HEALTH_MAGIC = 0x4d474832; // "MGH2"
+static const size_t HEALTH_SIZE = 65536;
+
+static_assert(sizeof(healthheader_t) <= sizeof(healthentry_t),
+              "the header has to fit into the first slot");
+
+bool mapHealth(const char *file, bool writable);
+void setHealthRelay(const char *relay);
+const char* healthRelay();
+healthentry_t* findHealth(const char *name, bool create);
+bool healthMatches(const healthentry_t *h, const char *name);
+bool healthDown(const char *name, time_t now);
+time_t healthNextRetry(time_t now);
+void healthSuccess(healthentry_t *h);
+void healthFailure(healthentry_t *h, time_t now);
@@ -0,0 +1,938 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "inject.hh"
+#include "rfc822-address.hh"
+#include "opensocket.hh"
+#include "envelope.hh"
+#include "trace.hh"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include <atomic>
+#include <vector>
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+static bool sendStream(inject_t *inject, FILE *in,
+                       const char *data, size_t size);
+static bool sendMessage(inject_t *inject, const string &head,
+                        const char *data, int fd, off_t offset, size_t size);
+static bool connectQueue(inject_t *inject);
+static void retire(inject_t *inject);
+static void answered(inject_t *inject);
+static bool sendAll(int sock, const char *data, size_t size,
+                    size_t *sent = 0);
+static bool sendFile(int sock, int fd, off_t offset, size_t size,
+                     size_t *sent);
+static bool spliceAll(int sock, int fd);
+static bool readHeader(FILE *in, string *header, size_t *end, size_t *body,
+                       const char **error);
+static bool readHeader(int fd, string *header, size_t *end, size_t *body,
+                       const char **error);
+static bool rewriteHeader(const string &header, size_t end, size_t body,
+                          string *out, const char *host,
+                          string *fromList, string *toList,
+                          const char **error);
+
+inject_t::inject_t()
+{
+  socket = "queue.ctrl";
+  error = 0;
+  sock = -1;
+  pending = 0;
+  owed = 0;
+  if (gethostname(host, sizeof(host)) == -1)
+    strcpy(host, "localhost");
+}
+
+inject_t::~inject_t()
+{
+  injectClose(this);
+}
+
+/**
+ * Queue the message and wait for mailgrave-queue's answer.
+ *
+ * Must not be called while answers to injectSend() are outstanding.
+ *
+ * \return
+ *   'true' when the message was queued, otherwise 'error' tells why not
+ */
+bool
+injectMessage(inject_t *inject, const char *data, size_t size)
+{
+  if (inject->pending) {
+    inject->error = "answers to injectSend() are outstanding";
+    return false;
+  }
+  if (!injectSend(inject, data, size))
+    return false;
+  return injectAnswer(inject, true)==1;
+}
+
+bool
+injectMessage(inject_t *inject, FILE *in)
+{
+  if (inject->pending) {
+    inject->error = "answers to injectSend() are outstanding";
+    return false;
+  }
+  if (!injectSend(inject, in))
+    return false;
+  return injectAnswer(inject, true)==1;
+}
+
+/**
+ * Queue the message read from 'fd' and wait for mailgrave-queue's answer.
+ *
+ * The body isn't copied through the application: it is sent with
+ * sendfile() when 'fd' is a regular file and otherwise, since its size
+ * isn't known in advance, spliced into a connection of its own which is
+ * shut down behind the message.
+ */
+bool
+injectMessage(inject_t *inject, int fd)
+{
+  if (inject->pending) {
+    inject->error = "answers to injectSend() are outstanding";
+    return false;
+  }
+  inject->error = 0;
+  struct stat st;
+  if (fstat(fd, &st)!=0) {
+    inject->error = strerror(errno);
+    return false;
+  }
+  string header, head, fromList, toList;
+  size_t end, body;
+  if (!readHeader(fd, &header, &end, &body, &inject->error) ||
+      !rewriteHeader(header, end, body, &head, inject->host,
+                     &fromList, &toList, &inject->error))
+  {
+    return false;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset>=0 && offset<=st.st_size) {
+      if (!sendMessage(inject, head, 0, fd, offset, st.st_size - offset))
+        return false;
+      lseek(fd, st.st_size, SEEK_SET);
+      return injectAnswer(inject, true)==1;
+    }
+  }
+
+  int sock = openUNIXSocket(inject->socket);
+  if (sock<0) {
+    inject->error = "failed to connect to mailgrave-queue";
+    return false;
+  }
+  char answer = 0;
+  ssize_t l = -1;
+  if (sendAll(sock, head.data(), head.size()) &&
+      spliceAll(sock, fd) &&
+      shutdown(sock, SHUT_WR)==0)
+  {
+    while((l=recv(sock, &answer, 1, 0))<0 && errno==EINTR)
+      ;
+  }
+  if (l<0)
+    inject->error = strerror(errno);
+  else if (l==0)
+    inject->error = "lost connection to mailgrave-queue";
+  else if (!answer)
+    inject->error = "delivery to queue failed";
+  close(sock);
+  return l==1 && answer;
+}
+
+/**
+ * Rewrite the message and send it to mailgrave-queue without waiting for
+ * the answer.
+ *
+ * \return
+ *   'false' when the message was rejected or couldn't be sent, there
+ *   will be no answer for it then
+ */
+bool
+injectSend(inject_t *inject, const char *data, size_t size)
+{
+  if (size==0) {
+    inject->error = "empty message";
+    return false;
+  }
+  FILE *in = fmemopen((void*)data, size, "r");
+  if (!in) {
+    inject->error = strerror(errno);
+    return false;
+  }
+  bool r = sendStream(inject, in, data, size);
+  fclose(in);
+  return r;
+}
+
+bool
+injectSend(inject_t *inject, FILE *in)
+{
+  return sendStream(inject, in, 0, 0);
+}
+
+/**
+ * \param data
+ *   the message 'in' reads from or 0, when given the body is sent from
+ *   'data'
+ */
+bool
+sendStream(inject_t *inject, FILE *in, const char *data, size_t size)
+{
+  inject->error = 0;
+  string header, head, fromList, toList;
+  size_t end, body;
+  if (!readHeader(in, &header, &end, &body, &inject->error) ||
+      !rewriteHeader(header, end, body, &head, inject->host,
+                     &fromList, &toList, &inject->error))
+  {
+    return false;
+  }
+
+  // the rest of the body is sent from where it is, only a stream which is
+  // neither in memory nor a regular file has to be read
+  off_t offset = ftello(in);
+  struct stat st;
+  if (data && offset>=0) {
+    return sendMessage(inject, head, data + offset, -1, 0, size - offset);
+  }
+  int fd = fileno(in);
+  if (fd>=0 && offset>=0 && fstat(fd, &st)==0 && S_ISREG(st.st_mode) &&
+      offset<=st.st_size)
+  {
+    if (!sendMessage(inject, head, 0, fd, offset, st.st_size - offset))
+      return false;
+    fseeko(in, st.st_size, SEEK_SET);
+    return true;
+  }
+  while(true) {
+    size_t have = head.size();
+    head.resize(have + 65536);
+    size_t n = fread(&head[have], 1, 65536, in);
+    head.resize(have + n);
+    if (n==0)
+      break;
+  }
+  return sendMessage(inject, head, 0, -1, 0, 0);
+}
+
+/**
+ * Send the envelope and header in 'head' followed by 'size' bytes of the
+ * body, either from 'data' or from 'fd' at 'offset', over the batch
+ * connection.
+ *
+ * After a partial message the queue can't tell where the next one would
+ * begin, the connection is shut down and only used to collect the answers
+ * it owes. The queue drops the partial message and still answers the ones
+ * before it, the next message goes over a new connection.
+ */
+bool
+sendMessage(inject_t *inject, const string &head,
+            const char *data, int fd, off_t offset, size_t size)
+{
+  char length[32];
+  snprintf(length, sizeof(length), "%zu\n", head.size() + size);
+  // a connection left idle may have been closed by the queue meanwhile,
+  // then try a new one as long as nothing of the message went out
+  for(unsigned attempt=0; attempt<2; ++attempt) {
+    if (!connectQueue(inject))
+      break;
+    size_t sent = 0;
+    if (sendAll(inject->sock, length, strlen(length), &sent) &&
+        sendAll(inject->sock, head.data(), head.size(), &sent) &&
+        (fd<0 ? sendAll(inject->sock, data, size, &sent) :
+                sendFile(inject->sock, fd, offset, size, &sent)))
+    {
+      ++inject->pending;
+      return true;
+    }
+    inject->error = strerror(errno);
+    retire(inject);
+    if (sent)
+      break;
+  }
+  return false;
+}
+
+/**
+ * Stop sending over the current connection. When answers are still owed
+ * it is shut down and kept until they arrived, otherwise it is closed.
+ */
+void
+retire(inject_t *inject)
+{
+  if (inject->sock<0)
+    return;
+  unsigned owed = inject->pending - inject->owed;
+  if (owed) {
+    shutdown(inject->sock, SHUT_WR);
+    inject->drain.push_back(std::make_pair(inject->sock, owed));
+    inject->owed += owed;
+  } else {
+    close(inject->sock);
+  }
+  inject->sock = -1;
+}
+
+/**
+ * Count an answer, or a lost one, to the oldest message.
+ */
+void
+answered(inject_t *inject)
+{
+  --inject->pending;
+  if (inject->drain.empty())
+    return;
+  --inject->owed;
+  if (--inject->drain.front().second==0) {
+    if (inject->drain.front().first>=0)
+      close(inject->drain.front().first);
+    inject->drain.pop_front();
+  }
+}
+
+/**
+ * Fetch mailgrave-queue's answer to the oldest message sent with
+ * injectSend().
+ *
+ * \param wait
+ *   wait for the answer
+ * \return
+ *   1 when the message was queued, 0 when not ('error' tells why) and -1
+ *   when there is no answer yet
+ */
+int
+injectAnswer(inject_t *inject, bool wait)
+{
+  if (!inject->pending) {
+    inject->error = "no message sent";
+    return 0;
+  }
+  int *fd = inject->drain.empty() ? &inject->sock
+                                  : &inject->drain.front().first;
+  if (*fd>=0) {
+    char answer;
+    while(true) {
+      ssize_t l = recv(*fd, &answer, 1, wait ? 0 : MSG_DONTWAIT);
+      if (l==1) {
+        answered(inject);
+        if (!answer) {
+          inject->error = "delivery to queue failed";
+          return 0;
+        }
+        return 1;
+      }
+      if (l<0 && errno==EINTR)
+        continue;
+      if (l<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+        inject->error = 0;
+        return -1;
+      }
+      break;
+    }
+    // the messages without answer are lost
+    if (fd==&inject->sock)
+      retire(inject);
+    fd = &inject->drain.front().first;
+    close(*fd);
+    *fd = -1;
+  }
+  answered(inject);
+  inject->error = "lost connection to mailgrave-queue";
+  return 0;
+}
+
+/**
+ * Close the connection to mailgrave-queue. The queue still stores the
+ * messages whose answers weren't fetched.
+ */
+void
+injectClose(inject_t *inject)
+{
+  if (inject->sock>=0) {
+    close(inject->sock);
+    inject->sock = -1;
+  }
+  while(!inject->drain.empty()) {
+    if (inject->drain.front().first>=0)
+      close(inject->drain.front().first);
+    inject->drain.pop_front();
+  }
+  inject->pending = 0;
+  inject->owed = 0;
+}
+
+/**
+ * Make sure there is a connection to mailgrave-queue.
+ */
+bool
+connectQueue(inject_t *inject)
+{
+  if (inject->sock>=0 && inject->pending==inject->owed) {
+    // an idle connection becomes readable when the queue closed it
+    pollfd pfd;
+    pfd.fd = inject->sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0)!=0)
+      retire(inject);
+  }
+  if (inject->sock>=0)
+    return true;
+  inject->sock = openUNIXSocket(inject->socket);
+  if (inject->sock<0) {
+    inject->error = "failed to connect to mailgrave-queue";
+    return false;
+  }
+  if (!sendAll(inject->sock, &QUEUE_BATCH, 1)) {
+    inject->error = strerror(errno);
+    injectClose(inject);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * \param sent
+ *   when given, the number of bytes sent is added to it
+ */
+bool
+sendAll(int sock, const char *data, size_t size, size_t *sent)
+{
+  while(size) {
+    // don't kill the application with SIGPIPE when the queue is gone
+    ssize_t l = send(sock, data, size, MSG_NOSIGNAL);
+    if (l<0) {
+      if (errno==EINTR)
+        continue;
+      return false;
+    }
+    data += l;
+    size -= l;
+    if (sent)
+      *sent += l;
+  }
+  return true;
+}
+
+/*
+ * Unlike send(), sendfile() and splice() can't be told to leave SIGPIPE
+ * alone. The signal is blocked during the transfer and one raised by it is
+ * taken from the pending signals again.
+ */
+static void
+holdSigpipe(sigset_t *old)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+static void
+releaseSigpipe(const sigset_t *old)
+{
+  if (!sigismember(old, SIGPIPE)) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    timespec zero = { 0, 0 };
+    sigtimedwait(&set, 0, &zero);
+  }
+  pthread_sigmask(SIG_SETMASK, old, 0);
+}
+
+/**
+ * Send 'size' bytes of the regular file 'fd' starting at 'offset' without
+ * copying them through the application. The file's offset isn't changed,
+ * the bytes sent are added to 'sent'.
+ */
+bool
+sendFile(int sock, int fd, off_t offset, size_t size, size_t *sent)
+{
+  sigset_t old;
+  holdSigpipe(&old);
+  while(size) {
+    ssize_t l = sendfile(sock, fd, &offset, size);
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<=0) {
+      if (l==0)
+        errno = EIO; // the file was truncated meanwhile
+      break;
+    }
+    size -= l;
+    *sent += l;
+  }
+  int e = errno;
+  releaseSigpipe(&old);
+  errno = e;
+  return size==0;
+}
+
+/**
+ * Move everything up to EOF from 'fd' into the socket. With a pipe this
+ * happens inside the kernel, otherwise large blocks are copied.
+ */
+bool
+spliceAll(int sock, int fd)
+{
+  sigset_t old;
+  holdSigpipe(&old);
+  bool ok = true;
+  bool pipe = true;
+  while(pipe) {
+    ssize_t l = splice(fd, 0, sock, 0, 1<<20, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (l==0)
+      break;
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<0 && errno==EINVAL) {
+      // not a pipe
+      pipe = false;
+    } else if (l<0) {
+      ok = false;
+      break;
+    }
+  }
+  int e = errno;
+  releaseSigpipe(&old);
+  errno = e;
+  if (pipe || !ok)
+    return ok;
+
+  char buffer[65536];
+  while(true) {
+    ssize_t l = read(fd, buffer, sizeof(buffer));
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<0)
+      return false;
+    if (l==0)
+      return true;
+    if (!sendAll(sock, buffer, l))
+      return false;
+  }
+}
+
+/*
+ * The header fields mailgrave-inject cares about. Their first and last
+ * letters place each in its own slot of a table with 16 entries, which is
+ * built and checked at compile time.
+ */
+
+enum {
+  HDR_OTHER,
+  HDR_FROM,
+  HDR_TO,
+  HDR_CC,
+  HDR_BCC,
+  HDR_DATE,
+  HDR_MESSAGE_ID,
+  HDR_RETURN_PATH,
+  HDR_CONTENT_LENGTH
+};
+
+struct headerName_t
+{
+  const char *name;
+  size_t len;
+  int kind;
+};
+
+static constexpr headerName_t headerNames[] = {
+  { "from",            4, HDR_FROM },
+  { "to",              2, HDR_TO },
+  { "cc",              2, HDR_CC },
+  { "bcc",             3, HDR_BCC },
+  { "date",            4, HDR_DATE },
+  { "message-id",     10, HDR_MESSAGE_ID },
+  { "return-path",    11, HDR_RETURN_PATH },
+  { "content-length", 14, HDR_CONTENT_LENGTH }
+};
+
+static constexpr unsigned
+headerSlot(const char *name, size_t len)
+{
+  return ((name[0] | 0x20) + 4 * (name[len-1] | 0x20)) & 15;
+}
+
+struct headerTable_t
+{
+  headerName_t slot[16];
+};
+
+static constexpr headerTable_t
+makeHeaderTable()
+{
+  headerTable_t table = {};
+  for(const headerName_t &h : headerNames)
+    table.slot[headerSlot(h.name, h.len)] = h;
+  return table;
+}
+
+static constexpr headerTable_t headerTable = makeHeaderTable();
+
+static constexpr bool
+headerTableIsPerfect()
+{
+  for(const headerName_t &h : headerNames) {
+    if (headerTable.slot[headerSlot(h.name, h.len)].kind != h.kind)
+      return false;
+  }
+  return true;
+}
+
+static_assert(headerTableIsPerfect(), "header names share a slot");
+
+static int
+headerKind(const char *name, size_t len)
+{
+  const headerName_t &h = headerTable.slot[headerSlot(name, len)];
+  if (h.len!=len || strncasecmp(h.name, name, len)!=0)
+    return HDR_OTHER;
+  return h.kind;
+}
+
+/**
+ * Find the empty line ending the header.
+ *
+ * \param from
+ *   in: where to continue the search, out: where to continue it when more
+ *   data has been read
+ * \param body
+ *   out: the beginning of the body
+ * \return
+ *   the offset of the empty line or string::npos when it wasn't read yet
+ */
+static size_t
+findHeaderEnd(const string &header, size_t *from, size_t *body)
+{
+  const char *p = header.data();
+  size_t n = header.size();
+  size_t i = *from;
+  if (i==0) {
+    // no header at all
+    if (n>=1 && p[0]=='\n') {
+      *body = 1;
+      return 0;
+    }
+    if (n>=2 && p[0]=='\r' && p[1]=='\n') {
+      *body = 2;
+      return 0;
+    }
+    if (n<2)
+      return string::npos;
+  }
+  while(true) {
+    const char *nl = (const char*)memchr(p+i, '\n', n-i);
+    if (!nl) {
+      *from = n;
+      return string::npos;
+    }
+    i = nl - p;
+    if (i+1==n || (p[i+1]=='\r' && i+2==n)) {
+      // can't tell yet
+      *from = i;
+      return string::npos;
+    }
+    if (p[i+1]=='\n') {
+      *body = i + 2;
+      return i + 1;
+    }
+    if (p[i+1]=='\r' && p[i+2]=='\n') {
+      *body = i + 3;
+      return i + 1;
+    }
+    ++i;
+  }
+}
+
+/**
+ * Add the lines in [p, e) to 'spans', turning single '\n' into "\r\n".
+ */
+static void
+emit(vector<string_view> *spans, const char *p, const char *e)
+{
+  while(p!=e) {
+    const char *nl = (const char*)memchr(p, '\n', e-p);
+    if (!nl) {
+      spans->push_back(string_view(p, e-p));
+      return;
+    }
+    if (nl!=p && nl[-1]=='\r') {
+      spans->push_back(string_view(p, nl+1-p));
+    } else {
+      spans->push_back(string_view(p, nl-p));
+      spans->push_back(string_view("\r\n", 2));
+    }
+    p = nl + 1;
+  }
+}
+
+/**
+ * Read the message from 'in' until the empty line ending its header.
+ *
+ * \param header
+ *   out: what was read, the header and the beginning of the body
+ * \param end
+ *   out: the offset of the empty line
+ * \param body
+ *   out: the offset of the body
+ */
+static bool
+readHeader(FILE *in, string *header, size_t *end, size_t *body,
+           const char **error)
+{
+  size_t from = 0;
+  while((*end=findHeaderEnd(*header, &from, body))==string::npos) {
+    // read into the buffer directly
+    size_t have = header->size();
+    header->resize(have + 16384);
+    size_t n = fread(&(*header)[have], 1, 16384, in);
+    header->resize(have + n);
+    if (n==0) {
+      *error = "missing empty line after the header";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Like readHeader() above, but with read() so that the rest of the
+ * message can be taken from 'fd' afterwards.
+ */
+static bool
+readHeader(int fd, string *header, size_t *end, size_t *body,
+           const char **error)
+{
+  size_t from = 0;
+  while((*end=findHeaderEnd(*header, &from, body))==string::npos) {
+    size_t have = header->size();
+    header->resize(have + 16384);
+    ssize_t n = read(fd, &(*header)[have], 16384);
+    header->resize(have + (n>0 ? n : 0));
+    if (n<0 && errno==EINTR)
+      continue;
+    if (n<0) {
+      *error = strerror(errno);
+      return false;
+    }
+    if (n==0) {
+      *error = "missing empty line after the header";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Rewrite the header read by readHeader() and store the envelope followed
+ * by the new header and the part of the body read along with the header
+ * in 'out'.
+ *
+ * The header is scanned field by field, the fields which are kept are
+ * copied from the read buffer.
+ *
+ * \param fromList
+ *   out: the sender taken from the From: header field
+ * \param toList
+ *   out: the recipients taken from the To:, Cc: and Bcc: header fields
+ * \param error
+ *   out: the reason when the message was rejected
+ */
+static bool
+rewriteHeader(const string &header, size_t end, size_t body, string *out,
+              const char *host, string *fromList, string *toList,
+              const char **error)
+{
+  // rewrite header
+  // - header name is case insensitive
+  // - From:
+  // - To:, Cc, Bcc
+  // - Bcc: is dropped from the header
+  // - Date: is added if missing
+  // - Message-Id: is added if missing
+  // - Received: qmail-queue is doing that for us
+  // - Return-Path: removed
+  // - Content-Length: removed
+  // - single '\n' in the header become "\r\n"
+
+  bool has_date = false;
+  bool has_message_id = false;
+  vector<string_view> spans;
+
+  const char *p = header.data();
+  const char *e = p + end;
+  while(p!=e) {
+    // the field name
+    const char *name = p;
+    while(p!=e && *p>32 && *p<127 && *p!=':')
+      ++p;
+    if (p==e || *p!=':' || p==name) {
+      *error = "Non-printable ASCII character in header field name";
+      return false;
+    }
+    size_t len = p - name;
+    const char *value = ++p;
+
+    // the field ends with a line not followed by whitespace
+    while(true) {
+      p = (const char*)memchr(p, '\n', e-p) + 1;
+      if (p==e || (*p!=' ' && *p!='\t'))
+        break;
+    }
+
+    int kind = headerKind(name, len);
+    switch(kind) {
+      case HDR_FROM:
+      case HDR_TO:
+      case HDR_CC:
+      case HDR_BCC: {
+        string *list = kind==HDR_FROM ? fromList : toList;
+        size_t before = list->size();
+        unsigned n = 0;
+        addressParser_t parser(string_view(value, p-value));
+        address_t address;
+        while(parser.next(&address)) {
+          *list += kind==HDR_FROM ? 'F' : 'T';
+          appendAddress(address, list);
+          *list += '\0';
+          ++n;
+        }
+        if (parser.error) {
+          *error = parser.error;
+          return false;
+        }
+        if (kind==HDR_FROM && (n>1 || before!=0)) {
+          *error = "only one From: entry allowed";
+          return false;
+        }
+        if (kind==HDR_BCC)
+          break;
+        emit(&spans, name, p);
+      } break;
+      case HDR_DATE:
+        has_date = true;
+        emit(&spans, name, p);
+        break;
+      case HDR_MESSAGE_ID:
+        has_message_id = true;
+        emit(&spans, name, p);
+        break;
+      case HDR_RETURN_PATH:
+      case HDR_CONTENT_LENGTH:
+        break;
+      default:
+        emit(&spans, name, p);
+    }
+  }
+
+  out->reserve(fromList->size() + toList->size() + header.size() + 256);
+  char accepted[32];
+  snprintf(accepted, sizeof(accepted), "A%llu", (unsigned long long)traceClock());
+  out->append(accepted, strlen(accepted) + 1);
+  *out += *fromList;
+  *out += *toList;
+  *out += '\0';
+  for(vector<string_view>::const_iterator s = spans.begin(); s != spans.end(); ++s)
+    out->append(s->data(), s->size());
+  char line[512];
+  if (!has_message_id) {
+    // several messages are created per second
+    static std::atomic<unsigned> sequence(0);
+    snprintf(line, sizeof(line), "Message-Id: <%lu.%lu.%u.mailgrave@%s>\r\n",
+             (u_long)time(NULL), (u_long)getpid(), sequence++, host);
+    *out += line;
+  }
+  if (!has_date) {
+    char str[256];
+    time_t now = time(NULL);
+    if (strftime(str, sizeof(str), "%a, %d %b %Y %T %z",
+                 localtime(&now)) == 0)
+    {
+      perror("strftime");
+    }
+    snprintf(line, sizeof(line), "Date: %s\r\n", str);
+    *out += line;
+  }
+  *out += "\r\n";
+
+  // the beginning of the body
+  out->append(header, body, string::npos);
+  return true;
+}
+
+/**
+ * Rewrite the header of the message read from 'in' and write the envelope
+ * followed by the message to 'out' the way mailgrave-queue expects it.
+ *
+ * \param fromList
+ *   out: the sender taken from the From: header field
+ * \param toList
+ *   out: the recipients taken from the To:, Cc: and Bcc: header fields
+ * \param error
+ *   out: the reason when the message was rejected
+ */
+bool
+rewriteMessage(FILE *in, FILE *out, const char *host,
+               string *fromList, string *toList, const char **error)
+{
+  string header, head;
+  size_t end, body;
+  if (!readHeader(in, &header, &end, &body, error) ||
+      !rewriteHeader(header, end, body, &head, host, fromList, toList, error))
+  {
+    return false;
+  }
+  fwrite(head.data(), head.size(), 1, out);
+
+  // the body
+  while(true) {
+    char block[65536];
+    size_t n = fread(block, 1, sizeof(block), in);
+    if (n==0)
+      break;
+    fwrite(block, n, 1, out);
+  }
+  return true;
+}
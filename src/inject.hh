@@ -0,0 +1,76 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <sys/param.h>
+
+#include <string>
+#include <deque>
+#include <utility>
+
+/*
+ * libmailgrave-inject: hand messages to mailgrave-queue from within an
+ * application instead of running mailgrave-inject for each of them.
+ *
+ * The header of each message is rewritten like mailgrave-inject does it:
+ * the envelope is taken from the From:, To:, Cc: and Bcc: header fields,
+ * Bcc:, Return-Path: and Content-Length: are removed and Date: and
+ * Message-Id: are added when missing.
+ *
+ * The messages are sent over one connection to mailgrave-queue, which is
+ * kept open between the calls and opened again when it was lost. Either
+ * wait for the queue's answer to each message with injectMessage() or
+ * send several messages with injectSend() and collect the answers, in the
+ * same order, with injectAnswer().
+ *
+ * Only the header passes through the library. The body is sent from the
+ * caller's memory, with sendfile() when the message is read from a
+ * regular file or with splice() when it is read from a pipe.
+ *
+ * An inject_t must not be used by several threads at the same time.
+ */
+
+struct inject_t
+{
+  inject_t();
+  ~inject_t();
+
+  const char *socket;        // mailgrave-queue's socket, 'queue.ctrl'
+  const char *error;         // why the last call failed
+
+  int sock;                  // -1 when not connected
+  unsigned pending;          // messages sent without an answer yet
+  // connections which are no longer used for sending, each with the number
+  // of answers it still owes. These answers come before those on 'sock'.
+  std::deque<std::pair<int, unsigned> > drain;
+  unsigned owed;             // the answers owed by 'drain'
+  char host[MAXHOSTNAMELEN]; // for the Message-Id
+};
+
+bool injectMessage(inject_t *inject, const char *data, size_t size);
+bool injectMessage(inject_t *inject, FILE *in);
+bool injectMessage(inject_t *inject, int fd);
+bool injectSend(inject_t *inject, const char *data, size_t size);
+bool injectSend(inject_t *inject, FILE *in);
+int injectAnswer(inject_t *inject, bool wait);
+void injectClose(inject_t *inject);
+
+bool rewriteMessage(FILE *in, FILE *out, const char *host,
+                    std::string *fromList, std::string *toList,
+                    const char **error);
@@ -0,0 +1,498 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.hh"
+
+unsigned log_level = LEVEL_INFO;
+
+/*
+ * The ring buffer between the daemon's thread, which appends records and
+ * advances 'head', and the writer thread, which formats them and
+ * advances 'tail' once their text was written. Both count bytes since
+ * the start, the offset into the ring is their remainder. A record
+ * doesn't wrap around, the end of the ring is skipped instead.
+ */
+static const size_t LOG_RING = 262144;
+static char ring[LOG_RING] __attribute__((aligned(8)));
+static uint64_t head;           // the end of the last complete record
+static uint64_t tail;           // the end of the last written record
+static uint64_t begin;          // where logBegin() placed the record
+
+// the writer sleeps on 'wake' when the ring is empty, the daemon's thread
+// only posts when 'sleeping' is set, thus once per burst of records
+static sem_t wake;
+static unsigned sleeping;
+static bool running;            // the writer thread runs
+static bool restart;            // start a writer in the child of a fork()
+
+// text of formatted records, written when full or the ring is empty
+static char text[65536];
+static size_t textlen;
+static const size_t LOG_LINE_MAX = 16384;
+
+static void drain();
+
+/**
+ * Handle '--log-level <level>' and '--verbose', which is short for
+ * '--log-level verbose'.
+ *
+ * \return
+ *   false when argv[*i] is no logging option
+ */
+bool
+logOption(int argc, char **argv, int *i)
+{
+  if (strcmp(argv[*i], "--verbose")==0 || strcmp(argv[*i], "-v")==0) {
+    log_level = LEVEL_VERBOSE;
+  } else
+  if (strcmp(argv[*i], "--log-level")==0) {
+    if (*i+1 >= argc) {
+      fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[*i]);
+      exit(EXIT_FAILURE);
+    }
+    const char *level = argv[++(*i)];
+    if (strcmp(level, "error")==0)
+      log_level = LEVEL_ERROR;
+    else if (strcmp(level, "info")==0)
+      log_level = LEVEL_INFO;
+    else if (strcmp(level, "verbose")==0)
+      log_level = LEVEL_VERBOSE;
+    else {
+      fprintf(stderr, "%s: unknown log level '%s'\n", argv[0], level);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void
+wakeWriter()
+{
+  if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+    sem_post(&wake);
+}
+
+static void
+nap()
+{
+  timespec ts = { 0, 100000 };
+  nanosleep(&ts, 0);
+}
+
+/**
+ * Reserve 'size' bytes for a record, waiting for the writer while the
+ * ring is full. Before logStart() the ring is emptied right away.
+ */
+char*
+logBegin(size_t size)
+{
+  if (restart)
+    logStart();
+  uint64_t h = head;
+  size_t offset = h % LOG_RING;
+  size_t need = size;
+  if (offset + size > LOG_RING)
+    need += LOG_RING - offset;
+  while(LOG_RING - (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) < need) {
+    if (!running) {
+      drain();
+      continue;
+    }
+    wakeWriter();
+    nap();
+  }
+  if (offset + size > LOG_RING) {
+    // the header's first 8 bytes tell the writer to skip the rest
+    uint32_t skip[2] = { (uint32_t)(LOG_RING - offset), LOG_SKIP };
+    memcpy(ring + offset, skip, sizeof(skip));
+    h += LOG_RING - offset;
+  }
+  begin = h;
+  return ring + h % LOG_RING;
+}
+
+/**
+ * Publish the record reserved with logBegin().
+ */
+void
+logEnd(size_t size)
+{
+  __atomic_store_n(&head, begin + size, __ATOMIC_SEQ_CST);
+  if (running)
+    wakeWriter();
+  else
+    drain();
+}
+
+/**
+ * Log the bytes of a dialog, see LOG_BYTES().
+ */
+void
+logBytes(const char *data, size_t size)
+{
+  while(size) {
+    size_t n = size < LOG_STRING_MAX ? size : LOG_STRING_MAX;
+    size_t rsize = sizeof(logrecord_t) + logPad(n);
+    char *p = logBegin(rsize);
+    logrecord_t *r = (logrecord_t*)p;
+    r->size = rsize;
+    r->kind = LOG_DATA;
+    r->length = n;
+    memcpy(p + sizeof(logrecord_t), data, n);
+    logEnd(rsize);
+    data += n;
+    size -= n;
+  }
+}
+
+/*
+ * Formatting
+ */
+
+struct logargs_t
+{
+  const char *p, *end;
+};
+
+static uint64_t
+nextArg(logargs_t *a)
+{
+  uint64_t v = 0;
+  if (a->p + 8 <= a->end) {
+    memcpy(&v, a->p, 8);
+    a->p += 8;
+  }
+  return v;
+}
+
+/**
+ * Append the output of snprintf() which returned 'r' to 'text'.
+ */
+static void
+added(int r, size_t *n, size_t size)
+{
+  if (r<0)
+    return;
+  *n += (size_t)r < size - *n ? r : size - *n - 1;
+}
+
+/**
+ * Format a LOG_FORMAT record like printf() would have done, converting
+ * one argument at a time.
+ */
+static size_t
+formatRecord(const logrecord_t *r, char *out, size_t size)
+{
+  logargs_t args = { (const char*)(r+1), (const char*)r + r->size };
+  const char *f = r->format;
+  size_t n = 0;
+  while(*f && n+1 < size) {
+    if (*f!='%') {
+      out[n++] = *f++;
+      continue;
+    }
+    ++f;
+    if (*f=='%') {
+      out[n++] = *f++;
+      continue;
+    }
+    // '%', flags and width, the precision is kept apart for strings
+    char spec[64];
+    size_t k = 0;
+    spec[k++] = '%';
+    while(*f && strchr("-+ #0", *f) && k<8)
+      spec[k++] = *f++;
+    if (*f=='*') {
+      ++f;
+      k += snprintf(spec+k, 16, "%d", (int)nextArg(&args));
+    } else {
+      while(*f>='0' && *f<='9' && k<24)
+        spec[k++] = *f++;
+    }
+    int precision = -1;
+    if (*f=='.') {
+      ++f;
+      if (*f=='*') {
+        ++f;
+        precision = (int)nextArg(&args);
+      } else {
+        precision = 0;
+        while(*f>='0' && *f<='9')
+          precision = precision * 10 + *f++ - '0';
+      }
+    }
+    if (precision>=0 && *f!='s')
+      k += snprintf(spec+k, 16, ".%d", precision);
+    // the length only tells the width of unsigned values
+    unsigned bits = 32;
+    while(*f && strchr("hlLqjzt", *f)) {
+      bits = *f=='h' ? (bits==16 ? 8 : 16) : 64;
+      ++f;
+    }
+    char conversion = *f;
+    if (!conversion)
+      break;
+    ++f;
+    uint64_t v;
+    switch(conversion) {
+      case 'd':
+      case 'i':
+        strcpy(spec+k, "lld");
+        added(snprintf(out+n, size-n, spec, (long long)nextArg(&args)), &n, size);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        v = nextArg(&args);
+        if (bits<64)
+          v &= ((uint64_t)1 << bits) - 1;
+        spec[k++] = 'l';
+        spec[k++] = 'l';
+        spec[k++] = conversion;
+        spec[k] = 0;
+        added(snprintf(out+n, size-n, spec, (unsigned long long)v), &n, size);
+        break;
+      case 'c':
+        strcpy(spec+k, "c");
+        added(snprintf(out+n, size-n, spec, (int)nextArg(&args)), &n, size);
+        break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A': {
+        double d;
+        v = nextArg(&args);
+        memcpy(&d, &v, 8);
+        spec[k++] = conversion;
+        spec[k] = 0;
+        added(snprintf(out+n, size-n, spec, d), &n, size);
+      } break;
+      case 's': {
+        v = nextArg(&args);
+        const char *s = "(null)";
+        size_t length = 6;
+        if (v!=~(uint64_t)0) {
+          s = args.p;
+          length = v;
+          args.p += logPad(v);
+          if (args.p > args.end) {
+            args.p = args.end;
+            length = 0;
+          }
+        }
+        if (precision<0 || (size_t)precision>length)
+          precision = length;
+        strcpy(spec+k, ".*s");
+        added(snprintf(out+n, size-n, spec, precision, s), &n, size);
+      } break;
+      case 'p':
+        strcpy(spec+k, "p");
+        added(snprintf(out+n, size-n, spec, (void*)(uintptr_t)nextArg(&args)), &n, size);
+        break;
+    }
+  }
+  return n;
+}
+
+/**
+ * Format a LOG_DATA record, '\r', '\n' and '\0' are made visible and
+ * each '\n' also ends the line.
+ */
+static size_t
+formatData(const logrecord_t *r, char *out, size_t size)
+{
+  const char *p = (const char*)(r+1);
+  size_t n = 0;
+  for(const char *e = p + r->length; p != e && n+3 < size; ++p) {
+    switch(*p) {
+      case '\r':
+        out[n++] = '\\';
+        out[n++] = 'r';
+        break;
+      case '\n':
+        out[n++] = '\\';
+        out[n++] = 'n';
+        out[n++] = '\n';
+        break;
+      case '\0':
+        out[n++] = '\\';
+        out[n++] = '0';
+        break;
+      default:
+        out[n++] = *p;
+    }
+  }
+  return n;
+}
+
+/**
+ * Write the formatted text and release the records up to 'upto'.
+ */
+static void
+writeText(uint64_t upto)
+{
+  for(size_t written = 0; written < textlen; ) {
+    ssize_t r = write(STDOUT_FILENO, text + written, textlen - written);
+    if (r<0 && errno==EINTR)
+      continue;
+    if (r<=0)
+      break;   // nowhere to log to, drop the text
+    written += r;
+  }
+  textlen = 0;
+  __atomic_store_n(&tail, upto, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format and write all complete records.
+ */
+static void
+drain()
+{
+  uint64_t t = tail;
+  uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  if (t==h)
+    return;
+  while(t!=h) {
+    if (textlen + LOG_LINE_MAX > sizeof(text))
+      writeText(t);
+    const logrecord_t *r = (const logrecord_t*)(ring + t % LOG_RING);
+    char *out = text + textlen;
+    switch(r->kind) {
+      case LOG_FORMAT:
+        textlen += formatRecord(r, out, LOG_LINE_MAX);
+        break;
+      case LOG_DATA:
+        textlen += formatData(r, out, LOG_LINE_MAX);
+        break;
+    }
+    t += r->size;
+  }
+  writeText(t);
+}
+
+static void*
+writer(void*)
+{
+  while(true) {
+    drain();
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&head, __ATOMIC_SEQ_CST)==tail) {
+      while(sem_wait(&wake)!=0 && errno==EINTR)
+        ;
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/**
+ * Wait until all records were written.
+ */
+void
+logFlush()
+{
+  if (!running)
+    return;
+  uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  while(__atomic_load_n(&tail, __ATOMIC_ACQUIRE)!=h) {
+    wakeWriter();
+    nap();
+  }
+}
+
+/**
+ * The writer thread isn't copied by fork(), the child starts its own
+ * once it logs.
+ */
+static void
+forked()
+{
+  if (running) {
+    running = false;
+    restart = true;
+  }
+}
+
+/**
+ * Write what is left before a signal terminates the daemon.
+ */
+static void
+onSignal(int sig)
+{
+  logFlush();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+ * Start the writer thread. Until then, and when it can't be started, the
+ * records are written at once.
+ */
+void
+logStart()
+{
+  static bool once = false;
+  restart = false;
+  if (running)
+    return;
+  if (!once) {
+    once = true;
+    pthread_atfork(logFlush, 0, forked);
+    atexit(logFlush);
+    int sigs[] = { SIGTERM, SIGINT, SIGHUP };
+    for(unsigned i=0; i<sizeof(sigs)/sizeof(sigs[0]); ++i) {
+      struct sigaction sa;
+      if (sigaction(sigs[i], 0, &sa)==0 && sa.sa_handler==SIG_DFL)
+        signal(sigs[i], onSignal);
+    }
+  }
+  drain();
+  sem_init(&wake, 0, 0);
+  sleeping = 0;
+
+  // the writer takes no signals, they stay with the daemon's thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int r = pthread_create(&thread, 0, writer, 0);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  if (r!=0) {
+    fprintf(stderr, "failed to start the log writer: %s\n", strerror(r));
+    return;
+  }
+  pthread_detach(thread);
+  running = true;
+}
@@ -0,0 +1,159 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <type_traits>
+
+/*
+ * Logging of the daemons. LOG() stores the address of the format string
+ * and the arguments as a binary record in a ring buffer. A background
+ * thread started by logStart() formats the records and writes them to
+ * stdout in large blocks, thus the daemon doesn't make a system call per
+ * line. The output is the text printf() would have printed, one line per
+ * message as svlogd expects it. Before logStart() the records are written
+ * at once.
+ *
+ * A record above 'log_level' costs a compare, its arguments aren't
+ * evaluated. Levels above LOG_MAX_LEVEL are removed at compile time.
+ *
+ * The format must be a string literal, the records only keep its
+ * address. Strings are copied, up to LOG_STRING_MAX bytes each. Only one
+ * thread of a process may log.
+ */
+
+enum {
+  LEVEL_ERROR,          // failures
+  LEVEL_INFO,           // what happens to each message
+  LEVEL_VERBOSE         // the dialogs with other hosts
+};
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LEVEL_VERBOSE
+#endif
+
+extern unsigned log_level;
+
+#define LOG_ENABLED(level) ((level)<=LOG_MAX_LEVEL && (level)<=log_level)
+
+#define LOG(level, format, ...) \
+  do { \
+    if (LOG_ENABLED(level)) \
+      logRecord("" format, ##__VA_ARGS__); \
+    if (false) \
+      printf(format, ##__VA_ARGS__); /* the compiler checks the format */ \
+  } while(0)
+
+// log 'size' bytes of a dialog, '\r', '\n' and '\0' are made visible
+#define LOG_BYTES(level, data, size) \
+  do { \
+    if (LOG_ENABLED(level)) \
+      logBytes((data), (size)); \
+  } while(0)
+
+static const size_t LOG_STRING_MAX = 4096;
+
+enum {
+  LOG_FORMAT,           // a format followed by its arguments
+  LOG_DATA,             // bytes of a dialog
+  LOG_SKIP              // the rest of the ring buffer is unused
+};
+
+struct logrecord_t
+{
+  uint32_t size;        // of the record including this header, a multiple of 8
+  uint32_t kind;
+  union {
+    const char *format; // LOG_FORMAT, followed by 8 bytes per argument,
+                        // strings by their length and the padded bytes
+    uint64_t length;    // LOG_DATA, followed by the padded bytes
+  };
+};
+
+bool logOption(int argc, char **argv, int *i);
+void logStart();
+void logFlush();
+char* logBegin(size_t size);
+void logEnd(size_t size);
+void logBytes(const char *data, size_t size);
+
+static inline size_t
+logPad(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+template<typename T>
+static inline size_t
+logArgSize(T value)
+{
+  if constexpr (std::is_convertible<T, const char*>::value) {
+    size_t n = value ? strnlen(value, LOG_STRING_MAX) : 0;
+    return 8 + logPad(n);
+  }
+  return 8;
+}
+
+template<typename T>
+static inline char*
+logArgPut(char *p, T value)
+{
+  if constexpr (std::is_convertible<T, const char*>::value) {
+    // a null pointer is stored with the length ~0
+    uint64_t n = value ? strnlen(value, LOG_STRING_MAX) : ~(uint64_t)0;
+    memcpy(p, &n, 8);
+    if (!value)
+      return p + 8;
+    memcpy(p + 8, value, n);
+    return p + 8 + logPad(n);
+  } else
+  if constexpr (std::is_floating_point<T>::value) {
+    double d = value;
+    memcpy(p, &d, 8);
+  } else
+  if constexpr (std::is_pointer<T>::value) {
+    uint64_t v = (uintptr_t)value;
+    memcpy(p, &v, 8);
+  } else {
+    // integers are sign extended, the format tells their width
+    int64_t v = value;
+    memcpy(p, &v, 8);
+  }
+  return p + 8;
+}
+
+/**
+ * Store a record, use LOG() instead.
+ */
+template<typename... A>
+static inline void
+logRecord(const char *format, A... args)
+{
+  size_t size = sizeof(logrecord_t) + (logArgSize(args) + ... + 0);
+  char *p = logBegin(size);
+  logrecord_t *r = (logrecord_t*)p;
+  r->size = size;
+  r->kind = LOG_FORMAT;
+  r->format = format;
+  p += sizeof(logrecord_t);
+  ((p = logArgPut(p, args)), ...);
+  logEnd(size);
+}
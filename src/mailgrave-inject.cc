@@ -26,7 +26,7 @@
  *
  */
 
-#include "opensocket.hh"
+#include "inject.hh"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -34,6 +34,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <sys/wait.h>
@@ -41,11 +42,19 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
 using std::string;
+using std::vector;
+using std::deque;
 
-extern unsigned parseAddress(FILE *in, string *r, char c, bool z, string *o);
+static int injectBatch(FILE *in, const char *source, const char *dir,
+                       const char *name, bool dryrun);
 
 static void
 usage()
@@ -66,6 +75,14 @@ usage()
     "    The socket of mailgrave-queue.\n"
     "  --dry-run\n"
     "    Print result instead of putting it into the queue.\n"
+    "  --mbox\n"
+    "    Read a batch of messages in mbox format instead of a single one.\n"
+    "  --dir <directory>\n"
+    "    Read a batch of messages, one per file in the directory.\n"
+    "\n"
+    "  A batch is sent to mailgrave-queue over a single connection. One\n"
+    "  line is printed per message:\n"
+    "    <number> TAB ok|failed TAB <source> [TAB <reason>]\n"
   );
 }
 
@@ -76,6 +93,8 @@ main(int argc, char **argv)
 
   const char *filename = 0;
   bool dryrun = false;
+  bool mbox = false;
+  const char *dir = 0;
   const char *name = "queue.ctrl";
 
   // parse argument list
@@ -97,6 +116,16 @@ main(int argc, char **argv)
     if (strcmp(argv[i], "--dry-run")==0) {
       dryrun = true;
     } else
+    if (strcmp(argv[i], "--mbox")==0) {
+      mbox = true;
+    } else
+    if (strcmp(argv[i], "--dir")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      dir = argv[++i];
+    } else
     if (strcmp(argv[i], "--help")==0) {
       usage();
       return EXIT_SUCCESS;
@@ -118,11 +147,6 @@ main(int argc, char **argv)
     }
   }
 
-  char host[MAXHOSTNAMELEN];
-  if (gethostname(host, sizeof(host)) == -1) {
-    perror("gethostname");
-    return EXIT_FAILURE;
-  }
   
   const char *user = "anonymous";
   struct passwd *pw;
@@ -133,275 +157,26 @@ main(int argc, char **argv)
     }
   }
   
-  bool expand_lf2crlf = true;
-  
-  FILE *out = stdout;
-
-  // open mailgrave-queue's socket to deliver mail
-  int sock = -1;
-  if (!dryrun) {
-    sock = openUNIXSocket(name);
-    if (sock<0) {
-      exit(EXIT_FAILURE);
-    }
-    out = fdopen(sock, "w");
+  if (mbox || dir) {
+    return injectBatch(dir ? 0 : in, filename ? filename : "-", dir,
+                       name, dryrun);
   }
-  
-  // rewrite header
-  // - header name is case insensitive
-  // - From:
-  // - To:, Cc, Bcc
-  // - Bcc: is dropped from the header
-  // - Date: is added if missing
-  // - Message-Id: is added if missing
-  // - Received: qmail-queue is doing that for us
-  // - Return-Path: removed
-  // - Content-Length: removed
-  
-  char buffer[20];
-  char lbuffer[20];
-  size_t bp = 0;
-
-  string toList;
-  string fromList;
-
-  bool has_date = false;
-  bool has_message_id = false;
-
-  enum {
-    STATE_HEADER_FIELD_NAME,
-    
-    STATE_COPY,
-    STATE_COPY_0,
-    STATE_COPY_1,
-    
-    STATE_DROP,
-    STATE_DROP_0,
-    STATE_DROP_1,
-    
-    STATE_EMAIL,
-    
-    STATE_DATA,
-    STATE_DATA_0,
-    STATE_DATA_1
-  } state = STATE_HEADER_FIELD_NAME;
-  
-  bool drop;
-  bool from;
-  string header;
-
-  while(true) {
-    int c = getc_unlocked(in);
-    if (c==EOF)
-      break;
-//printf("main: %i '%c' '%i'\n", state, c, c);
-    switch(state) {
-      case STATE_HEADER_FIELD_NAME:
-        if (expand_lf2crlf && c=='\n') {
-          fwrite(fromList.data(), fromList.size(), 1, out);
-          fwrite(toList.data(), toList.size(), 1, out);
-          putc_unlocked(0, out);
-          fwrite(header.data(), header.size(), 1, out);
-          header.clear();
-          state = STATE_DATA_0;
-          break;
-        }
-        if (c=='\r') {
-          fwrite(fromList.data(), fromList.size(), 1, out);
-          fwrite(toList.data(), toList.size(), 1, out);
-          putc_unlocked(0, out);
-          fwrite(header.data(), header.size(), 1, out);
-          header.clear();
-          state = STATE_DATA;
-          break;
-        }
-        if (c<=32 || c>=126) {
-          fprintf(stderr, "Non-printable ASCII character in header field name\n");
-          exit(EXIT_FAILURE);
-        }
-        if (c==':') {
-          drop = false;
-          from = false;
-          lbuffer[bp] = 0;
-          if (strcmp(lbuffer, "from")==0) {
-            state = STATE_EMAIL;
-            from = true;
-          } else
-          if (strcmp(lbuffer, "to")==0) {
-            state = STATE_EMAIL;
-          } else
-          if (strcmp(lbuffer, "cc")==0) {
-            state = STATE_EMAIL;
-          } else
-          if (strcmp(lbuffer, "bcc")==0) {
-            state = STATE_EMAIL;
-            drop = true;
-          } else
-          if (strcmp(lbuffer, "date")==0) {
-            has_date = true;
-            state = STATE_COPY;
-          } else
-          if (strcmp(lbuffer, "message-id")==0) {
-            has_message_id = true;
-            state = STATE_COPY;
-          } else
-          if (strcmp(lbuffer, "return-path")==0) {
-            state = STATE_DROP;
-          } else
-          if (strcmp(lbuffer, "content-length")==0) {
-            state = STATE_DROP;
-          } else {
-            state = STATE_COPY;
-          }
-          if (!drop) {
-            buffer[bp] = ':';
-            // fwrite(buffer, bp+1, 1, out);
-            header.append(buffer, bp+1);
-          }
-          bp = 0;
-          if (state == STATE_EMAIL) {
-            string addresses;
-            string o;
-            unsigned n = parseAddress(in, &addresses, from ? 'F' : 'T', true, &o);
-            if (!drop) {
-              // fprintf(out, "%s", o.c_str());
-              header.append(o);
-            }
-            if (from) {
-              if (n>1 || !fromList.empty()) {
-                fprintf(stderr, "only one From: entry allowed\n");
-                exit(EXIT_FAILURE);
-              }
-              fromList += addresses;
-            } else {
-              toList += addresses;
-            }
-            state = STATE_HEADER_FIELD_NAME;
-            continue;
-          }
-          break;
-        }
-        buffer[bp] = c;
-        lbuffer[bp] = tolower(c);
-        ++bp;
-        if (bp==sizeof(buffer)-1) {
-          state = STATE_COPY;
-          bp = 0;
-        }
-        break;
-
-      case STATE_COPY:
-        if (expand_lf2crlf && c=='\n') {
-          //putc_unlocked('\r', out);
-          //putc_unlocked('\n', out);
-          header += "\r\n";
-          state = STATE_COPY_1;
-          break;
-        }
-        // putc_unlocked(c, out);
-        header += c;
-        if (c=='\r')
-          state = STATE_COPY_0;
-        break;
-      case STATE_COPY_0:
-        // putc_unlocked(c, out);
-        header += c;
-        if (c=='\n')
-          state = STATE_COPY_1;
-        if (c!='\r')
-          state = STATE_COPY;
-        break;
-      case STATE_COPY_1:
-        if (c==' ' || c=='\t') {
-          // putc_unlocked(c, out);
-          header += c;
-          state = STATE_COPY;
-        } else {
-          ungetc(c, in);
-          state = STATE_HEADER_FIELD_NAME;
-        }
-        break;
 
-      case STATE_DROP:
-        if (expand_lf2crlf && c=='\n') {
-          state = STATE_DROP_1;
-          break;
-        }
-        if (c=='\r')
-          state = STATE_DROP_0;
-        break;
-      case STATE_DROP_0:
-        if (c=='\n')
-          state = STATE_DROP_1;
-        if (c!='\r')
-          state = STATE_DROP;
-        break;
-      case STATE_DROP_1:
-        if (c==' ' || c=='\t') {
-          state = STATE_DROP;
-        } else {
-          ungetc(c, in);
-          state = STATE_HEADER_FIELD_NAME;
-        }
-        break;
+  inject_t inject;
+  inject.socket = name;
 
-      case STATE_DATA:
-        if (c!='\n') {
-          fprintf(stderr, "Non-printable ASCII character in header field name\n");
-          exit(1);
-        }
-        putc_unlocked('\n', out);
-        state = STATE_DATA_0;
-        break;
-      case STATE_DATA_0:
-        if (!has_message_id) {
-          fprintf(out, "Message-Id: <%lu.%lu.mailgrave@%s>\r\n",
-                       (u_long)time(NULL), (u_long)getpid(), host);
-        }
-        if (!has_date) {
-          char str[256];
-          time_t now = time(NULL);
-          if (strftime(str, sizeof(str), "%a, %d %b %Y %T %z",
-                       localtime(&now)) == 0)
-          {
-            perror("strftime");
-          }
-          fprintf(out, "Date: %s\r\n", str);
-        }
-        putc_unlocked('\r', out);
-        putc_unlocked('\n', out);
-        putc_unlocked(c, out);
-        state = STATE_DATA_1;
-        break;
-      case STATE_DATA_1:
-        putc_unlocked(c, out);
-        break;
-      default:
-        fprintf(stderr, "unexpected parser state\n");
-        exit(EXIT_FAILURE);
-    }
-  }
-  
   if (!dryrun) {
-    // shutdown write connection to the queue to signal end of data and
-    // read the result code
-    fflush(out);
-
-    char result;
-    if (shutdown(sock, SHUT_WR)==-1) {
-      perror("mailgrave-inject: shutdown");
+    if (!injectMessage(&inject, fileno(in))) {
+      fprintf(stderr, "mailgrave-inject: %s\n", inject.error);
       exit(EXIT_FAILURE);
-    } else
-    if (read(sock, &result, 1)!=1) {
-      perror("mailgrave-inject: unabled to read queue process result\n");
-      exit(EXIT_FAILURE);
-    } else
-    if (!result) {
-      fprintf(stderr, "mailgrave-inject: delivery to queue failed\n");
-      exit(EXIT_FAILURE);
-    };
-    fclose(out);
+    }
   } else {
+    string fromList, toList;
+    const char *error = 0;
+    if (!rewriteMessage(in, stdout, inject.host, &fromList, &toList, &error)) {
+      fprintf(stderr, "%s\n", error);
+      exit(EXIT_FAILURE);
+    }
     for(string::const_iterator p = fromList.begin();
         p != fromList.end();
         ++p)
@@ -430,3 +205,266 @@ main(int argc, char **argv)
 
   return EXIT_SUCCESS;
 }
+
+/*
+ * Batch mode: all messages are sent over one connection to
+ * mailgrave-queue, without waiting for its answer to the previous message.
+ */
+
+struct pending_t
+{
+  string message;          // number and source
+  bool failed;             // the message didn't reach the queue
+  string error;            // why, copied as strerror() reuses its buffer
+};
+
+struct batch_t
+{
+  inject_t inject;
+  bool dryrun;
+  unsigned count, failed;
+  deque<pending_t> pending; // results not printed yet, in order
+};
+
+/**
+ * Number the next message of the batch for its result line.
+ */
+static string
+numbered(batch_t *batch, const string &source)
+{
+  char number[32];
+  snprintf(number, sizeof(number), "%u\t", ++batch->count);
+  return number + source;
+}
+
+/**
+ * Print the result of a message.
+ */
+static void
+result(batch_t *batch, const string &message, bool ok, const char *reason)
+{
+  if (ok) {
+    printf("%s\tok\n", message.c_str());
+  } else {
+    printf("%s\tfailed\t%s\n", message.c_str(), reason);
+    ++batch->failed;
+  }
+}
+
+/**
+ * Remember the result of a message until the results of the messages in
+ * front of it are known.
+ */
+static void
+pending(batch_t *batch, const string &message, const char *error)
+{
+  if (batch->dryrun) {
+    result(batch, message, !error, error);
+    return;
+  }
+  pending_t p;
+  p.message = message;
+  p.failed = error!=0;
+  if (error)
+    p.error = error;
+  batch->pending.push_back(p);
+}
+
+/**
+ * Fetch the queue's answers and print the results known so far.
+ *
+ * \param wait
+ *   wait until all answers arrived
+ */
+static void
+readAnswers(batch_t *batch, bool wait)
+{
+  while(true) {
+    while(!batch->pending.empty() && batch->pending.front().failed) {
+      result(batch, batch->pending.front().message, false,
+             batch->pending.front().error.c_str());
+      batch->pending.pop_front();
+    }
+    if (batch->pending.empty())
+      return;
+    int r = injectAnswer(&batch->inject, wait);
+    if (r<0)
+      return;
+    result(batch, batch->pending.front().message, r, batch->inject.error);
+    batch->pending.pop_front();
+  }
+}
+
+/**
+ * Rewrite one message of the batch and send it to the queue.
+ *
+ * \param data
+ *   the message 'in' reads from when it is in memory, otherwise 0
+ * \param source
+ *   where the message came from, for the result
+ */
+static void
+batchMessage(batch_t *batch, FILE *in, const string *data,
+             const string &source)
+{
+  string message = numbered(batch, source);
+
+  if (batch->dryrun) {
+    char *data = 0;
+    size_t size = 0;
+    FILE *mem = open_memstream(&data, &size);
+    if (!mem) {
+      pending(batch, message, strerror(errno));
+      return;
+    }
+    string fromList, toList;
+    const char *error = 0;
+    bool ok = rewriteMessage(in, mem, batch->inject.host,
+                             &fromList, &toList, &error);
+    fclose(mem);
+    free(data);
+    pending(batch, message, ok ? 0 : error);
+    return;
+  }
+
+  bool ok = data ? injectSend(&batch->inject, data->data(), data->size())
+                 : injectSend(&batch->inject, in);
+  pending(batch, message, ok ? 0 : batch->inject.error);
+  readAnswers(batch, false);
+}
+
+struct mbox_t
+{
+  FILE *in;
+  char *line;
+  size_t size;
+  ssize_t len;       // length of the line, -1 when there is none
+  unsigned number;   // line number
+};
+
+static bool
+nextLine(mbox_t *mbox)
+{
+  mbox->len = getline(&mbox->line, &mbox->size, mbox->in);
+  if (mbox->len<0)
+    return false;
+  ++mbox->number;
+  return true;
+}
+
+/**
+ * Read the next message from an mbox. Lines quoted as '>From ', '>>From ',
+ * ... get one '>' removed (mboxrd).
+ *
+ * \param first
+ *   out: line number of the message's 'From ' line
+ */
+static bool
+readMbox(mbox_t *mbox, string *message, unsigned *first)
+{
+  message->clear();
+  while(true) {
+    if (mbox->len<0 && !nextLine(mbox))
+      return false;
+    if (strncmp(mbox->line, "From ", 5)==0)
+      break;
+    mbox->len = -1;
+  }
+  *first = mbox->number;
+  while(nextLine(mbox)) {
+    const char *p = mbox->line;
+    if (strncmp(p, "From ", 5)==0)
+      break;
+    const char *q = p;
+    while(*q=='>')
+      ++q;
+    if (q!=p && strncmp(q, "From ", 5)==0)
+      ++p;
+    message->append(p, mbox->line + mbox->len - p);
+  }
+  // the empty line in front of the next 'From ' line belongs to the mbox
+  size_t n = message->size();
+  if (n>=2 && message->compare(n-2, 2, "\n\n")==0)
+    message->erase(n-1);
+  else if (n>=4 && message->compare(n-4, 4, "\r\n\r\n")==0)
+    message->erase(n-2);
+  return true;
+}
+
+/**
+ * Inject the messages of an mbox or of a directory.
+ *
+ * \param in
+ *   the mbox or 0
+ * \param source
+ *   the mbox' name
+ * \param dir
+ *   the directory when 'in' is 0
+ * \param name
+ *   mailgrave-queue's socket
+ */
+int
+injectBatch(FILE *in, const char *source, const char *dir,
+            const char *name, bool dryrun)
+{
+  batch_t batch;
+  batch.inject.socket = name;
+  batch.dryrun = dryrun;
+  batch.count = batch.failed = 0;
+
+  if (in) {
+    mbox_t mbox;
+    mbox.in = in;
+    mbox.line = 0;
+    mbox.size = 0;
+    mbox.len = -1;
+    mbox.number = 0;
+    string message;
+    unsigned first;
+    while(readMbox(&mbox, &message, &first)) {
+      char where[32];
+      snprintf(where, sizeof(where), ":%u", first);
+      FILE *f = message.empty() ? 0 :
+                fmemopen((void*)message.data(), message.size(), "r");
+      if (!f) {
+        pending(&batch, numbered(&batch, source + string(where)),
+                "empty message");
+        continue;
+      }
+      batchMessage(&batch, f, &message, source + string(where));
+      fclose(f);
+    }
+    free(mbox.line);
+  } else {
+    DIR *d = opendir(dir);
+    if (!d) {
+      fprintf(stderr, "failed to open '%s': %s\n", dir, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    vector<string> files;
+    while(dirent *e = readdir(d)) {
+      if (e->d_name[0]!='.')
+        files.push_back(string(dir) + "/" + e->d_name);
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    for(vector<string>::const_iterator p = files.begin(); p != files.end(); ++p) {
+      struct stat st;
+      if (stat(p->c_str(), &st)!=0 || !S_ISREG(st.st_mode))
+        continue;
+      FILE *f = fopen(p->c_str(), "r");
+      if (!f) {
+        pending(&batch, numbered(&batch, *p), strerror(errno));
+        continue;
+      }
+      batchMessage(&batch, f, 0, *p);
+      fclose(f);
+    }
+  }
+
+  readAnswers(&batch, true);
+  injectClose(&batch.inject);
+  fprintf(stderr, "mailgrave-inject: %u messages, %u failed\n",
+          batch.count, batch.failed);
+  return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
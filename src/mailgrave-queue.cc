@@ -39,6 +39,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/file.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
@@ -49,11 +50,21 @@
 #include "createsocket.hh"
 #include "opensocket.hh"
 #include "cug.hh"
+#include "envelope.hh"
+#include "stats.hh"
+#include "trace.hh"
+#include "log.hh"
 
 unsigned long long createTail();
-bool pushQueue(FILE *in);
+bool pushQueue(FILE *in, long long *left);
 bool copyfile(int out, int in);
-static bool copystream(int fd, FILE *in, bool null);
+static bool copystream(int fd, FILE *in, long long *left, bool null);
+static bool copywire(int fd, FILE *in, long long *left, unsigned char *flags);
+static void queued(const char *argv0, int client, bool ok);
+static bool acceptedAt(FILE *in, long long *left, uint64_t *when);
+
+static bool wire = false;
+static histogram_t *push_latency;  // for mailgrave-stat
 
 static void usage()
 {
@@ -72,6 +83,17 @@ static void usage()
     "  --out <socket>\n"
     "    UNIX domain socket to open and close after a new mail was queued.\n"
     "    Defaults to 'send.ctrl'.\n"
+    "  --wire-format\n"
+    "    Store messages with CRLF line endings and dot-stuffing applied so\n"
+    "    mailgrave-remote can send them without processing each byte.\n"
+    "  --stats <file>\n"
+    "    Count the queued messages and bytes in this file for mailgrave-stat.\n"
+    "  --trace <file>\n"
+    "    Append a record to this file as each message passes a stage, see\n"
+    "    mailgrave-trace.\n"
+    "  --log-level error|info|verbose\n"
+    "    Log only up to this level, default is info. --verbose is short for\n"
+    "    --log-level verbose.\n"
     "  --chroot <directory>\n"
     "    change root directory after setup\n"
     "  --user <user>[:<group>]\n"
@@ -87,9 +109,8 @@ const char *out = "send.ctrl";
 int
 main(int argc, char **argv)
 {
-  setvbuf(stdout, 0, _IONBF, 0);
-  
   const char *in = "queue.ctrl";
+  const char *statsfile = 0;
   cug_t cug;
 
   // parse argument list
@@ -112,7 +133,27 @@ main(int argc, char **argv)
       }
       out = argv[++i];
     } else
+    if (strcmp(argv[i], "--wire-format")==0) {
+      wire = true;
+    } else
+    if (strcmp(argv[i], "--stats")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      statsfile = argv[++i];
+    } else
+    if (strcmp(argv[i], "--trace")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      if (!openTrace(argv[++i]))
+        LOG(LEVEL_ERROR, "mailgrave-queue: continuing without trace\n");
+    } else
     if (chrootOrUser(argc, argv, &i, &cug)) {
+    } else
+    if (logOption(argc, argv, &i)) {
     } else {
       fprintf(stderr, "%s: unknown argument %s, please try --help\n",
                       argv[0], argv[i]);
@@ -139,17 +180,25 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  if (statsfile && !mapStats(statsfile, "queue"))
+    LOG(LEVEL_ERROR, "mailgrave-queue: continuing without statistics\n");
+  push_latency = statHistogram("pushQueue");
+
   // change root, uid, gid
   if (!setChrootUidGid(&cug))
     return EXIT_FAILURE;
     
-  printf("mailgrave-queue started\n");
+  // the processes handling batches aren't waited for
+  signal(SIGCHLD, SIG_IGN);
+
+  logStart();
+  LOG(LEVEL_INFO, "mailgrave-queue started\n");
 
   // message loop
   while(true) {
     struct sockaddr_un addr;
     socklen_t addrlen = sizeof(addr);
-    printf("waiting for message\n");
+    LOG(LEVEL_INFO, "waiting for message\n");
     int client = accept(sock, (struct sockaddr*) &addr, &addrlen);
     if (client<0) {
       fprintf(stderr, "accept failed", strerror(errno));
@@ -162,36 +211,89 @@ main(int argc, char **argv)
       fprintf(stderr, "fdopen failed", strerror(errno));
       continue;
     }
-    printf("awoke\n");
-    if (pushQueue(in)) {
-      char x = 1;
-      write(client, &x, 1);
-      printf("got message, triggering mailgrave-send via '%s'\n", out);
-      int trigger = openUNIXSocket(out);
-      if (trigger>=0)
-        close(trigger);
-      else
-        printf("%s: failed to trigger mailgrave-send via '%s': %s\n",
-               argv[0], out, strerror(errno));
-    } else {
-      char x = 0;
-      write(client, &x, 1);
-      printf("%s: push queue failed\n", argv[0]);
+    LOG(LEVEL_INFO, "awoke\n");
+    int c = getc_unlocked(in);
+    if (c!=QUEUE_BATCH) {
+      ungetc(c, in);
+      long long left = -1;
+      queued(argv[0], client, pushQueue(in, &left));
+      fclose(in);
+      continue;
+    }
+
+    // a batch of messages, each preceded by its size. Batch connections
+    // may stay open for long, thus they get a process of their own.
+    pid_t pid = fork();
+    if (pid<0)
+      perror("fork");
+    if (pid>0) {
+      fclose(in);
+      continue;
+    }
+    unsigned n = 0;
+    long long size;
+    while(fscanf(in, "%lld", &size)==1 && getc_unlocked(in)=='\n' && size>=0) {
+      long long left = size;
+      queued(argv[0], client, pushQueue(in, &left));
+      // skip what a failed message left over
+      while(left>0 && getc_unlocked(in)!=EOF)
+        --left;
+      ++n;
     }
+    LOG(LEVEL_INFO, "batch of %u messages done\n", n);
     fclose(in);
+    if (pid==0)
+      exit(EXIT_SUCCESS);
   }
   return EXIT_SUCCESS;
 }
 
+/**
+ * Answer the client and trigger mailgrave-send when a message was queued.
+ */
+void
+queued(const char *argv0, int client, bool ok)
+{
+  char x = ok;
+  write(client, &x, 1);
+  if (!ok) {
+    LOG(LEVEL_ERROR, "%s: push queue failed\n", argv0);
+    return;
+  }
+  statAdd(&stats->queued, 1);
+  LOG(LEVEL_INFO, "got message, triggering mailgrave-send via '%s'\n", out);
+  int trigger = openUNIXSocket(out);
+  if (trigger>=0)
+    close(trigger);
+  else
+    LOG(LEVEL_ERROR, "%s: failed to trigger mailgrave-send via '%s': %s\n",
+        argv0, out, strerror(errno));
+}
+
+/**
+ * \param unixfd
+ *   the client's connection
+ * \param left
+ *   the number of bytes of envelope and message to read, which is counted
+ *   down, or -1 to read until EOF
+ */
 bool
-pushQueue(FILE *unixfd)
+pushQueue(FILE *unixfd, long long *left)
 {
+  uint64_t t0 = statClock();
+  envtrace_t stamps;
+  memset(&stamps, 0, sizeof(stamps));
+  stamps.queued = traceClock();
   // create new filenames
   time_t now;
   unsigned long long id = createTail();
   char datname[64];
   char envname[64];
   int dfd=-1, efd=-1;
+  off_t size;
+  unsigned char header[ENV_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  header[0] = ENV_TRACE;
 
   snprintf(datname, sizeof(datname), "%020llX.dat", id);
   snprintf(envname, sizeof(envname), "%020llX.env", id);
@@ -224,23 +326,71 @@ pushQueue(FILE *unixfd)
     goto error;
   }
   
-  // store envelope
-  if (write(efd, "\0\0\0\0\0\0\0\0", 8)!=8) {
-    perror("failed top write to envelope");
+  // when the client accepted the message
+  if (!acceptedAt(unixfd, left, &stamps.accepted)) {
+    fprintf(stderr, "invalid envelope\n");
     goto error;
   }
-  if (!copystream(efd, unixfd, true)) {
+
+  // store envelope, the header is written when the flags are known
+  if (lseek(efd, ENV_HEADER_SIZE + sizeof(stamps), SEEK_SET)!=
+      ENV_HEADER_SIZE + sizeof(stamps))
+  {
+    perror("failed to seek in envelope");
+    goto error;
+  }
+  if (!copystream(efd, unixfd, left, true)) {
     perror("failed to copy envelope");
     goto error;
   }
 
   // copy data
   write(dfd, received, strlen(received));
-  if (!copystream(dfd, unixfd, false)) {
+  if (wire) {
+    if (!copywire(dfd, unixfd, left, &header[0])) {
+      perror("failed to copy data");
+      goto error;
+    }
+  } else
+  if (!copystream(dfd, unixfd, left, false)) {
     perror("failed to copy data");
     goto error;
   }
+  // the copy stops at EOF, in a batch that means the client announced more
+  // than it sent
+  if (*left>0) {
+    fprintf(stderr, "message truncated, %lld bytes missing\n", *left);
+    goto error;
+  }
+
+  // there is no fsync(), the message is stored but may not survive a crash
+  stamps.stored = traceClock();
+  if (pwrite(efd, header, ENV_HEADER_SIZE, 0)!=ENV_HEADER_SIZE ||
+      pwrite(efd, &stamps, sizeof(stamps), ENV_HEADER_SIZE)!=sizeof(stamps))
+  {
+    perror("failed to write envelope header");
+    goto error;
+  }
+  size = lseek(dfd, 0, SEEK_CUR);
+  statAdd(&stats->bytes_in, size);
+
+  if (close(dfd)!=0) {
+    dfd = -1;
+    perror("failed to close queue data file");
+    goto error;
+  }
+  dfd = -1;
+  if (close(efd)!=0) {
+    efd = -1;
+    perror("failed to close envelope file");
+    goto error;
+  }
   
+  statRecord(push_latency, statClock() - t0);
+  if (stamps.accepted)
+    trace(id, TRACE_ACCEPTED, stamps.accepted, 0);
+  trace(id, TRACE_QUEUED, stamps.queued, 0);
+  trace(id, TRACE_STORED, stamps.stored, size);
   return true;
 
 error:
@@ -277,25 +427,88 @@ createTail()
   return tail;
 }
 
+/**
+ * Read the next character of the client's message.
+ *
+ * \param left
+ *   the number of bytes left, EOF is returned when it reached 0,
+ *   -1 when reading until EOF
+ */
+static inline int
+nextc(FILE *in, long long *left)
+{
+  if (*left==0)
+    return EOF;
+  int c = getc_unlocked(in);
+  if (c!=EOF && *left>0)
+    --*left;
+  return c;
+}
+
+/**
+ * Read the optional 'A' record with which a client tells when it accepted
+ * the message.
+ *
+ * \param left
+ *   see nextc()
+ * \param when
+ *   out: the time of the record, 0 when there is none
+ */
+bool
+acceptedAt(FILE *in, long long *left, uint64_t *when)
+{
+  *when = 0;
+  int c = nextc(in, left);
+  if (c!='A') {
+    if (c!=EOF) {
+      ungetc(c, in);
+      if (*left>=0)
+        ++*left;
+    }
+    return true;
+  }
+  while((c=nextc(in, left))>='0' && c<='9')
+    *when = *when * 10 + c - '0';
+  return c==0;
+}
+
 /**
  * Copy stream.
  *
  * \param fd
- *   output stream, which is closed when leaving this function
+ *   output stream
  * \param in
  *   input stream
+ * \param left
+ *   see nextc()
  * \param null
  *   when true, stop copying when two '\0' characters appeared in 
  *   the input stream, otherwise copying is stopped on EOF of input stream
  */
 bool
-copystream(int fd, FILE *in, bool null)
+copystream(int fd, FILE *in, long long *left, bool null)
 {
   char buffer[4096];
   size_t n=0;
   bool secondnull=false;
+  if (!null) {
+    // the message itself is copied block-wise
+    while(*left!=0) {
+      n = sizeof(buffer);
+      if (*left>0 && *left<(long long)n)
+        n = *left;
+      n = fread(buffer, 1, n, in);
+      if (n==0)
+        break;
+      if (*left>0)
+        *left -= n;
+      if (write(fd, buffer, n)!=(ssize_t)n)
+        return false;
+    }
+    return true;
+  }
   while(true) {
-    int c = getc_unlocked(in);
+    int c = nextc(in, left);
     if (null) {
       if (c==0) {
         if (secondnull)
@@ -309,15 +522,114 @@ copystream(int fd, FILE *in, bool null)
       if (!null) {
         break;
       }
-      close(fd);
       return false;
     }
     buffer[n++]=c;
     if (n==4096) {
-      write(fd, buffer, n);
+      if (write(fd, buffer, n)!=(ssize_t)n)
+        return false;
+      n = 0;
+    }
+  }
+  return write(fd, buffer, n)==(ssize_t)n;
+}
+
+/**
+ * Copy the message from 'in' to 'fd' in SMTP wire format, the same way
+ * mailgrave-remote's sendData() does it, but without the final ".\r\n":
+ *
+ * \li convert single '\n' to '\r\n'
+ * \li convert '\r\n.' to '\r\n..'
+ * \li terminate the last line with '\r\n'
+ *
+ * \param left
+ *   see nextc()
+ * \param flags
+ *   out: ENV_WIRE and, when no line began with a '.', ENV_NODOTS are set
+ */
+bool
+copywire(int fd, FILE *in, long long *left, unsigned char *flags)
+{
+  char buffer[4096+2];
+  size_t n=0;
+  bool dots = false;
+  unsigned state = 0;
+  while(state!=100) {
+    int c = nextc(in, left);
+    switch(state) {
+      case 0: // BOL
+        switch(c) {
+          case EOF:
+            state = 100;
+            break;
+          case '\n':
+            buffer[n++] = '\r';
+            buffer[n++] = c;
+            break;
+          case '\r':
+            buffer[n++] = c;
+            state = 2;
+            break;
+          case '.':
+            dots = true;
+            buffer[n++] = '.';
+            buffer[n++] = c;
+            state = 1;
+            break;
+          default:
+            buffer[n++] = c;
+            state = 1;
+        }
+        break;
+      case 1: // behind BOL
+        switch(c) {
+          case EOF:
+            buffer[n++] = '\r';
+            buffer[n++] = '\n';
+            state = 100;
+            break;
+          case '\n':
+            buffer[n++] = '\r';
+            buffer[n++] = c;
+            state = 0;
+            break;
+          case '\r':
+            buffer[n++] = c;
+            state = 2;
+            break;
+          default:
+            buffer[n++] = c;
+        }
+        break;
+      case 2: // behind '\r'
+        switch(c) {
+          case EOF:
+            buffer[n++] = '\n';
+            state = 100;
+            break;
+          case '\n':
+            buffer[n++] = c;
+            state = 0;
+            break;
+          case '\r':
+            buffer[n++] = c;
+            break;
+          default:
+            buffer[n++] = c;
+            state = 1;
+        }
+        break;
+    }
+    if (n>=4096) {
+      if (write(fd, buffer, n)!=(ssize_t)n)
+        return false;
       n = 0;
     }
   }
-  write(fd, buffer, n);
-  return close(fd)==0;
+  if (write(fd, buffer, n)!=(ssize_t)n)
+    return false;
+  *flags |= ENV_WIRE;
+  if (!dots)
+    *flags |= ENV_NODOTS;
+  return true;
 }
@@ -4,12 +4,12 @@
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation; either version 2 of the License, or   
+ * the Free Software Foundation; either version 2 of the License, or
  * (at your option) any later version.
  *
  * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of 
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  *
  * You should have received a copy of the GNU General Public License
@@ -17,12 +17,23 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/*
+ * mailgrave-remote runs all SMTP client sessions in a single process: jobs
+ * are accepted from remote.ctrl, queued per destination and handed to
+ * sessions, which are state machines driven by a poll() loop. A session
+ * which finished a job stays connected for a while to take the next job
+ * for the same destination.
+ */
+
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -31,17 +42,36 @@
 #include <sys/socket.h>
 #include <sys/file.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 
 #include "createsocket.hh"
 #include "cug.hh"
+#include "handoff.hh"
+#include "envelope.hh"
+#include "deadline.hh"
+#include "resolver.hh"
+#include "health.hh"
+#include "stats.hh"
+#include "reply.hh"
+#include "wire.hh"
+#include "tls.hh"
+#include "log.hh"
 
 using std::string;
 using std::vector;
+using std::deque;
+using std::map;
 
-// RFC 2821: 
+// RFC 2821:
 // RFC 2554: SMTP Service Extension for Authentication
 // RFC 2222: Simple Authentication and Security Layer (SASL)
 // RFC 2245: ANONYMOUS
@@ -50,16 +80,318 @@ using std::vector;
 // RFC ????: LOGIN
 // RFC 2831: DIGEST-MD5
 // RFC 3207: SMTP Service Extension for Secure SMTP over Transport Layer Security
+// RFC 3030: SMTP Service Extensions for Transmission of Large and Binary MIME Messages
+
+/**
+ * Non-blocking connection to the SMTP server. Data from the server is
+ * buffered in 'in', data for the server is collected in 'out' and written
+ * whenever the socket is writable. Every wait is limited by 'deadline'.
+ *
+ * After STARTTLS all data goes through 'ssl', unless 'ktls' is set: then
+ * the kernel encrypts everything written to 'fd'.
+ */
+struct conn_t
+{
+  conn_t() {
+    fd = -1;
+    inpos = inlen = 0;
+    outpos = 0;
+    ssl = 0;
+    ktls = false;
+    want = 0;
+  }
+  int fd;
+  SSL *ssl;
+  bool ktls;
+  short want;         // S_TLS: poll events the handshake waits for
+  deadline_t deadline;
+  char in[4096];
+  size_t inpos, inlen;
+  string out;
+  size_t outpos;
+};
+
+struct dest_t;
+
+/**
+ * A message received from mailgrave-send. The result is reported to
+ * 'client' as one RCPT_* byte per recipient when the job is done.
+ *
+ * 'status' starts with RCPT_DONE for all recipients. A rejected RCPT TO
+ * settles the recipient at once, the others take the outcome of the
+ * transaction in finishJob().
+ *
+ * For direct delivery a job with recipients in several domains is split
+ * into one job per domain, and a job with more than 'max_recipients'
+ * recipients into several transactions. These share the parent's 'datafd'
+ * and the parent is done when all of them are. 'index' maps the
+ * recipients of a split job to those of its parent.
+ */
+struct job_t
+{
+  job_t() {
+    client = -1;
+    datafd = -1;
+    start = 0;
+    flags = 0;
+    dest = 0;
+    parent = 0;
+    pending = 0;
+  }
+  int client;
+  int datafd;
+  off_t start;        // the message starts at this offset of 'datafd'
+  unsigned flags;
+  string host, sender;
+  vector<string> receipients;
+  vector<unsigned char> status;
+  vector<size_t> index;
+  dest_t *dest;
+  job_t *parent;
+  unsigned pending;   // number of unfinished jobs split from this one
+};
+
+/**
+ * A job which is still being received from mailgrave-send.
+ */
+struct intake_t
+{
+  intake_t() {
+    fd = -1;
+    memfd = -1;
+    field = 0;
+    fieldlen = 0;
+    envdone = false;
+  }
+  int fd;
+  int memfd;          // stream mode: the message data is spooled here
+  string envelope;
+  unsigned field;     // stream mode: number of the envelope field
+  size_t fieldlen;
+  bool envdone;
+};
+
+struct address_t
+{
+  sockaddr_storage addr;
+  socklen_t len;
+  unsigned host;      // index of the mail exchanger
+};
+
+enum {
+  D_NEW,        // the addresses need to be looked up
+  D_RESOLVING,
+  D_READY
+};
+
+/**
+ * All jobs for one destination and the sessions connected to it. The
+ * destination is either the relay or a recipient domain, in which case
+ * its addresses are those of its mail exchangers in order of preference.
+ */
+struct dest_t
+{
+  dest_t() {
+    mx = false;
+    state = D_NEW;
+    expires = 0;
+    lookups = 0;
+    health = 0;
+    window = 0;
+    decreased = 0;
+    notls = 0;
+    srtt = minrtt = 0;
+    tempfail = 0;
+    active = 0;
+    idle = 0;
+    opening = 0;
+    quitting = 0;
+  }
+  string name;
+  int port;
+  bool mx;            // 'name' is a mail domain
+  int state;
+  unsigned long long expires;       // monotonicMs() when to look up again
+  vector<string> hosts;             // D_RESOLVING: mail exchangers
+  vector<vector<address_t> > found; // D_RESOLVING: addresses per host
+  unsigned lookups;   // D_RESOLVING: outstanding address lookups
+  vector<address_t> addrs;
+  healthentry_t *health;
+  unsigned long long notls;         // monotonicMs() until which to skip STARTTLS
+
+  // AIMD concurrency control
+  double window;      // number of sessions allowed
+  unsigned long long decreased; // monotonicMs() of the last decrease
+  double srtt;        // smoothed reply latency in ms
+  double minrtt;      // the latency of an unloaded server
+  double tempfail;    // smoothed rate of 4xx replies
 
-static bool sendMail(FILE *in);
-static void sendData(FILE *out, FILE *in);
-static bool parseResponse(FILE *server, unsigned *code, string *text, bool *more, unsigned timeout);
-static bool parseResponseDoIt(FILE *server, unsigned *code, string *text, bool *more);
-static int base64_encode(const char *in, char *out);
+  deque<job_t*> queue;
+  unsigned active;    // number of sessions
+  unsigned idle;      // sessions waiting for a job
+  unsigned opening;   // sessions not yet ready to take a job
+  unsigned quitting;  // sessions in S_QUIT
+};
 
-static int verbose = 1;
+/**
+ * Passed to the resolver to tell to which host of a destination the
+ * answer belongs.
+ */
+struct lookup_t
+{
+  dest_t *dest;
+  size_t host;
+};
+
+enum {
+  S_CONNECT,
+  S_GREETING,
+  S_EHLO,
+  S_AUTH,
+  S_AUTH_USER,
+  S_AUTH_PASS,
+  S_AUTH_PLAIN,
+  S_STARTTLS,
+  S_TLS,
+  S_IDLE,
+  S_MAIL,
+  S_RCPT,
+  S_DATA,
+  S_BODY,
+  S_DATA_END,
+  S_BDAT,
+  S_RSET,
+  S_QUIT
+};
+
+enum {
+  BODY_STUFF,   // DATA, dot-stuffing and CRLF conversion
+  BODY_FILE,    // wire format file, sendfile() and, for DATA, the final dot
+  BODY_CHUNKS   // BDAT chunks with CRLF conversion
+};
+
+/**
+ * A connection attempt of a session in state S_CONNECT.
+ */
+struct attempt_t
+{
+  int fd;
+  unsigned serial;
+  size_t addr;        // index in session_t::addrs
+  deadline_t deadline;
+};
+
+/**
+ * An SMTP client session. It is driven by onReadable/onWritable and
+ * handles one job at a time.
+ *
+ * While connecting, the addresses of one mail exchanger are raced against
+ * each other: another attempt starts whenever the previous ones failed or
+ * haven't succeeded within 'connect_delay' (RFC 8305). Only when all
+ * addresses of a mail exchanger failed, the next one is tried.
+ */
+struct session_t
+{
+  session_t() {
+    id = 0;
+    state = S_CONNECT;
+    dest = 0;
+    job = 0;
+    replytimeout = 0;
+    closed = false;
+    sent = 0;
+    rcpt = 0;
+    nextaddr = 0;
+    host = 0;
+    body = BODY_STUFF;
+    offset = end = 0;
+    bodystate = 0;
+    dot = false;
+    eof = false;
+  }
+  unsigned id;
+  conn_t conn;
+  int state;
+  dest_t *dest;
+  job_t *job;
+  unsigned replytimeout;
+  bool closed;
+  uint64_t sent;      // statClock() when the last command was out
+
+  caps_t caps;        // announced in the EHLO reply
 
-int sock;
+  size_t rcpt;        // next RCPT TO to send
+
+  vector<address_t> addrs;
+  size_t nextaddr;    // next address to try
+  unsigned host;      // mail exchanger of the current attempts
+  vector<attempt_t> attempts;
+  deadline_t stagger; // start the next attempt
+  address_t peer;
+
+  // transfer of the message body
+  int body;
+  off_t offset, end;  // BODY_FILE: range still to be sent
+  unsigned bodystate; // BODY_STUFF, BODY_CHUNKS: WIRE_* state
+  bool dot;           // BODY_FILE: append ".\r\n" when done
+  bool eof;
+};
+
+static bool splitEnvelope(const string &envelope, string *host, string *sender, vector<string> *receipients);
+static void runEngine(int sock);
+static void acceptJob(int sock);
+static bool readIntake(intake_t *in);
+static void queueJob(job_t *job);
+static void finishJob(job_t *job, unsigned char outcome);
+static void schedule();
+static void resolveDest(dest_t *dest);
+static void onMX(void *data, const dnsresult_t *result);
+static void onAddress(void *data, const dnsresult_t *result);
+static void addressesFound(dest_t *dest);
+static void failDest(dest_t *dest, unsigned char outcome);
+static void failQueue(dest_t *dest, unsigned char outcome);
+static healthentry_t* destHealth(dest_t *dest);
+static void sessionReady(session_t *s);
+static void quitSession(session_t *s);
+static void windowIncrease(dest_t *dest);
+static void windowDecrease(dest_t *dest, const char *reason);
+static bool windowCongested(const dest_t *dest);
+static void latencySample(dest_t *dest, unsigned long long ms);
+static dest_t* findDest(const string &name, bool mx);
+static void lookupHosts(dest_t *dest);
+static string addressString(const address_t *a);
+static string lowercase(const string &s);
+static session_t* openSession(dest_t *dest);
+static void closeSession(session_t *s, bool fail);
+static void startConnect(session_t *s);
+static bool startAttempt(session_t *s);
+static void onConnect(session_t *s, unsigned serial);
+static void onConnectTimeout(session_t *s);
+static void connectDeadline(session_t *s);
+static void closeAttempt(session_t *s, size_t attempt);
+static void onReadable(session_t *s);
+static void onWritable(session_t *s);
+static void onTimeout(session_t *s);
+static void authenticate(session_t *s);
+static void startTLS(session_t *s);
+static void handshakeTLS(session_t *s);
+static void failTLS(session_t *s);
+static int onTLSSession(SSL *ssl, SSL_SESSION *session);
+static void closeTLS(conn_t *conn);
+static void onReply(session_t *s, const reply_t *reply);
+static void expect(session_t *s, int state, unsigned timeout);
+static void startJob(session_t *s);
+static void startBody(session_t *s);
+static bool pumpBody(session_t *s);
+static int readReply(conn_t *server, reply_t *reply);
+static int io_read(conn_t *f);
+static void io_put(conn_t *f, const char *s);
+static void io_write(conn_t *f, const char *s, size_t n);
+static bool io_writev(conn_t *f, const struct iovec *iov, size_t n);
+static bool io_flush(conn_t *f);
+static string base64(const string &in);
+
+static bool handoff = false;
 
 static void
 usage()
@@ -76,6 +408,15 @@ usage()
     "    Use the specified file instead of stdin.\n"
     "  --relay <server>\n"
     "    don't deliver directly, use the specified relay server instead\n"
+    "  --health <file>\n"
+    "    File shared with mailgrave-send to track which destinations are\n"
+    "    down, default is 'health'\n"
+    "  --stats <file>\n"
+    "    Count sessions, settled recipients and bytes sent in this file for\n"
+    "    mailgrave-stat\n"
+    "  --dns <address>[:<port>]\n"
+    "    Name server used for direct delivery, default is the first one in\n"
+    "    /etc/resolv.conf\n"
     "  --port <port>\n"
     "    SMTP port of the remote server\n"
     "  --login <login>\n"
@@ -85,21 +426,62 @@ usage()
     "    You should use the environment variable SMTP_AUTH_PASSWORD instead\n"
     "    of this option as parameters on the command line may be visible to\n"
     "    other users on the same computer.\n"
+    "  --no-starttls\n"
+    "    Don't encrypt the connection even when the server offers STARTTLS\n"
+    "  --ktls\n"
+    "    Let the kernel encrypt the data sent over TLS connections, so\n"
+    "    messages are still sent with sendfile()\n"
+    "  --handoff\n"
+    "    Receive jobs from mailgrave-send --handoff, which passes the queue\n"
+    "    file's descriptor instead of copying the message.\n"
+    "  --connect-timeout <seconds>\n"
+    "    Give up connecting to an address after this time, default is 10\n"
+    "  --connect-delay <milliseconds>\n"
+    "    Start connecting to the server's next address when the previous\n"
+    "    attempts didn't succeed within this time, default is 250\n"
+    "  --max-sessions <n>\n"
+    "    Maximal number of concurrent SMTP sessions, default is 200\n"
+    "  --max-per-destination <n>\n"
+    "    Maximal number of concurrent SMTP sessions to the same server,\n"
+    "    default is 10. The actual number adapts to the server's behaviour\n"
+    "    between 1 and this maximum.\n"
+    "  --max-recipients <n>\n"
+    "    Maximal number of recipients per transaction, larger envelopes are\n"
+    "    split into several transactions, default is 100\n"
+    "  --idle-timeout <seconds>\n"
+    "    Keep a session open this long to wait for further jobs, default is 10\n"
+    "  --log-level error|info|verbose\n"
+    "    Log only up to this level, default is verbose, which includes the\n"
+    "    dialog with the SMTP server\n"
     "  --verbose | -v\n"
-    "    Print the dialog with the SMTP server\n"
+    "    Short for --log-level verbose\n"
     "  --help\n"
     "    show this help text\n"
   );
 }
 
-static void io_putc(FILE *f, int c);
-static void io_put(FILE *f, const char *s);
-static void io_flush(FILE *f);
-
 static const char *login    = getenv("SMTP_AUTH_LOGIN");
 static const char *password = getenv("SMTP_AUTH_PASSWORD");
+// the credentials are encoded once for all sessions
+static string auth_plain, auth_user, auth_password;
+static bool starttls = true;
+static bool ktls = false;
+static SSL_CTX *tlsctx = 0;
+// sessions to resume per server name, shared by all connections
+static map<string, SSL_SESSION*> tlssessions;
+static const size_t tlssessions_max = 1024;
+// how long to deliver in cleartext to a destination whose TLS handshake
+// failed before trying STARTTLS again
+static const unsigned tls_retry = 60 * 60;
 static const char *relay = 0;
+static const char *dns = 0;
+static const char *healthfile = "health";
+static const char *statsfile = 0;
+// for mailgrave-stat: the time servers take to reply to commands and to
+// accept the message data
+static histogram_t *reply_latency, *data_latency;
 static int port = 25;
+static char myhost[MAXHOSTNAMELEN];
 
 // various minimal timeouts as suggested by RFC 2821, 4.5.3.2 Timeouts
 static unsigned timeout_initial = 5 * 60;
@@ -111,15 +493,36 @@ static unsigned timeout_data_init = 2 * 60;
 static unsigned timeout_data_block = 3 * 60;
 static unsigned timeout_data_term = 10 * 60;
 static unsigned timeout_quit = 5 * 60;
+// not covered by RFC 2821, blackholed servers would otherwise block us for
+// the kernel's whole SYN retry period
+static unsigned timeout_connect = 10;
+// RFC 8305, 5: Connection Attempt Delay
+static unsigned connect_delay = 250;
+static unsigned timeout_idle = 10;
+
+static unsigned max_sessions = 200;
+static unsigned max_per_destination = 10;
+// RFC 5321, 4.5.3.1.8: servers must accept at least 100 recipients
+static unsigned max_recipients = 100;
+
+// AIMD concurrency control per destination
+static const unsigned initial_window = 2;
+static const unsigned decrease_interval = 1000; // ms between decreases
+static const double latency_slack = 50;        // ms
+static const double tempfail_limit = 0.1;
+
+static vector<intake_t*> intakes;
+static vector<session_t*> sessions;
+static map<string, dest_t*> dests;
+static unsigned session_id = 0;
+static unsigned attempt_serial = 0;
 
 int
 main(int argc, char **argv)
 {
-  setvbuf(stdout, 0, _IONBF, 0);
-
+  log_level = LEVEL_VERBOSE;
   cug_t cug;
   const char *name = "remote.ctrl";
-  int firstarg = argc;
   FILE *in  = stdin;
 
   // parse argument list
@@ -151,6 +554,27 @@ main(int argc, char **argv)
       }
       relay = argv[++i];
     } else
+    if (strcmp(argv[i], "--health")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      healthfile = argv[++i];
+    } else
+    if (strcmp(argv[i], "--stats")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      statsfile = argv[++i];
+    } else
+    if (strcmp(argv[i], "--dns")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      dns = argv[++i];
+    } else
     if (strcmp(argv[i], "--login")==0) {
       if (i+1 >= argc) {
         fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
@@ -165,8 +589,58 @@ main(int argc, char **argv)
       }
       password = argv[++i];
     } else
-    if (strcmp(argv[i], "--verbose")==0 || strcmp(argv[i], "-v")==0) {
-      ++verbose;
+    if (strcmp(argv[i], "--handoff")==0) {
+      handoff = true;
+    } else
+    if (strcmp(argv[i], "--no-starttls")==0) {
+      starttls = false;
+    } else
+    if (strcmp(argv[i], "--ktls")==0) {
+      ktls = true;
+    } else
+    if (logOption(argc, argv, &i)) {
+    } else
+    if (strcmp(argv[i], "--connect-timeout")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      timeout_connect = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--connect-delay")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      connect_delay = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--idle-timeout")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      timeout_idle = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--max-sessions")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      max_sessions = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--max-per-destination")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      max_per_destination = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--max-recipients")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      max_recipients = atoi(argv[++i]);
     } else
     if (strcmp(argv[i], "--port")==0) {
       if (i+1 >= argc) {
@@ -179,19 +653,51 @@ main(int argc, char **argv)
       usage();
       return EXIT_SUCCESS;
     } else {
-      firstarg = i;
       break;
     }
   }
 
+  if (!initResolver(dns))
+    return EXIT_FAILURE;
+  if (starttls) {
+    tlsctx = tlsClientContext(ktls);
+    if (!tlsctx)
+      return EXIT_FAILURE;
+    SSL_CTX_set_session_cache_mode(tlsctx, SSL_SESS_CACHE_CLIENT |
+                                           SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tlsctx, onTLSSession);
+  }
+  if (max_sessions<1)
+    max_sessions = 1;
+  if (max_per_destination<1)
+    max_per_destination = 1;
+  if (max_recipients<1)
+    max_recipients = 1;
+  if (login && password) {
+    // RFC 4616: <authorization identity>\0<authentication identity>\0<password>
+    string plain;
+    plain += '\0';
+    plain += login;
+    plain += '\0';
+    plain += password;
+    auth_plain = "AUTH PLAIN " + base64(plain) + "\r\n";
+    auth_user = base64(login) + "\r\n";
+    auth_password = base64(password) + "\r\n";
+  }
+
+  if (gethostname(myhost, sizeof(myhost)) == -1) {
+    perror("gethostname failed");
+    return EXIT_FAILURE;
+  }
+
   // create socket
-  int sock = createUNIXSocket(name);
+  int sock = createUNIXSocket(name, handoff ? SOCK_SEQPACKET : SOCK_STREAM);
   if (sock<0) {
     perror ("failed to create unix domain socket");
     return EXIT_FAILURE;
   }
 
-  if (listen(sock, 5) < 0) {
+  if (listen(sock, 64) < 0) {
     perror("control listen");
     close(sock);
     return EXIT_FAILURE;
@@ -203,663 +709,2026 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  if (mapHealth(healthfile, true))
+    setHealthRelay(relay);
+  else
+    LOG(LEVEL_ERROR, "mailgrave-remote: continuing without health tracking\n");
+  if (statsfile && !mapStats(statsfile, "remote"))
+    LOG(LEVEL_ERROR, "mailgrave-remote: continuing without statistics\n");
+  reply_latency = statHistogram("reply");
+  data_latency = statHistogram("dataEnd");
+
   // change root, uid, gid
   if (!setChrootUidGid(&cug))
     return EXIT_FAILURE;
-  
-  // message loop  
-  while(true) {
-    struct sockaddr_un addr;
-    socklen_t addrlen = sizeof(addr);
-    int client = accept(sock, (struct sockaddr*) &addr, &addrlen);
-    printf("%s: got job\n", argv[0]);
-    // we should fork here...
-    FILE *in = fdopen(client, "r");
-    if (sendMail(in)) {
-      char x = 1;
-      write(client, &x, 1);
-    } else {
-      char x = 0;
-      write(client, &x, 1);
-    }
-    fclose(in);
-  }
+
+  // a server closing an idle session must not terminate all the others
+  signal(SIGPIPE, SIG_IGN);
+
+  logStart();
+  runEngine(sock);
   return EXIT_SUCCESS;
 }
 
-bool
-sendMail(FILE *in)
-{
-  bool result = false;
-
-  bool auth = false;
-  bool has_tls = false;
-  bool has_plain = false;
-  bool has_login = false;
-
-  // fetch host, sender and receipients from the socket:
-  // <host>\0
-  // <sender>\0
-  // <recipient>\0...\0
-  // <data>
-  
-  string host, sender, tmp;
-  vector<string> receipients;
-  
-  unsigned state=0;
-  while(state!=255) {
-    int c = fgetc(in);
-    if (c==EOF) {
-      return result;
-    }
-    switch(state) {
-      case 0: // collect 'host'
-        if (c==0) {
-          state = 1;
-          if (verbose)
-            printf("mailgrave-remote: got host '%s'\n", host.c_str());
-          continue;
-        }
-        host += c;
-        break;
-      case 1: // collect 'sender'
-        if (c==0) {
-          state = 2;
-          if (verbose)
-            printf("mailgrave-remote: got sender '%s'\n", sender.c_str());
-          continue;
-        }
-        sender += c;
-        break;
-      case 2: // collect receipients
-        if (c==0) {
-          if (verbose)
-            printf("mailgrave-remote: got %lu recipients\n", (unsigned long)receipients.size());
-          state = 255;
-          continue;
-        }
-        tmp += c;
-        state = 3;
-        break;
-      case 3: // collect single receipient
-        if (c==0) {
-          state = 2;
-          receipients.push_back(tmp);
-          if (verbose)
-            printf("mailgrave-remote: got receipient '%s'\n", tmp.c_str());
-          tmp.clear();
-          continue;
-        }
-        tmp += c;
-        break;
-    }
-  }
+/**
+ * The event loop: wait for new jobs on 'sock', for data of jobs being
+ * received and for the sessions' sockets and deadlines.
+ */
+void
+runEngine(int sock)
+{
+  vector<pollfd> pfds;
+  vector<session_t*> owners;  // session of pfds[2+intakes.size()+i]
+  vector<unsigned> serials;   // connection attempt or 0
+  while(true) {
+    schedule();
 
-  // connect to the server
-  sockaddr_in name;
-  in_addr ia;
-  if (inet_aton(relay, &ia)!=0) {
-    name.sin_addr.s_addr = ia.s_addr;
-  } else {
-    struct hostent *hostinfo;
-    hostinfo = gethostbyname(relay);
-    if (hostinfo==0) {
-      fprintf(stderr, "Failed to resolve hostname '%s'\n", relay);
-      return result;
+    pfds.clear();
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfds.push_back(pfd);
+    pfd.fd = resolverFd();
+    pfds.push_back(pfd);
+    for(size_t i=0; i<intakes.size(); ++i) {
+      pfd.fd = intakes[i]->fd;
+      pfds.push_back(pfd);
     }
-    name.sin_addr = *(struct in_addr *) hostinfo->h_addr;
-  }
-  name.sin_family = AF_INET;
-  name.sin_port   = htons(port);
 
-  sock = socket (AF_INET, SOCK_STREAM, 0);
-  if (sock==-1) {
-    perror("Failed to create socket");
-    return result;
-  }
-  
-  if (connect(sock, (sockaddr*) &name, sizeof(sockaddr_in)) < 0) {
-    printf("mailgrave-remote: failed to connect to '%s:%d': %s\n",
-           relay, port, strerror(errno));
-    return result;
-  }
-
-  char myhost[MAXHOSTNAMELEN];
-  if (gethostname(myhost, sizeof(myhost)) == -1) {
-    perror("gethostname failed");
-    return result;
-  }
-
-  FILE *server = fdopen(sock, "r+");
-  if (!server) {
-    perror("fdopen failed");
-    return result;
-  }
-
-  // communicate with the server
-  unsigned code;
-  string text;
-  bool more;
-
-  // read server name
-  parseResponse(server, &code, &text, 0, timeout_initial);
-  if (code!=220) {
-    printf("Server send error %03u %s\n", code, text.c_str());
-    goto error1;
-  }
-  
-  // send EHLO
-  io_put(server, "EHLO ");
-  io_put(server, myhost);
-  io_put(server, "\r\n");
-  io_flush(server);
-  
-  // parse HELO/EHLO response (may be multiple lines, thus the loop)
-  do {
-    parseResponse(server, &code, &text, &more, timeout_helo);
-    if (code!=250) {
-      printf("Server send error %03u %s\n", code, text.c_str());
-      goto error1;
-    }
-    if (text=="STARTTLS") {
-      has_tls = true;
-    } else
-    if (text.compare(0, 5, "AUTH ", 5)==0) {
-      auth = true;
-      string::size_type i0 = 5, i1;
-//printf("split '%s\n", text.c_str());
-      while(true) {
-        i1 = text.find(' ', i0);
-        string name = text.substr(i0, i1-i0);
-//printf("  i0=%d, i1=%d, '%s'\n", i0, i1, name.c_str());
-        if (name=="PLAIN") {
-          has_plain = true;
-        } else
-        if (name=="LOGIN") {
-          has_login = true;
+    int timeout = resolverTimeout();
+    owners.clear();
+    serials.clear();
+    for(size_t i=0; i<sessions.size(); ++i) {
+      session_t *s = sessions[i];
+      if (s->state==S_CONNECT) {
+        pfd.events = POLLOUT;
+        for(size_t j=0; j<s->attempts.size(); ++j) {
+          pfd.fd = s->attempts[j].fd;
+          pfds.push_back(pfd);
+          owners.push_back(s);
+          serials.push_back(s->attempts[j].serial);
         }
-        if (i1==string::npos)
-          break;
-        i0 = i1 + 1;
+      } else {
+        pfd.fd = s->conn.fd;
+        pfd.events = POLLIN;
+        if (s->conn.outpos < s->conn.out.size() || s->state==S_BODY)
+          pfd.events |= POLLOUT;
+        if (s->state==S_TLS)
+          pfd.events = s->conn.want;
+        pfds.push_back(pfd);
+        owners.push_back(s);
+        serials.push_back(0);
       }
+      int t = deadlineRemaining(&s->conn.deadline);
+      if (t>=0 && (timeout<0 || t<timeout))
+        timeout = t;
     }
-  } while(more);
-  
-  if (!password || !login) {
-    auth = false;
-  }
-  
-  // STARTTLS
-  if (has_tls) {
-  }
-
-  // ANONYMOUS, PLAIN, LOGIN, CRAM-MD5, DIGEST-MD5, GSSAPI, NTLM
-
-  if (auth && has_login) {
-    char b64[(strlen(login)+strlen(password))*2];
-
-    io_put(server, "AUTH LOGIN\r\n");
-    io_flush(server);
-    
-    parseResponse(server, &code, &text, 0, timeout_auth);
-    if (code != 334) {
-      io_put(server, "QUIT\r\n");
-      io_flush(server);
-      printf("Connected to '%s' but AUTH LOGIN was rejected.\n", host.c_str());
-      goto error1;
-    }
-    
-    base64_encode(login, b64);
-    io_put(server, b64);
-    io_put(server, "\r\n");
-    io_flush(server);
-
-    parseResponse(server, &code, &text, 0, timeout_auth);
-    if (code != 334) {
-      io_put(server, "QUIT\r\n");
-      io_flush(server);
-      printf("Connected to '%s' but AUTH LOGIN's username was rejected.\n", host.c_str());
-      goto error1;
-    }
-
-    base64_encode(password, b64);
-    io_put(server, b64);
-    io_put(server, "\r\n");
-    io_flush(server);
-
-    parseResponse(server, &code, &text, 0, timeout_auth);
-    if (code != 235) {
-      io_put(server, "QUIT\r\n");
-      io_flush(server);
-      printf("Connected to '%s' but AUTH LOGIN' password was rejected.\n", host.c_str());
-      goto error1;
-    }
-  }
-
-  io_put(server, "MAIL FROM:<");
-  io_put(server, sender.c_str());
-  io_put(server, ">\r\n");
-  io_flush(server);
-
-  parseResponse(server, &code, &text, 0, timeout_mail);
-  if (code != 250) {
-    io_put(server, "QUIT\r\n");
-    io_flush(server);
-    printf("Connected to '%s' but MAIL FROM was rejected.\n", host.c_str());
-    goto error1;
-  }
-  
-  for(vector<string>::const_iterator p = receipients.begin();
-      p != receipients.end();
-      ++p)
-  {
-    io_put(server, "RCPT TO:<");
-    io_put(server, p->c_str());
-    io_put(server, ">\r\n");
-    io_flush(server);
-
-    parseResponse(server, &code, &text, 0, timeout_rcpt);
-    if (code != 250) {
-      printf("Connected to '%s' but RCPT TO was rejected.\n", host.c_str());
-      io_put(server, "QUIT\r\n");
-      io_flush(server);
-      parseResponse(server, &code, &text, 0, timeout_quit);
-      if (code != 221) {
-        printf("QUIT was rejected. (ignored)\n");
-      }
-      goto error1;
-    }
-  }
-  
-  io_put(server, "DATA\r\n");
-  io_flush(server);
-  
-  parseResponse(server, &code, &text, 0, timeout_data_init);
-  if (code != 354) {
-    printf("Connected to '%s' but DATA was rejected.\n", host.c_str());
-    goto error1;
-  }
-  
-  sendData(server, in);
-  
-  parseResponse(server, &code, &text, 0, timeout_data_term);
-  if (code != 250) {
-    printf("Connected to '%s' DATA was rejected.\n", host.c_str());
-    goto error1;
-  }
-  
-  io_put(server, "QUIT\r\n");
-  io_flush(server);
-  
-  parseResponse(server, &code, &text, 0, timeout_quit);
-  if (code != 221) {
-    printf("Mail send but QUIT was rejected. (ignored)\n");
-  }
-  result = true;
-error1:  
-//  if (in != stdin)
-//    fclose(in);
-  fclose(server);
-  return result;
-}
-
-/**
- * Copy email data to the SMTP server.
- *
- * \li convert '\r\n.' to '\r\n..' so a dot at the beginning of a line
- *     isn't confused with end of data
- * \li convert single '\n' to '\r\n'
- */
-void
-sendData(FILE *out, FILE *in)
-{  
-  if (verbose>0)
-    printf("BEGIN OF DATA\n");
-  unsigned state = 0;
-  while(state!=100) {
-    int c = getc_unlocked(in);
-    switch(state) {
-      case 0: // BOL
-        switch(c) {
-          case EOF:
-            state = 100;
-            break;
-          case '\n':
-            io_putc(out, '\r');
-            io_putc(out, c);
-            break;
-          case '\r':
-            io_putc(out, c);
-            state = 2;
-            break;
-          case '.':
-            io_putc(out, '.');
-            io_putc(out, c);
-            state = 1;
-            break;
-          default:
-            io_putc(out, c);
-            state = 1;
-        }
-        break;
 
-      case 1: // behind BOL
-        switch(c) {
-          case EOF:
-            io_putc(out, '\r');
-            io_putc(out, '\n');
-            state = 100;
-            break;
-          case '\n':
-            io_putc(out, '\r');
-            io_putc(out, c);
-            state = 0;
-            break;
-          case '\r':
-            io_putc(out, c);
-            state = 2;
-            break;
-          default:
-            io_putc(out, c);
-        }
-        break;
+    int r = poll(&pfds[0], pfds.size(), timeout);
+    if (r<0) {
+      if (errno!=EINTR)
+        perror("mailgrave-remote: poll");
+      continue;
+    }
 
-      case 2: // behind '\r'
-        io_putc(out, c);
-        switch(c) {
-          case EOF:
-            io_putc(out, '\n');
-            state = 100;
-            break;
-          case '\n':
-            state = 0;
+    // the vectors may change while handling the events, thus work on
+    // copies which are checked against the current state
+    vector<intake_t*> ilist(intakes);
+    vector<session_t*> slist(sessions);
+    if (pfds[1].revents || resolverTimeout()==0)
+      resolverEvent();
+    size_t n = 2;
+    for(size_t i=0; i<ilist.size(); ++i, ++n) {
+      if (pfds[n].revents && !readIntake(ilist[i])) {
+        for(size_t j=0; j<intakes.size(); ++j) {
+          if (intakes[j]==ilist[i]) {
+            intakes.erase(intakes.begin()+j);
             break;
-          case '\r':
-            break;
-          default:
-            state = 1;
+          }
         }
-        break;
+      }
     }
+    for(size_t i=0; i<owners.size(); ++i, ++n) {
+      session_t *s = owners[i];
+      short ev = pfds[n].revents;
+      if (s->closed || !ev)
+        continue;
+      if (serials[i]) {
+        onConnect(s, serials[i]);
+        continue;
+      }
+      if (ev & (POLLIN|POLLERR|POLLHUP))
+        onReadable(s);
+      if (s->closed || s->conn.fd<0)
+        continue;
+      if (ev & POLLOUT)
+        onWritable(s);
+    }
+    for(size_t i=0; i<slist.size(); ++i) {
+      session_t *s = slist[i];
+      if (!s->closed && deadlineExpired(&s->conn.deadline))
+        onTimeout(s);
+    }
+    for(size_t i=sessions.size(); i>0; --i) {
+      if (sessions[i-1]->closed) {
+        delete sessions[i-1];
+        sessions.erase(sessions.begin()+i-1);
+      }
+    }
+    statSet(&stats->sessions, sessions.size());
+
+    if (pfds[0].revents & POLLIN)
+      acceptJob(sock);
   }
-  if (verbose>0) {
-    printf("END OF DATA\n");
-  }
-  io_put(out, ".\r\n");
-  io_flush(out);
 }
 
 /**
- * Parse a single server response line.
- * In case of an error, an message is printed and exit(0) invoked.
- *
- * \param server
- *   stream with the server socket
- * \param code
- *   out: the SMTP result code
- * \param text
- *   out: additional text after the result code
- * \param: more
- *   out: returns true, when this response line is followed by another one;
- *   it is an error if another line will follows and 'more' is NULL.
+ * Accept a new connection from mailgrave-send.
  */
-static bool timeout_flag;
-
-void alarm_cb(int) {
-  printf("alarm_cb\n");
-  timeout_flag = true;
-}
-
-bool
-parseResponse(FILE *server, unsigned *aCode, string *text, bool *more, unsigned timeout)
-{
-  *aCode = 0;
-  timeout_flag = false;
-  alarm(timeout);
-//alarm(5);
-  struct sigaction sig;
-  sig.sa_handler = &alarm_cb;
-  sig.sa_flags   = 0;
-  sigemptyset(&sig.sa_mask);
-  sigaction(SIGALRM, &sig, 0);
-  bool r = parseResponseDoIt(server, aCode, text, more);
-  alarm(0);
-  sig.sa_handler = SIG_DFL;
-  sigaction(SIGALRM, &sig, 0);
-  if (timeout_flag) {
-    printf("parseResponse timed out\n");
-    r = false;
-  }
-  if (verbose)
-    fflush(stdout);
-  return r;
+void
+acceptJob(int sock)
+{
+  struct sockaddr_un addr;
+  socklen_t addrlen = sizeof(addr);
+  int client = accept4(sock, (struct sockaddr*) &addr, &addrlen, SOCK_CLOEXEC);
+  if (client<0) {
+    perror("accept");
+    return;
+  }
+  LOG(LEVEL_INFO, "mailgrave-remote: got job\n");
+  intake_t *in = new intake_t;
+  in->fd = client;
+  intakes.push_back(in);
 }
 
+/**
+ * Receive the job from mailgrave-send.
+ *
+ * In handoff mode the job arrives with a single recvHandoff(). On the
+ * stream socket the envelope is followed by the message, which is spooled
+ * into an anonymous file so the sessions can treat both modes alike.
+ *
+ * \return
+ *   false when 'in' is done and was deleted
+ */
 bool
-parseResponseDoIt(FILE *server, unsigned *aCode, string *text, bool *more)
-{
-printf("reading server response\n");
-  unsigned state = 0;
-  unsigned code = 0;
-  if (more)
-    *more = false;
-  text->clear();
-  while(true) {
-    int c = getc_unlocked(server);
-    if (c<0) {
-      if (errno==EINTR) {
-        if (!timeout_flag)
-          continue;
-        else
-          return false;
-      }
-      perror("getc failed");
+readIntake(intake_t *in)
+{
+  job_t *job = 0;
+  if (handoff) {
+    int fd;
+    uint32_t flags;
+    unsigned count;
+    job = new job_t;
+    job->client = in->fd;
+    if (!recvHandoff(in->fd, &fd, &flags, &count, &in->envelope)) {
+      finishJob(job, RCPT_DEFERRED);
+      delete in;
       return false;
     }
-//    int c = fgetc(server);
-//    char c;
-//    read(sock, &c, 1);
-    if (verbose>0) {
-      switch(c) {
-        case '\r':
-          printf("\\r");
-          break;
-        case '\n':
-          printf("\\n\n");
-          break;
-        case '\0':
-          printf("\\0");
-          break;
-        default:
-	  putc_unlocked(c, stdout);
-      }
-    }
-    switch(state) {
-      case 0: // parse three digit number
-        if (!isdigit(c)) {
-          printf("Unexpected response: expected 1st digit\n");
-          return false;
-        }
-        code += (c - '0') * 100;
-        state = 1;
-        break;
-      case 1:
-        if (!isdigit(c)) {
-          printf("Unexpected response: expected 2nd digit\n");
-          return false;
-        }
-        code += (c - '0') * 10;
-        state = 2;
-        break;
-      case 2:
-        if (!isdigit(c)) {
-          printf("Unexpected response: expected 3rd digit\n");
-          return false;
-        }
-        code += (c - '0');
-        state = 3;
-        break;
-        
-      case 3: // parse character after three digit number
-        switch(c) {
-          case '-':
-            if (more) {
-              *more = true;
-            } else {
-              printf("Unexpected response: expected single line response\n");
-              return false;
-            }
-          case ' ':
-            state = 4;
-            break;
-          case '\r':
-            state = 5;
-            break;
-          case '\n':
-            printf("Unexpected '\\n' (3)\n");
-            return false;
-          default:
-            printf("Unexpected response: expected ' ' or '\\r'\n");
-            return false;
+    job->datafd = fd;
+    job->start = lseek(fd, 0, SEEK_CUR);
+    if (job->start<0)
+      job->start = 0;
+    job->flags = flags;
+  } else {
+    char buffer[65536];
+    ssize_t l = read(in->fd, buffer, sizeof(buffer));
+    if (l<0 && (errno==EINTR || errno==EAGAIN))
+      return true;
+    if (l<0) {
+      perror("mailgrave-remote: read job");
+      goto error;
+    }
+    if (l>0) {
+      // collect the envelope: <host>\0<sender>\0<recipient>\0...\0
+      const char *p = buffer;
+      const char *e = buffer + l;
+      while(!in->envdone && p!=e) {
+        in->envelope += *p;
+        if (*p==0) {
+          if (in->field>=2 && in->fieldlen==0)
+            in->envdone = true;
+          ++in->field;
+          in->fieldlen = 0;
+        } else {
+          ++in->fieldlen;
         }
-        break;
-        
-      case 4: // parse text
-        switch(c) {
-          case '\r':
-            state = 5;
-            break;
-          case '\n':
-            printf("Unexpected '\\n' (4)\n");
-            return false;
-          default:
-            *text += c;
+        ++p;
+      }
+      if (p!=e) {
+        if (in->memfd<0) {
+          in->memfd = memfd_create("mailgrave-remote", MFD_CLOEXEC);
+          if (in->memfd<0) {
+            perror("mailgrave-remote: memfd_create");
+            goto error;
+          }
         }
-        break;
-      case 5:
-        switch(c) {
-          case '\n':
-            *aCode = code;
-            return true;
-          case '\r':
-            *text += '\r';
-            break;
-          default:
-            *text += '\r';
-            *text += c;
-            state = 4;
+        while(p!=e) {
+          ssize_t n = write(in->memfd, p, e-p);
+          if (n<0) {
+            if (errno==EINTR)
+              continue;
+            perror("mailgrave-remote: write spool");
+            goto error;
+          }
+          p += n;
         }
-        break;
+      }
+      return true;
+    }
+    // end of job
+    if (!in->envdone) {
+      LOG(LEVEL_ERROR, "mailgrave-remote: incomplete envelope\n");
+      goto error;
     }
+    job = new job_t;
+    job->client = in->fd;
+    if (in->memfd<0)
+      in->memfd = memfd_create("mailgrave-remote", MFD_CLOEXEC);
+    job->datafd = in->memfd;
+    in->memfd = -1;
+    if (job->datafd<0 || lseek(job->datafd, 0, SEEK_SET)!=0) {
+      perror("mailgrave-remote: spool");
+      finishJob(job, RCPT_DEFERRED);
+      delete in;
+      return false;
+    }
+  }
+
+  if (!splitEnvelope(in->envelope, &job->host, &job->sender, &job->receipients)) {
+    finishJob(job, RCPT_DEFERRED);
+  } else {
+    job->status.assign(job->receipients.size(), RCPT_DONE);
+    queueJob(job);
   }
+  delete in;
+  return false;
+
+error:
+  char x = 0;
+  write(in->fd, &x, 1);
+  close(in->fd);
+  if (in->memfd>=0)
+    close(in->memfd);
+  delete in;
   return false;
 }
 
-/*
- * methods for writing data to the server which also dump their output
- * on stdout when verbose mode is selected
+/**
+ * Split an envelope in the format
+ * <host>\0<sender>\0<recipient>\0...\0
  */
-void
-io_putc(FILE *f, int c)
+bool
+splitEnvelope(const string &envelope, string *host, string *sender, vector<string> *receipients)
 {
-  if (verbose>0) {
-    if (c=='\r')
-      fwrite("\\r", 1, 2, stdout);
-    else if (c=='\n')
-      fwrite("\\n\n", 1, 3, stdout);
-    else
-      putc_unlocked(c, stdout);
-  }
-  putc_unlocked(c, f);
-}
+  const char *p = envelope.data();
+  const char *e = p + envelope.size();
+  const char *q;
 
-void
-io_put(FILE *f, const char *s)
-{
-  if (verbose>0) {
-    int l = strlen(s);
-    for(int i=0; i<l; ++i)
-      io_putc(f, s[i]);
-    return;
+  if (e==p || e[-1]!=0) {
+    LOG(LEVEL_ERROR, "mailgrave-remote: malformed envelope\n");
+    return false;
   }
-  fwrite(s, 1, strlen(s), f);
-}
-
-void
-io_flush(FILE *f)
-{
-  if (verbose>0)
-    fflush(stdout);
-  fflush(f);
+  q = p + strlen(p);
+  host->assign(p, q);
+  p = q + 1;
+  if (p==e) {
+    LOG(LEVEL_ERROR, "mailgrave-remote: envelope without sender\n");
+    return false;
+  }
+  q = p + strlen(p);
+  sender->assign(p, q);
+  p = q + 1;
+  while(p<e && *p) {
+    q = p + strlen(p);
+    receipients->push_back(string(p, q));
+    p = q + 1;
+  }
+  LOG(LEVEL_INFO, "mailgrave-remote: got host '%s', sender '%s', %lu recipients\n",
+                  host->c_str(), sender->c_str(), (unsigned long)receipients->size());
+  return true;
 }
 
-/*
- * BASE64 encoding
+/**
+ * Return the destination for 'name', creating it if needed.
  */
-
-static int
-base64_encode6(int v)
+dest_t*
+findDest(const string &name, bool mx)
 {
-  if (v<26)
-    return v+'A';
-  if (v<52)
-    return v-26+'a';
-  if (v<62)
-    return v-52+'0';
-  if (v==62)
-    return '+';
-  return '/';
+  string key = (mx ? "mx:" : "host:") + name;
+  map<string, dest_t*>::iterator p = dests.find(key);
+  if (p!=dests.end())
+    return p->second;
+  dest_t *dest = new dest_t;
+  dest->name = name;
+  dest->port = port;
+  dest->mx = mx;
+  dests[key] = dest;
+  return dest;
 }
 
-static void
-base64_encode24(char **out, int d, int n)
+/**
+ * Put the job into the queue of its destination.
+ *
+ * Without a relay the host field of the envelope names the recipients'
+ * domain. When it is empty the recipients are grouped by their domains.
+ * Each group is split into transactions of at most 'max_recipients'
+ * recipients, which the sessions to the destination deliver in parallel.
+ */
+void
+queueJob(job_t *job)
 {
-  int m = 0;
-  if (n==0)
+  map<string, vector<size_t> > groups;
+  for(size_t i=0; i<job->receipients.size(); ++i) {
+    if (relay || !job->host.empty()) {
+      groups[""].push_back(i);
+      continue;
+    }
+    const string &rcpt = job->receipients[i];
+    string::size_type at = rcpt.rfind('@');
+    groups[lowercase(at==string::npos ? rcpt : rcpt.substr(at+1))].push_back(i);
+  }
+  if (groups.empty()) {
+    finishJob(job, RCPT_DEFERRED);
     return;
-  
-  d<<=(24-n);
-  n=24;
-  
-  while(n>0) {
-    if (n>18)
-      **out = base64_encode6((d>>18)&63);
-    else if (n>12)
-      **out = base64_encode6((d>>12)&63);
-    else if (n>6)
-      **out = base64_encode6((d>> 6)&63);
+  }
+
+  if (groups.size()==1 && job->receipients.size() <= max_recipients) {
+    const string &domain = groups.begin()->first;
+    if (relay)
+      job->dest = findDest(relay, false);
     else
-      **out = base64_encode6((d    )&63);
-    ++*out;
-    ++m;
-    n-=6;
+      job->dest = findDest(domain.empty() ? lowercase(job->host) : domain, true);
+    job->dest->queue.push_back(job);
+    return;
   }
-  while(m<4) {
-    **out = '=';
-    ++*out;
-    ++m;
+
+  for(map<string, vector<size_t> >::iterator p = groups.begin();
+      p != groups.end();
+      ++p)
+  {
+    dest_t *dest;
+    if (relay)
+      dest = findDest(relay, false);
+    else
+      dest = findDest(p->first.empty() ? lowercase(job->host) : p->first, true);
+    const vector<size_t> &group = p->second;
+    for(size_t i=0; i<group.size(); i+=max_recipients) {
+      job_t *sub = new job_t;
+      sub->datafd = job->datafd;
+      sub->start = job->start;
+      sub->flags = job->flags;
+      sub->sender = job->sender;
+      sub->parent = job;
+      sub->dest = dest;
+      for(size_t j=i; j<group.size() && j<i+max_recipients; ++j) {
+        sub->receipients.push_back(job->receipients[group[j]]);
+        sub->status.push_back(RCPT_DONE);
+        sub->index.push_back(group[j]);
+      }
+      ++job->pending;
+      dest->queue.push_back(sub);
+    }
   }
+  if (job->pending>1)
+    LOG(LEVEL_INFO, "mailgrave-remote: split job into %u transactions\n", job->pending);
 }
 
-int
-base64_encode(const char *in, char *out)
-{
-  int i, d, n;
-  while(1) {
-    d = 0;
-    n = 0;
-    for(i=0; i<3; ++i) {
-      if (!*in)
+/**
+ * Report the result to mailgrave-send and delete the job.
+ *
+ * \param outcome
+ *   the RCPT_* status for all recipients which weren't rejected on their
+ *   own
+ */
+void
+finishJob(job_t *job, unsigned char outcome)
+{
+  for(size_t i=0; i<job->status.size(); ++i) {
+    if (job->status[i]==RCPT_DONE)
+      job->status[i] = outcome;
+  }
+  if (job->parent) {
+    job_t *parent = job->parent;
+    for(size_t i=0; i<job->index.size(); ++i)
+      parent->status[job->index[i]] = job->status[i];
+    delete job;
+    if (--parent->pending==0)
+      finishJob(parent, RCPT_DONE);
+    return;
+  }
+  for(size_t i=0; i<job->status.size(); ++i) {
+    switch(job->status[i]) {
+      case RCPT_DONE:
+        statAdd(&stats->delivered, 1);
+        break;
+      case RCPT_FAILED:
+        statAdd(&stats->failed, 1);
+        break;
+      default:
+        statAdd(&stats->deferred, 1);
+    }
+  }
+  if (job->client>=0) {
+    if (!job->status.empty())
+      write(job->client, &job->status[0], job->status.size());
+    close(job->client);
+  }
+  if (job->datafd>=0)
+    close(job->datafd);
+  delete job;
+}
+
+/**
+ * Hand queued jobs to idle sessions and open new sessions as long as the
+ * limits permit.
+ */
+void
+schedule()
+{
+  for(map<string, dest_t*>::iterator p = dests.begin();
+      p != dests.end();
+      ++p)
+  {
+    dest_t *dest = p->second;
+    if (dest->queue.empty())
+      continue;
+    for(size_t i=0; i<sessions.size() && !dest->queue.empty(); ++i) {
+      session_t *s = sessions[i];
+      if (s->dest==dest && s->state==S_IDLE)
+        startJob(s);
+    }
+
+    // circuit breaker: while the destination is down, jobs fail without
+    // a connection attempt, afterwards a single session probes it
+    healthentry_t *h = destHealth(dest);
+    if (dest->window==0) {
+      dest->window = max_per_destination < initial_window ? max_per_destination : initial_window;
+      if (h)
+        h->window = (uint32_t)dest->window;
+    }
+    unsigned limit = (unsigned)dest->window;
+    if (h && h->state==HEALTH_DOWN) {
+      if (time(0) < h->retry) {
+        if (!dest->queue.empty()) {
+          LOG(LEVEL_INFO, "mailgrave-remote: '%s' is down\n", dest->name.c_str());
+          failQueue(dest, RCPT_DEFERRED);
+        }
+        continue;
+      }
+      h->state = HEALTH_PROBE;
+    }
+    if (h && h->state==HEALTH_PROBE)
+      limit = 1;
+
+    if (dest->state==D_READY && monotonicMs() >= dest->expires)
+      dest->state = D_NEW;
+    if (dest->state==D_NEW && !dest->queue.empty())
+      resolveDest(dest);
+    if (dest->state!=D_READY)
+      continue;
+    while(dest->queue.size() > dest->opening &&
+          dest->active < limit &&
+          sessions.size() < max_sessions)
+    {
+      if (!openSession(dest))
+        break;
+    }
+  }
+}
+
+/**
+ * Look up the addresses of the destination. For a mail domain these are
+ * the addresses of its mail exchangers, ordered by preference.
+ *
+ * RFC 5321, 5.1: Locating the Target Host
+ */
+void
+resolveDest(dest_t *dest)
+{
+  dest->state = D_RESOLVING;
+  dest->expires = (unsigned long long)-1;
+  dest->hosts.clear();
+  dest->found.clear();
+
+  if (!dest->mx) {
+    address_t a;
+    memset(&a, 0, sizeof(a));
+    sockaddr_in *sin = (sockaddr_in*)&a.addr;
+    sockaddr_in6 *sin6 = (sockaddr_in6*)&a.addr;
+    if (inet_pton(AF_INET, dest->name.c_str(), &sin->sin_addr)==1) {
+      sin->sin_family = AF_INET;
+      a.len = sizeof(sockaddr_in);
+    } else
+    if (inet_pton(AF_INET6, dest->name.c_str(), &sin6->sin6_addr)==1) {
+      sin6->sin6_family = AF_INET6;
+      a.len = sizeof(sockaddr_in6);
+    } else {
+      dest->hosts.push_back(dest->name);
+      lookupHosts(dest);
+      return;
+    }
+    a.host = 0;
+    dest->addrs.clear();
+    dest->addrs.push_back(a);
+    dest->state = D_READY;
+    return;
+  }
+  resolve(dest->name, DNS_MX, onMX, dest);
+}
+
+static bool
+mxLess(const dnsrecord_t &a, const dnsrecord_t &b)
+{
+  return a.pref < b.pref;
+}
+
+void
+onMX(void *data, const dnsresult_t *result)
+{
+  dest_t *dest = (dest_t*)data;
+  unsigned long long expires = monotonicMs() + (unsigned long long)result->ttl * 1000;
+  if (expires < dest->expires)
+    dest->expires = expires;
+
+  switch(result->status) {
+    case DNS_OK: {
+      // hosts with the same preference are tried in random order
+      vector<dnsrecord_t> mx(result->records);
+      for(size_t i=mx.size(); i>1; --i)
+        std::swap(mx[i-1], mx[random() % i]);
+      stable_sort(mx.begin(), mx.end(), mxLess);
+      for(size_t i=0; i<mx.size(); ++i) {
+        if (!mx[i].name.empty())
+          dest->hosts.push_back(mx[i].name);
+      }
+      // RFC 7505: a single MX for "." means the domain accepts no mail
+      if (dest->hosts.empty()) {
+        LOG(LEVEL_ERROR, "mailgrave-remote: domain '%s' doesn't accept mail\n",
+                         dest->name.c_str());
+        failDest(dest, RCPT_FAILED);
+        return;
+      }
+    } break;
+    case DNS_NODATA:
+      // no MX records, the domain itself is the mail exchanger
+      dest->hosts.push_back(dest->name);
+      break;
+    case DNS_NXDOMAIN:
+      LOG(LEVEL_ERROR, "mailgrave-remote: domain '%s' doesn't exist\n", dest->name.c_str());
+      failDest(dest, RCPT_FAILED);
+      return;
+    default:
+      LOG(LEVEL_ERROR, "mailgrave-remote: failed to look up MX for '%s'\n",
+                       dest->name.c_str());
+      failDest(dest, RCPT_DEFERRED);
+      return;
+  }
+  lookupHosts(dest);
+}
+
+/**
+ * Look up the IPv6 and IPv4 addresses of all hosts in dest->hosts.
+ */
+void
+lookupHosts(dest_t *dest)
+{
+  dest->found.resize(dest->hosts.size());
+  dest->lookups = dest->hosts.size() * 2;
+  // copy, the destination may be done before the loop is
+  vector<string> hosts(dest->hosts);
+  for(size_t i=0; i<hosts.size(); ++i) {
+    lookup_t *l = new lookup_t;
+    l->dest = dest;
+    l->host = i;
+    resolve(hosts[i], DNS_AAAA, onAddress, l);
+    l = new lookup_t;
+    l->dest = dest;
+    l->host = i;
+    resolve(hosts[i], DNS_A, onAddress, l);
+  }
+}
+
+void
+onAddress(void *data, const dnsresult_t *result)
+{
+  lookup_t *l = (lookup_t*)data;
+  dest_t *dest = l->dest;
+  size_t host = l->host;
+  delete l;
+
+  if (result->status==DNS_OK) {
+    unsigned long long expires = monotonicMs() + (unsigned long long)result->ttl * 1000;
+    if (expires < dest->expires)
+      dest->expires = expires;
+  }
+  vector<address_t> addrs;
+  for(size_t i=0; i<result->records.size(); ++i) {
+    const dnsrecord_t &rr = result->records[i];
+    address_t a;
+    memset(&a, 0, sizeof(a));
+    if (rr.type==DNS_A) {
+      sockaddr_in *sin = (sockaddr_in*)&a.addr;
+      sin->sin_family = AF_INET;
+      memcpy(&sin->sin_addr, rr.addr, 4);
+      a.len = sizeof(sockaddr_in);
+    } else {
+      sockaddr_in6 *sin6 = (sockaddr_in6*)&a.addr;
+      sin6->sin6_family = AF_INET6;
+      memcpy(&sin6->sin6_addr, rr.addr, 16);
+      a.len = sizeof(sockaddr_in6);
+    }
+    addrs.push_back(a);
+  }
+  // IPv6 addresses come first
+  vector<address_t> &found = dest->found[host];
+  if (!addrs.empty() && addrs[0].addr.ss_family==AF_INET6)
+    found.insert(found.begin(), addrs.begin(), addrs.end());
+  else
+    found.insert(found.end(), addrs.begin(), addrs.end());
+
+  if (--dest->lookups==0)
+    addressesFound(dest);
+}
+
+void
+addressesFound(dest_t *dest)
+{
+  // RFC 8305, 4: alternate between IPv6 and IPv4 addresses of a host
+  dest->addrs.clear();
+  for(size_t i=0; i<dest->found.size(); ++i) {
+    vector<address_t> v6, v4;
+    for(size_t j=0; j<dest->found[i].size(); ++j) {
+      address_t a = dest->found[i][j];
+      a.host = i;
+      if (a.addr.ss_family==AF_INET6)
+        v6.push_back(a);
+      else
+        v4.push_back(a);
+    }
+    for(size_t j=0; j<v6.size() || j<v4.size(); ++j) {
+      if (j<v6.size())
+        dest->addrs.push_back(v6[j]);
+      if (j<v4.size())
+        dest->addrs.push_back(v4[j]);
+    }
+  }
+  dest->found.clear();
+  if (dest->addrs.empty()) {
+    LOG(LEVEL_ERROR, "mailgrave-remote: no address found for '%s'\n", dest->name.c_str());
+    failDest(dest, RCPT_DEFERRED);
+    return;
+  }
+  LOG(LEVEL_INFO, "mailgrave-remote: '%s' has %lu addresses\n",
+                  dest->name.c_str(), (unsigned long)dest->addrs.size());
+  dest->state = D_READY;
+}
+
+/**
+ * Fail all queued jobs of the destination and look up its addresses
+ * again for the next job.
+ *
+ * \param outcome
+ *   RCPT_FAILED when the domain can't receive mail at all, RCPT_DEFERRED
+ *   when it may work later
+ */
+void
+failDest(dest_t *dest, unsigned char outcome)
+{
+  dest->state = D_NEW;
+  failQueue(dest, outcome);
+}
+
+/**
+ * Fail all queued jobs of the destination.
+ */
+void
+failQueue(dest_t *dest, unsigned char outcome)
+{
+  while(!dest->queue.empty()) {
+    job_t *job = dest->queue.front();
+    dest->queue.pop_front();
+    finishJob(job, outcome);
+  }
+}
+
+/**
+ * The destination's entry in the health file. Its slot may have been
+ * reclaimed for another destination meanwhile, then it is looked up again.
+ */
+healthentry_t*
+destHealth(dest_t *dest)
+{
+  if (!dest->health || !healthMatches(dest->health, dest->name.c_str()))
+    dest->health = findHealth(dest->name.c_str(), true);
+  return dest->health;
+}
+
+string
+lowercase(const string &s)
+{
+  string result(s);
+  for(size_t i=0; i<result.size(); ++i)
+    result[i] = tolower((unsigned char)result[i]);
+  return result;
+}
+
+string
+addressString(const address_t *a)
+{
+  char buffer[INET6_ADDRSTRLEN];
+  const void *p;
+  if (a->addr.ss_family==AF_INET6)
+    p = &((const sockaddr_in6*)&a->addr)->sin6_addr;
+  else
+    p = &((const sockaddr_in*)&a->addr)->sin_addr;
+  if (!inet_ntop(a->addr.ss_family, p, buffer, sizeof(buffer)))
+    return "?";
+  return buffer;
+}
+
+/**
+ * Create a session for the destination and start connecting.
+ */
+session_t*
+openSession(dest_t *dest)
+{
+  session_t *s = new session_t;
+  s->id = ++session_id;
+  s->dest = dest;
+  s->addrs = dest->addrs;
+  ++dest->active;
+  ++dest->opening;
+  sessions.push_back(s);
+  startConnect(s);
+  return s->closed ? 0 : s;
+}
+
+/**
+ * Start connecting to the next mail exchanger in s->addrs.
+ */
+void
+startConnect(session_t *s)
+{
+  s->state = S_CONNECT;
+  s->host = s->addrs[s->nextaddr].host;
+  if (!startAttempt(s) && s->attempts.empty()) {
+    onConnectTimeout(s);
+    return;
+  }
+  connectDeadline(s);
+}
+
+/**
+ * Start a connection attempt to the next address of the current mail
+ * exchanger. Addresses which fail immediately are skipped.
+ *
+ * \return
+ *   false when no address of the current mail exchanger is left
+ */
+bool
+startAttempt(session_t *s)
+{
+  while(s->nextaddr < s->addrs.size() &&
+        s->addrs[s->nextaddr].host == s->host)
+  {
+    size_t i = s->nextaddr++;
+    address_t a = s->addrs[i];
+    if (a.addr.ss_family==AF_INET6)
+      ((sockaddr_in6*)&a.addr)->sin6_port = htons(s->dest->port);
+    else
+      ((sockaddr_in*)&a.addr)->sin_port = htons(s->dest->port);
+
+    int fd = socket(a.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd==-1) {
+      perror("Failed to create socket");
+      continue;
+    }
+    LOG(LEVEL_INFO, "mailgrave-remote: session %u: connecting to '%s' at %s port %d\n",
+                    s->id, s->dest->name.c_str(), addressString(&a).c_str(), s->dest->port);
+    if (connect(fd, (sockaddr*) &a.addr, a.len)!=0 && errno!=EINPROGRESS) {
+      LOG(LEVEL_ERROR, "mailgrave-remote: failed to connect to '%s' at %s: %s\n",
+                       s->dest->name.c_str(), addressString(&a).c_str(), strerror(errno));
+      close(fd);
+      continue;
+    }
+    attempt_t at;
+    at.fd = fd;
+    at.serial = ++attempt_serial;
+    at.addr = i;
+    armDeadline(&at.deadline, timeout_connect);
+    s->attempts.push_back(at);
+    armDeadlineMs(&s->stagger, connect_delay);
+    return true;
+  }
+  disarmDeadline(&s->stagger);
+  return false;
+}
+
+/**
+ * A connection attempt has finished, successful or not.
+ */
+void
+onConnect(session_t *s, unsigned serial)
+{
+  size_t i;
+  for(i=0; i<s->attempts.size(); ++i) {
+    if (s->attempts[i].serial==serial)
+      break;
+  }
+  if (s->state!=S_CONNECT || i==s->attempts.size())
+    return;
+
+  int err;
+  socklen_t errlen = sizeof(err);
+  if (getsockopt(s->attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen)!=0)
+    err = errno;
+  if (err!=0) {
+    LOG(LEVEL_ERROR, "mailgrave-remote: failed to connect to '%s' at %s: %s\n",
+                     s->dest->name.c_str(),
+                     addressString(&s->addrs[s->attempts[i].addr]).c_str(),
+                     strerror(err));
+    closeAttempt(s, i);
+    // don't wait for the delay when an attempt failed
+    if (!startAttempt(s) && s->attempts.empty()) {
+      onConnectTimeout(s);
+      return;
+    }
+    connectDeadline(s);
+    return;
+  }
+
+  // the winner takes the session, the others are dropped
+  s->conn.fd = s->attempts[i].fd;
+  s->peer = s->addrs[s->attempts[i].addr];
+  s->attempts.erase(s->attempts.begin()+i);
+  while(!s->attempts.empty())
+    closeAttempt(s, 0);
+  disarmDeadline(&s->stagger);
+  LOG(LEVEL_INFO, "mailgrave-remote: session %u: connected to %s\n",
+                  s->id, addressString(&s->peer).c_str());
+  expect(s, S_GREETING, timeout_initial);
+}
+
+/**
+ * Drop attempts which timed out and start the next one when it's time.
+ * When nothing is left for the current mail exchanger, go on with the
+ * next one or give up.
+ */
+void
+onConnectTimeout(session_t *s)
+{
+  for(size_t i=s->attempts.size(); i>0; --i) {
+    if (deadlineExpired(&s->attempts[i-1].deadline)) {
+      LOG(LEVEL_ERROR, "mailgrave-remote: failed to connect to '%s' at %s: timeout\n",
+                       s->dest->name.c_str(),
+                       addressString(&s->addrs[s->attempts[i-1].addr]).c_str());
+      closeAttempt(s, i-1);
+    }
+  }
+  if (s->attempts.empty() || deadlineExpired(&s->stagger)) {
+    if (startAttempt(s) || !s->attempts.empty()) {
+      connectDeadline(s);
+      return;
+    }
+    if (s->nextaddr < s->addrs.size()) {
+      startConnect(s);
+      return;
+    }
+    LOG(LEVEL_ERROR, "mailgrave-remote: session %u: no address of '%s' is reachable\n",
+                     s->id, s->dest->name.c_str());
+    closeSession(s, true);
+    return;
+  }
+  connectDeadline(s);
+}
+
+/**
+ * Let the session's deadline expire with the earliest of its attempts'
+ * deadlines or when the next attempt is due.
+ */
+void
+connectDeadline(session_t *s)
+{
+  s->conn.deadline = s->stagger;
+  for(size_t i=0; i<s->attempts.size(); ++i) {
+    if (s->conn.deadline.when==0 ||
+        s->attempts[i].deadline.when < s->conn.deadline.when)
+      s->conn.deadline = s->attempts[i].deadline;
+  }
+}
+
+void
+closeAttempt(session_t *s, size_t i)
+{
+  close(s->attempts[i].fd);
+  s->attempts.erase(s->attempts.begin()+i);
+}
+
+/**
+ * Close the session. The sessions's job fails.
+ *
+ * When the session failed before it became ready, RFC 5321, 5.1 asks to
+ * try the next mail exchanger, so the session starts connecting again if
+ * there is one. Otherwise and when no other session is left, all queued
+ * jobs fail too as nobody is able to deliver them now.
+ */
+void
+closeSession(session_t *s, bool fail)
+{
+  dest_t *dest = s->dest;
+  if (s->closed)
+    return;
+  closeTLS(&s->conn);
+  if (s->conn.fd>=0)
+    close(s->conn.fd);
+  s->conn.fd = -1;
+  while(!s->attempts.empty())
+    closeAttempt(s, 0);
+  disarmDeadline(&s->conn.deadline);
+  bool ready = true;
+  switch(s->state) {
+    case S_CONNECT:
+    case S_GREETING:
+    case S_EHLO:
+    case S_AUTH:
+    case S_AUTH_USER:
+    case S_AUTH_PASS:
+    case S_AUTH_PLAIN:
+    case S_STARTTLS:
+    case S_TLS:
+      ready = false;
+      if (fail && s->nextaddr < s->addrs.size()) {
+        // skip the remaining addresses of the current mail exchanger
+        while(s->nextaddr < s->addrs.size() &&
+              s->addrs[s->nextaddr].host == s->host)
+          ++s->nextaddr;
+      }
+      if (fail && s->nextaddr < s->addrs.size()) {
+        s->conn.inpos = s->conn.inlen = 0;
+        s->conn.out.clear();
+        s->conn.outpos = 0;
+        s->caps.clear();
+        startConnect(s);
+        return;
+      }
+      --dest->opening;
+      break;
+    case S_IDLE:
+      --dest->idle;
+      break;
+    case S_QUIT:
+      --dest->quitting;
+      break;
+  }
+  s->closed = true;
+  --dest->active;
+  if (s->job) {
+    finishJob(s->job, RCPT_DEFERRED);
+    s->job = 0;
+  }
+  if (fail && !ready) {
+    windowDecrease(dest, "connection failed");
+    healthFailure(destHealth(dest), time(0));
+    if (dest->active==0)
+      failDest(dest, RCPT_DEFERRED);
+  }
+  LOG(LEVEL_INFO, "mailgrave-remote: session %u: closed\n", s->id);
+}
+
+void
+onTimeout(session_t *s)
+{
+  if (s->state==S_CONNECT) {
+    onConnectTimeout(s);
+    return;
+  }
+  if (s->state==S_IDLE) {
+    --s->dest->idle;
+    quitSession(s);
+    return;
+  }
+  LOG(LEVEL_ERROR, "mailgrave-remote: session %u: timeout\n", s->id);
+  if (s->state==S_TLS) {
+    failTLS(s);
+    return;
+  }
+  closeSession(s, true);
+}
+
+void
+onReadable(session_t *s)
+{
+  if (s->state==S_TLS) {
+    handshakeTLS(s);
+    return;
+  }
+  int r;
+  do {
+    r = io_read(&s->conn);
+    if (r<0) {
+      closeSession(s, true);
+      return;
+    }
+    while(s->conn.fd>=0) {
+      reply_t reply;
+      int n = readReply(&s->conn, &reply);
+      if (n==0)
+        break;
+      if (n<0) {
+        closeSession(s, true);
+        return;
+      }
+      onReply(s, &reply);
+      if (s->state==S_TLS)
+        return;
+    }
+    // OpenSSL may hold decrypted data the socket doesn't signal anymore
+  } while(r>0 && s->conn.fd>=0 && s->conn.ssl && SSL_pending(s->conn.ssl));
+  if (s->conn.fd>=0 && r==0) {
+    if (s->state!=S_QUIT)
+      LOG(LEVEL_ERROR, "mailgrave-remote: session %u: connection to server lost\n", s->id);
+    closeSession(s, s->state!=S_QUIT);
+  }
+}
+
+void
+onWritable(session_t *s)
+{
+  if (s->state==S_TLS) {
+    handshakeTLS(s);
+    return;
+  }
+  if (s->state==S_BODY) {
+    if (!pumpBody(s)) {
+      closeSession(s, true);
+      return;
+    }
+  }
+  if (!io_flush(&s->conn)) {
+    closeSession(s, true);
+    return;
+  }
+  // the command is out, now wait for the reply
+  if (s->conn.out.empty() && s->state!=S_BODY) {
+    armDeadline(&s->conn.deadline, s->replytimeout);
+    s->sent = statClock();
+  }
+}
+
+/**
+ * Switch to 'state' and wait at most 'timeout' seconds for the server's
+ * reply once all pending output was written.
+ */
+void
+expect(session_t *s, int state, unsigned timeout)
+{
+  s->state = state;
+  s->replytimeout = timeout;
+  armDeadline(&s->conn.deadline, timeout);
+}
+
+/**
+ * Process a server reply line. Multiline replies are passed line by line,
+ * with 'more' set on all but the last line.
+ */
+void
+onReply(session_t *s, const reply_t *reply)
+{
+  job_t *job = s->job;
+  const char *host = s->dest->name.c_str();
+  unsigned code = reply->code;
+  // the text points into the read buffer and isn't terminated, LOG() gets
+  // a copy: string(text, len).c_str()
+  int len = reply->len;
+  const char *text = reply->text;
+
+  if (s->state==S_EHLO && code==250)
+    parseCapability(&s->caps, reply->text, reply->len);
+  if (reply->more)
+    return;
+
+  // feed the concurrency control, replies to the body's end depend on
+  // the message's size and aren't a useful measure
+  if (s->sent) {
+    uint64_t us = statClock() - s->sent;
+    switch(s->state) {
+      case S_EHLO:
+      case S_MAIL:
+      case S_RCPT:
+      case S_DATA:
+      case S_RSET:
+        latencySample(s->dest, us / 1000);
         break;
-      d<<=8;
-      d|=*in;
-      ++in;
-      n+=8;
     }
-    base64_encode24(&out, d, n);
-    if (i<3)
+    if (s->state==S_DATA_END || s->state==S_BDAT)
+      statRecord(data_latency, us);
+    else
+      statRecord(reply_latency, us);
+  }
+  s->sent = 0;
+  switch(s->state) {
+    case S_MAIL:
+    case S_RCPT:
+    case S_DATA:
+    case S_DATA_END:
+    case S_BDAT:
+      s->dest->tempfail = 0.9 * s->dest->tempfail + (code/100==4 ? 0.1 : 0);
+      break;
+  }
+  if (code==421 || code==451)
+    windowDecrease(s->dest, code==421 ? "421 reply" : "451 reply");
+
+  switch(s->state) {
+    case S_GREETING:
+      if (code!=220) {
+        LOG(LEVEL_ERROR, "Server send error %03u %s\n", code, string(text, len).c_str());
+        closeSession(s, true);
+        return;
+      }
+      io_put(&s->conn, "EHLO ");
+      io_put(&s->conn, myhost);
+      io_put(&s->conn, "\r\n");
+      expect(s, S_EHLO, timeout_helo);
       break;
+
+    case S_EHLO:
+      if (code!=250) {
+        LOG(LEVEL_ERROR, "Server send error %03u %s\n", code, string(text, len).c_str());
+        closeSession(s, true);
+        return;
+      }
+      if ((s->caps.flags & CAP_STARTTLS) && tlsctx && !s->conn.ssl &&
+          monotonicMs() >= s->dest->notls)
+      {
+        io_put(&s->conn, "STARTTLS\r\n");
+        expect(s, S_STARTTLS, timeout_helo);
+        break;
+      }
+      authenticate(s);
+      break;
+
+    case S_STARTTLS:
+      if (code != 220) {
+        // RFC 3207, 4: the client may go on without encryption
+        LOG(LEVEL_ERROR, "Connected to '%s' but STARTTLS was rejected: %03u %s\n",
+                         host, code, string(text, len).c_str());
+        authenticate(s);
+        break;
+      }
+      if (s->conn.inpos != s->conn.inlen) {
+        // RFC 3207, 6: nothing must be accepted from before the handshake
+        LOG(LEVEL_ERROR, "mailgrave-remote: session %u: data after STARTTLS\n", s->id);
+        closeSession(s, true);
+        return;
+      }
+      startTLS(s);
+      break;
+
+    case S_AUTH:
+      if (code != 334) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but AUTH LOGIN was rejected.\n", host);
+        closeSession(s, true);
+        return;
+      } else {
+        io_put(&s->conn, auth_user.c_str());
+        expect(s, S_AUTH_USER, timeout_auth);
+      }
+      break;
+
+    case S_AUTH_USER:
+      if (code != 334) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but AUTH LOGIN's username was rejected.\n", host);
+        closeSession(s, true);
+        return;
+      } else {
+        io_put(&s->conn, auth_password.c_str());
+        expect(s, S_AUTH_PASS, timeout_auth);
+      }
+      break;
+
+    case S_AUTH_PASS:
+      if (code != 235) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but AUTH LOGIN' password was rejected.\n", host);
+        closeSession(s, true);
+        return;
+      }
+      sessionReady(s);
+      break;
+
+    case S_AUTH_PLAIN:
+      if (code != 235) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but AUTH PLAIN was rejected.\n", host);
+        closeSession(s, true);
+        return;
+      }
+      sessionReady(s);
+      break;
+
+    case S_IDLE:
+      // most likely a 421 because the server closes the connection
+      LOG(LEVEL_ERROR, "mailgrave-remote: session %u: idle session got %03u %s\n",
+                       s->id, code, string(text, len).c_str());
+      --s->dest->idle;
+      ++s->dest->quitting;
+      s->state = S_QUIT;
+      closeSession(s, false);
+      break;
+
+    case S_MAIL:
+      if (code != 250) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but MAIL FROM was rejected.\n", host);
+        goto reset;
+      }
+      s->rcpt = 0;
+      // fall through
+    case S_RCPT:
+      if (s->state==S_RCPT) {
+        if (code != 250 && code != 251) {
+          // only this recipient is settled, the others may still succeed
+          LOG(LEVEL_ERROR, "Connected to '%s' but RCPT TO:<%s> was rejected: %03u %s\n",
+                           host, job->receipients[s->rcpt].c_str(), code,
+                           string(text, len).c_str());
+          job->status[s->rcpt] = code/100==5 ? RCPT_FAILED : RCPT_DEFERRED;
+        }
+        ++s->rcpt;
+      }
+      if (s->rcpt < job->receipients.size()) {
+        io_put(&s->conn, "RCPT TO:<");
+        io_put(&s->conn, job->receipients[s->rcpt].c_str());
+        io_put(&s->conn, ">\r\n");
+        expect(s, S_RCPT, timeout_rcpt);
+        break;
+      }
+      if (find(job->status.begin(), job->status.end(), RCPT_DONE) == job->status.end())
+        goto reset;
+      startBody(s);
+      break;
+
+    case S_DATA:
+      if (code != 354) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but DATA was rejected.\n", host);
+        goto reset;
+      }
+      LOG(LEVEL_VERBOSE, "BEGIN OF DATA\n");
+      expect(s, S_BODY, timeout_data_block);
+      break;
+
+    case S_BODY:
+      LOG(LEVEL_ERROR, "mailgrave-remote: session %u: unexpected reply %03u %s\n",
+                       s->id, code, string(text, len).c_str());
+      closeSession(s, true);
+      return;
+
+    case S_BDAT:
+      if (code != 250) {
+        LOG(LEVEL_ERROR, "Connected to '%s' but BDAT was rejected.\n", host);
+        goto reset;
+      }
+      if (!s->eof) {
+        expect(s, S_BODY, timeout_data_block);
+        break;
+      }
+      // fall through
+    case S_DATA_END:
+      if (code != 250) {
+        LOG(LEVEL_ERROR, "Connected to '%s' DATA was rejected.\n", host);
+        goto reset;
+      }
+      finishJob(job, RCPT_DONE);
+      s->job = 0;
+      windowIncrease(s->dest);
+      startJob(s);
+      break;
+
+    case S_RSET:
+      if (code != 250) {
+        quitSession(s);
+        break;
+      }
+      startJob(s);
+      break;
+
+    case S_QUIT:
+      if (code != 221) {
+        LOG(LEVEL_INFO, "QUIT was rejected. (ignored)\n");
+      }
+      closeSession(s, false);
+      break;
+  }
+  return;
+
+reset:
+  // the job failed but the session can be used for the next one, a
+  // permanent error settles all recipients which weren't rejected yet
+  finishJob(job, code/100==5 ? RCPT_FAILED : RCPT_DEFERRED);
+  s->job = 0;
+  io_put(&s->conn, "RSET\r\n");
+  expect(s, S_RSET, timeout_mail);
+}
+
+/**
+ * Authenticate with the cheapest mechanism both sides support and
+ * continue with sessionReady().
+ */
+void
+authenticate(session_t *s)
+{
+  // ANONYMOUS, PLAIN, LOGIN, CRAM-MD5, DIGEST-MD5, GSSAPI, NTLM
+  // PLAIN with the initial response takes a single round trip
+  if (!auth_plain.empty() && (s->caps.auth & AUTH_PLAIN)) {
+    io_put(&s->conn, auth_plain.c_str());
+    expect(s, S_AUTH_PLAIN, timeout_auth);
+    return;
+  }
+  if (!auth_user.empty() && (s->caps.auth & AUTH_LOGIN)) {
+    io_put(&s->conn, "AUTH LOGIN\r\n");
+    expect(s, S_AUTH, timeout_auth);
+    return;
+  }
+  sessionReady(s);
+}
+
+/**
+ * The server accepted STARTTLS, begin the handshake.
+ */
+void
+startTLS(session_t *s)
+{
+  conn_t *conn = &s->conn;
+  conn->ssl = SSL_new(tlsctx);
+  if (!conn->ssl || !SSL_set_fd(conn->ssl, conn->fd)) {
+    tlsError("mailgrave-remote: SSL_new");
+    failTLS(s);
+    return;
+  }
+  SSL_set_app_data(conn->ssl, s);
+  // the name of the mail exchanger, not the one of the mail domain
+  const string &name = s->peer.host < s->dest->hosts.size() ?
+                       s->dest->hosts[s->peer.host] : s->dest->name;
+  SSL_set_tlsext_host_name(conn->ssl, name.c_str());
+  map<string, SSL_SESSION*>::iterator p = tlssessions.find(name);
+  if (p!=tlssessions.end())
+    SSL_set_session(conn->ssl, p->second);
+  s->state = S_TLS;
+  armDeadline(&conn->deadline, timeout_helo);
+  handshakeTLS(s);
+}
+
+/**
+ * Continue the handshake, then start over with EHLO as RFC 3207, 4.2
+ * asks for.
+ */
+void
+handshakeTLS(session_t *s)
+{
+  conn_t *conn = &s->conn;
+  int r = SSL_connect(conn->ssl);
+  if (r!=1) {
+    switch(SSL_get_error(conn->ssl, r)) {
+      case SSL_ERROR_WANT_READ:
+        conn->want = POLLIN;
+        return;
+      case SSL_ERROR_WANT_WRITE:
+        conn->want = POLLOUT;
+        return;
+    }
+    tlsError("mailgrave-remote: TLS handshake");
+    failTLS(s);
+    return;
+  }
+  conn->ktls = tlsKernelSend(conn->ssl);
+  LOG(LEVEL_INFO, "mailgrave-remote: session %u: %s with %s%s%s\n",
+                  s->id, SSL_get_version(conn->ssl),
+                  SSL_CIPHER_get_name(SSL_get_current_cipher(conn->ssl)),
+                  SSL_session_reused(conn->ssl) ? ", resumed" : "",
+                  conn->ktls ? ", kTLS" : "");
+  s->caps.clear();
+  io_put(conn, "EHLO ");
+  io_put(conn, myhost);
+  io_put(conn, "\r\n");
+  expect(s, S_EHLO, timeout_helo);
+}
+
+/**
+ * The TLS handshake failed. The server is reachable, so this is no
+ * connection failure: the session is closed without penalty and the
+ * destination is delivered to in cleartext for a while, which RFC 3207, 4
+ * leaves to the client.
+ */
+void
+failTLS(session_t *s)
+{
+  dest_t *dest = s->dest;
+  LOG(LEVEL_ERROR, "mailgrave-remote: session %u: TLS failed, delivering to '%s' without STARTTLS\n",
+                   s->id, dest->name.c_str());
+  dest->notls = monotonicMs() + tls_retry * 1000ULL;
+  closeSession(s, false);
+}
+
+/**
+ * Keep the session the server handed out for the next connection to it.
+ * With TLS 1.3 this happens after the handshake.
+ */
+int
+onTLSSession(SSL *ssl, SSL_SESSION *session)
+{
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (!name)
+    return 0;
+  if (tlssessions.size() >= tlssessions_max &&
+      tlssessions.find(name) == tlssessions.end())
+  {
+    // drop the expired sessions, or the oldest one when none has expired
+    long now = time(0);
+    map<string, SSL_SESSION*>::iterator oldest = tlssessions.end();
+    for(map<string, SSL_SESSION*>::iterator p = tlssessions.begin();
+        p != tlssessions.end();)
+    {
+      long t = SSL_SESSION_get_time(p->second);
+      if (t + SSL_SESSION_get_timeout(p->second) <= now) {
+        SSL_SESSION_free(p->second);
+        tlssessions.erase(p++);
+        continue;
+      }
+      if (oldest==tlssessions.end() || t < SSL_SESSION_get_time(oldest->second))
+        oldest = p;
+      ++p;
+    }
+    if (tlssessions.size() >= tlssessions_max) {
+      SSL_SESSION_free(oldest->second);
+      tlssessions.erase(oldest);
+    }
+  }
+  SSL_SESSION *&entry = tlssessions[name];
+  if (entry)
+    SSL_SESSION_free(entry);
+  entry = session;
+  return 1;
+}
+
+void
+closeTLS(conn_t *conn)
+{
+  if (!conn->ssl)
+    return;
+  SSL_shutdown(conn->ssl);
+  SSL_free(conn->ssl);
+  conn->ssl = 0;
+  conn->ktls = false;
+}
+
+/**
+ * The session has been set up and is ready to send mail.
+ */
+void
+sessionReady(session_t *s)
+{
+  --s->dest->opening;
+  healthSuccess(destHealth(s->dest));
+  startJob(s);
+}
+
+void
+quitSession(session_t *s)
+{
+  ++s->dest->quitting;
+  io_put(&s->conn, "QUIT\r\n");
+  expect(s, S_QUIT, timeout_quit);
+}
+
+/**
+ * Additive increase: a successful delivery adds 1/window to the window,
+ * thus it grows by one session when all sessions delivered a message,
+ * unless the server shows signs of load.
+ */
+void
+windowIncrease(dest_t *dest)
+{
+  if (windowCongested(dest) || dest->tempfail > tempfail_limit)
+    return;
+  unsigned old = (unsigned)dest->window;
+  dest->window += 1.0 / dest->window;
+  if (dest->window > max_per_destination)
+    dest->window = max_per_destination;
+  if ((unsigned)dest->window != old) {
+    healthentry_t *h = destHealth(dest);
+    if (h)
+      h->window = (uint32_t)dest->window;
+    LOG(LEVEL_INFO, "mailgrave-remote: window of '%s' is now %u\n",
+                    dest->name.c_str(), (unsigned)dest->window);
+  }
+}
+
+/**
+ * Multiplicative decrease: halve the window. Failures of several
+ * sessions at once are most likely caused by the same overload, thus
+ * only one decrease per 'decrease_interval' counts.
+ */
+void
+windowDecrease(dest_t *dest, const char *reason)
+{
+  unsigned long long now = monotonicMs();
+  if (dest->decreased && now - dest->decreased < decrease_interval)
+    return;
+  dest->decreased = now;
+  dest->window /= 2;
+  if (dest->window < 1)
+    dest->window = 1;
+  healthentry_t *h = destHealth(dest);
+  if (h)
+    h->window = (uint32_t)dest->window;
+  LOG(LEVEL_INFO, "mailgrave-remote: window of '%s' is now %u (%s)\n",
+                  dest->name.c_str(), (unsigned)dest->window, reason);
+}
+
+/**
+ * The server is considered loaded when its replies take much longer than
+ * they do at best.
+ */
+bool
+windowCongested(const dest_t *dest)
+{
+  return dest->srtt > 2 * dest->minrtt + latency_slack;
+}
+
+void
+latencySample(dest_t *dest, unsigned long long ms)
+{
+  if (dest->srtt==0) {
+    dest->srtt = dest->minrtt = ms;
+    return;
+  }
+  dest->srtt = 0.875 * dest->srtt + 0.125 * ms;
+  // forget the best case slowly, the route or the server may change
+  if (ms < dest->minrtt)
+    dest->minrtt = ms;
+  else
+    dest->minrtt += (dest->srtt - dest->minrtt) / 256;
+  if (windowCongested(dest))
+    windowDecrease(dest, "latency");
+}
+
+/**
+ * Take the next job of the session's destination, or wait for one.
+ */
+void
+startJob(session_t *s)
+{
+  dest_t *dest = s->dest;
+  // the window shrank, close sessions above it
+  if (dest->active - dest->quitting > (unsigned)dest->window) {
+    if (s->state==S_IDLE)
+      --dest->idle;
+    LOG(LEVEL_INFO, "mailgrave-remote: session %u: above the window of '%s', closing\n",
+                    s->id, dest->name.c_str());
+    quitSession(s);
+    return;
+  }
+  if (dest->queue.empty()) {
+    if (s->state!=S_IDLE) {
+      ++dest->idle;
+      expect(s, S_IDLE, timeout_idle);
+    }
+    return;
+  }
+  if (s->state==S_IDLE)
+    --dest->idle;
+  s->job = dest->queue.front();
+  dest->queue.pop_front();
+  LOG(LEVEL_INFO, "mailgrave-remote: session %u: sending mail from '%s'\n",
+                  s->id, s->job->sender.c_str());
+
+  io_put(&s->conn, "MAIL FROM:<");
+  io_put(&s->conn, s->job->sender.c_str());
+  io_put(&s->conn, ">\r\n");
+  expect(s, S_MAIL, timeout_mail);
+}
+
+/**
+ * All recipients were accepted, start the transfer of the message.
+ *
+ * RFC 3030: with CHUNKING the body needs CRLF line endings but no
+ * dot-stuffing, a wire format file with dots must go through DATA.
+ */
+void
+startBody(session_t *s)
+{
+  job_t *job = s->job;
+  s->eof = false;
+  // the descriptor may be shared by several sessions, thus the message is
+  // read with pread() and sendfile() at the session's own offset
+  s->offset = job->start;
+  s->end = s->offset;
+  if (job->flags & ENV_WIRE) {
+    struct stat st;
+    if (fstat(job->datafd, &st)!=0) {
+      perror("mailgrave-remote: fstat");
+      closeSession(s, true);
+      return;
+    }
+    s->end = st.st_size;
+  }
+
+  if ((s->caps.flags & CAP_CHUNKING) && !(job->flags & ENV_WIRE)) {
+    s->body = BODY_CHUNKS;
+    s->bodystate = WIRE_BOL;
+    LOG(LEVEL_VERBOSE, "BEGIN OF BDAT\n");
+    expect(s, S_BODY, timeout_data_block);
+  } else
+  if ((s->caps.flags & CAP_CHUNKING) && (job->flags & ENV_NODOTS)) {
+    s->body = BODY_FILE;
+    s->dot = false;
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "BDAT %llu LAST\r\n",
+             (unsigned long long)(s->end - s->offset));
+    io_put(&s->conn, cmd);
+    LOG(LEVEL_VERBOSE, "(%llu bytes from file)\n", (unsigned long long)(s->end - s->offset));
+    expect(s, S_BODY, timeout_data_block);
+  } else {
+    s->body = (job->flags & ENV_WIRE) ? BODY_FILE : BODY_STUFF;
+    s->dot = true;
+    s->bodystate = WIRE_BOL;
+    io_put(&s->conn, "DATA\r\n");
+    expect(s, S_DATA, timeout_data_init);
+  }
+}
+
+/**
+ * Called when the socket is writable in state S_BODY: produce more output
+ * and switch to waiting for the reply when all of the message is out.
+ */
+bool
+pumpBody(session_t *s)
+{
+  job_t *job = s->job;
+  conn_t *out = &s->conn;
+
+  if (s->body==BODY_FILE && out->ssl && !out->ktls) {
+    // OpenSSL has to encrypt the message, keep at most 64k buffered
+    while(s->offset < s->end && out->out.size() - out->outpos < 65536) {
+      char buffer[16384];
+      size_t n = s->end - s->offset < (off_t)sizeof(buffer) ?
+                 s->end - s->offset : sizeof(buffer);
+      ssize_t l = pread(job->datafd, buffer, n, s->offset);
+      if (l<0) {
+        if (errno==EINTR)
+          continue;
+        perror("mailgrave-remote: read");
+        return false;
+      }
+      if (l==0) {
+        LOG(LEVEL_ERROR, "mailgrave-remote: unexpected end of file\n");
+        return false;
+      }
+      io_write(out, buffer, l);
+      s->offset += l;
+    }
+    if (s->offset < s->end)
+      return true;
+  }
+
+  if (s->body==BODY_FILE) {
+    if (!io_flush(out))
+      return false;
+    if (out->outpos < out->out.size())
+      return true;
+    while(s->offset < s->end) {
+      ssize_t n = sendfile(out->fd, job->datafd, &s->offset, s->end - s->offset);
+      if (n<0) {
+        if (errno==EINTR)
+          continue;
+        if (errno==EAGAIN) {
+          armDeadline(&out->deadline, timeout_data_block);
+          return true;
+        }
+        perror("mailgrave-remote: sendfile");
+        return false;
+      }
+      if (n==0) {
+        LOG(LEVEL_ERROR, "mailgrave-remote: unexpected end of file\n");
+        return false;
+      }
+      statAdd(&stats->bytes_out, n);
+      armDeadline(&out->deadline, timeout_data_block);
+    }
+    s->eof = true;
+    if (s->dot) {
+      LOG(LEVEL_VERBOSE, "END OF DATA\n");
+      io_put(out, ".\r\n");
+      expect(s, S_DATA_END, timeout_data_term);
+    } else {
+      expect(s, S_BDAT, timeout_data_term);
+    }
+    return true;
+  }
+
+  if (s->body==BODY_CHUNKS) {
+    // one chunk per reply
+    static const size_t chunksize = 65536;
+    char ibuf[chunksize];
+    char obuf[chunksize*2+2];
+    ssize_t l;
+    while((l = pread(job->datafd, ibuf, chunksize, s->offset))<0 && errno==EINTR);
+    if (l<0) {
+      perror("mailgrave-remote: read");
+      return false;
+    }
+    size_t n = 0;
+    for(const char *p = ibuf, *e = ibuf + l; p != e; ) {
+      struct iovec iov[256];
+      size_t niov;
+      p += wireSpans(p, e-p, &s->bodystate, false, iov, 256, &niov);
+      for(size_t i=0; i<niov; ++i) {
+        memcpy(obuf + n, iov[i].iov_base, iov[i].iov_len);
+        n += iov[i].iov_len;
+      }
+    }
+    s->offset += l;
+    s->eof = l==0;
+    if (s->eof) {
+      const char *tail = wireTail(s->bodystate);
+      memcpy(obuf + n, tail, strlen(tail));
+      n += strlen(tail);
+    }
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "BDAT %lu%s\r\n",
+             (unsigned long)n, s->eof ? " LAST" : "");
+    io_put(out, cmd);
+    LOG(LEVEL_VERBOSE, "(%lu bytes)\n", (unsigned long)n);
+    if (s->eof)
+      LOG(LEVEL_VERBOSE, "END OF BDAT\n");
+    io_write(out, obuf, n);
+    expect(s, S_BDAT, s->eof ? timeout_data_term : timeout_data_block);
+    return true;
+  }
+
+  // BODY_STUFF: the converted blocks are written straight from the read
+  // buffer, only what the socket doesn't take at once is copied into the
+  // output buffer, which holds at most 64k
+  while(out->out.size() - out->outpos < 65536) {
+    char buffer[16384];
+    ssize_t l = pread(job->datafd, buffer, sizeof(buffer), s->offset);
+    if (l<0) {
+      if (errno==EINTR)
+        continue;
+      perror("mailgrave-remote: read");
+      return false;
+    }
+    if (l==0) {
+      io_put(out, wireTail(s->bodystate));
+      s->eof = true;
+      LOG(LEVEL_VERBOSE, "END OF DATA\n");
+      io_put(out, ".\r\n");
+      expect(s, S_DATA_END, timeout_data_term);
+      return true;
+    }
+    s->offset += l;
+    for(const char *p = buffer, *e = buffer + l; p != e; ) {
+      struct iovec iov[256];
+      size_t niov;
+      p += wireSpans(p, e-p, &s->bodystate, true, iov, 256, &niov);
+      if (!io_writev(out, iov, niov))
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Parse a single server response line from the input buffer.
+ *
+ * \param server
+ *   the connection with the server
+ * \param reply
+ *   out: the reply line, its text stays valid until the next io_read()
+ * \return
+ *   1 when a line was parsed, 0 when the line isn't complete yet and -1
+ *   for a malformed response
+ */
+int
+readReply(conn_t *server, reply_t *reply)
+{
+  const char *p = server->in + server->inpos;
+  const char *e = server->in + server->inlen;
+  const char *next;
+  int r = parseReply(p, e, reply, &next);
+  if (r==0) {
+    if (server->inpos==0 && server->inlen==sizeof(server->in)) {
+      LOG(LEVEL_ERROR, "Unexpected response: line too long\n");
+      return -1;
+    }
+    return 0;
+  }
+  server->inpos = next - server->in;
+
+  LOG_BYTES(LEVEL_VERBOSE, p, next - p);
+
+  if (r<0) {
+    LOG(LEVEL_ERROR, "Unexpected response: expected three digits followed by "
+                     "' ', '-' or '\\r\\n'\n");
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * methods for reading data from the server
+ */
+
+/**
+ * Read whatever is available into the input buffer.
+ *
+ * \return
+ *   1 when data was read or none is available, 0 on end of file and -1
+ *   on error
+ */
+int
+io_read(conn_t *f)
+{
+  if (f->inpos>0) {
+    memmove(f->in, f->in + f->inpos, f->inlen - f->inpos);
+    f->inlen -= f->inpos;
+    f->inpos = 0;
+  }
+  if (f->inlen==sizeof(f->in))
+    return 1;
+  if (f->ssl) {
+    int n = SSL_read(f->ssl, f->in + f->inlen, sizeof(f->in) - f->inlen);
+    if (n>0) {
+      f->inlen += n;
+      return 1;
+    }
+    switch(SSL_get_error(f->ssl, n)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        return 1;
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    }
+    tlsError("mailgrave-remote: SSL_read");
+    return -1;
+  }
+  while(true) {
+    ssize_t n = read(f->fd, f->in + f->inlen, sizeof(f->in) - f->inlen);
+    if (n>0) {
+      f->inlen += n;
+      return 1;
+    }
+    if (n==0)
+      return 0;
+    if (errno==EINTR)
+      continue;
+    if (errno==EAGAIN)
+      return 1;
+    perror("mailgrave-remote: read");
+    return -1;
+  }
+}
+
+/*
+ * methods for writing data to the server which also log it as
+ * LEVEL_VERBOSE
+ */
+void
+io_put(conn_t *f, const char *s)
+{
+  size_t n = strlen(s);
+  LOG_BYTES(LEVEL_VERBOSE, s, n);
+  f->out.append(s, n);
+}
+
+void
+io_write(conn_t *f, const char *s, size_t n)
+{
+  f->out.append(s, n);
+}
+
+/**
+ * Write 'iov' to the server. When no output is pending the data goes out
+ * with a single writev() and only the rest which the socket didn't take
+ * is copied into the output buffer. Without kTLS the data of a TLS
+ * connection always takes the way through the output buffer.
+ *
+ * \return
+ *   false on error
+ */
+bool
+io_writev(conn_t *f, const struct iovec *iov, size_t n)
+{
+  if (LOG_ENABLED(LEVEL_VERBOSE)) {
+    for(size_t i=0; i<n; ++i)
+      LOG_BYTES(LEVEL_VERBOSE, (const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  size_t written = 0;
+  if (f->outpos == f->out.size() && (!f->ssl || f->ktls)) {
+    while(true) {
+      ssize_t r = writev(f->fd, iov, n);
+      if (r>=0) {
+        written = r;
+        statAdd(&stats->bytes_out, r);
+        if (r>0)
+          armDeadline(&f->deadline, timeout_data_block);
+        break;
+      }
+      if (errno==EINTR)
+        continue;
+      if (errno==EAGAIN)
+        break;
+      perror("mailgrave-remote: writev");
+      return false;
+    }
+  }
+  for(size_t i=0; i<n; ++i) {
+    if (written >= iov[i].iov_len) {
+      written -= iov[i].iov_len;
+      continue;
+    }
+    f->out.append((const char*)iov[i].iov_base + written, iov[i].iov_len - written);
+    written = 0;
+  }
+  return true;
+}
+
+/**
+ * Write as much of the collected output as the socket takes without
+ * blocking. Each write which makes progress restarts the deadline with
+ * 'timeout_data_block'.
+ *
+ * \return
+ *   false on error
+ */
+bool
+io_flush(conn_t *f)
+{
+  while(f->outpos < f->out.size()) {
+    if (f->ssl && !f->ktls) {
+      int n = SSL_write(f->ssl, f->out.data()+f->outpos, f->out.size()-f->outpos);
+      if (n>0) {
+        f->outpos += n;
+        statAdd(&stats->bytes_out, n);
+        armDeadline(&f->deadline, timeout_data_block);
+        continue;
+      }
+      switch(SSL_get_error(f->ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+          return true;
+      }
+      tlsError("mailgrave-remote: SSL_write");
+      return false;
+    }
+    ssize_t n = write(f->fd, f->out.data()+f->outpos, f->out.size()-f->outpos);
+    if (n>=0) {
+      f->outpos += n;
+      statAdd(&stats->bytes_out, n);
+      armDeadline(&f->deadline, timeout_data_block);
+      continue;
+    }
+    if (errno==EINTR)
+      continue;
+    if (errno==EAGAIN)
+      return true;
+    perror("mailgrave-remote: write");
+    return false;
+  }
+  f->out.clear();
+  f->outpos = 0;
+  return true;
+}
+
+/*
+ * BASE64 encoding
+ */
+
+static const char base64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Encode 'in' with BASE64, RFC 4648, 4.
+ */
+string
+base64(const string &in)
+{
+  string out;
+  out.reserve((in.size()+2)/3*4);
+  const unsigned char *p = (const unsigned char*)in.data();
+  size_t n = in.size();
+  for(; n>=3; p+=3, n-=3) {
+    unsigned long d = (p[0]<<16) | (p[1]<<8) | p[2];
+    out += base64_alphabet[(d>>18)&63];
+    out += base64_alphabet[(d>>12)&63];
+    out += base64_alphabet[(d>> 6)&63];
+    out += base64_alphabet[ d     &63];
+  }
+  if (n) {
+    unsigned long d = (p[0]<<16) | (n>1 ? p[1]<<8 : 0);
+    out += base64_alphabet[(d>>18)&63];
+    out += base64_alphabet[(d>>12)&63];
+    out += n>1 ? base64_alphabet[(d>>6)&63] : '=';
+    out += '=';
   }
-  *out = 0;
-  return 0;
+  return out;
 }
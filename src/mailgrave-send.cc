@@ -22,15 +22,19 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/wait.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
 
@@ -38,19 +42,41 @@
 #include "status.hh"
 #include "createsocket.hh"
 #include "opensocket.hh"
+#include "handoff.hh"
+#include "envelope.hh"
+#include "health.hh"
+#include "stats.hh"
+#include "trace.hh"
+#include "log.hh"
 
 #include <string>
 #include <vector>
+#include <map>
 using std::string;
 using std::vector;
+using std::map;
 
+static bool skipMail(unsigned long long);
 static bool handleMail(unsigned long long);
-static bool copyfile(FILE *out, int in);
+static void queueStats(unsigned long long head, unsigned long long tail);
+static bool copyfile(FILE *out, int in, bool unstuff);
+static bool bounce(unsigned long long id, int datfd, const string &sender,
+                   const vector<string> &failed);
 
-static int verbose = 0;
+static bool handoff = false;
 
 const char *in = "send.ctrl";
 const char *out = "remote.ctrl";
+const char *queue = "queue.ctrl";
+const char *healthfile = "health";
+static bool health = false;
+static const char *statsfile = 0;
+// for mailgrave-stat: the time to hand a message over and have it settled
+// and the time from being queued until the first attempt
+static histogram_t *handle_latency, *queue_delay;
+
+// the envelope's host field of messages which are still queued
+static map<unsigned long long, string> hosts;
 
 static void
 usage()
@@ -67,12 +93,29 @@ usage()
     "    UNIX domain socket to listen on. Defaults to 'send.ctrl'.\n"
     "  --out <socket>\n"
     "    Defaults to 'remote.ctrl' for now...\n"
+    "  --queue <socket>\n"
+    "    mailgrave-queue's socket to hand bounces to. Defaults to\n"
+    "    'queue.ctrl'.\n"
+    "  --health <file>\n"
+    "    File written by mailgrave-remote to tell which destinations are\n"
+    "    down, their messages are skipped. Defaults to 'health'.\n"
+    "  --stats <file>\n"
+    "    Count the settled recipients and keep the queue's depth in this\n"
+    "    file for mailgrave-stat.\n"
+    "  --trace <file>\n"
+    "    Append a record to this file for each attempt and its outcome, see\n"
+    "    mailgrave-trace.\n"
+    "  --handoff\n"
+    "    Pass the queue file's descriptor to mailgrave-remote instead of\n"
+    "    copying its content, mailgrave-remote must use --handoff too.\n"
     "  --chroot <directory>\n"
     "    change root directory after setup\n"
     "  --user <user>[:<group>]\n"
     "    change user/group after setup\n"
+    "  --log-level error|info|verbose\n"
+    "    Log only up to this level, default is info\n"
     "  --verbose | -v\n"
-    "    Be verbose\n"
+    "    Be verbose, short for --log-level verbose\n"
     "  --help\n"
     "    show this help text\n"
     "\n"
@@ -82,8 +125,6 @@ usage()
 int
 main(int argc, char **argv)
 {
-  setvbuf(stdout, 0, _IONBF, 0);
-
   cug_t cug;
 
   // parse argument list
@@ -102,10 +143,41 @@ main(int argc, char **argv)
       }
       out = argv[++i];
     } else
+    if (strcmp(argv[i], "--queue")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      queue = argv[++i];
+    } else
+    if (strcmp(argv[i], "--health")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      healthfile = argv[++i];
+    } else
+    if (strcmp(argv[i], "--stats")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      statsfile = argv[++i];
+    } else
+    if (strcmp(argv[i], "--trace")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      if (!openTrace(argv[++i]))
+        LOG(LEVEL_ERROR, "mailgrave-send: continuing without trace\n");
+    } else
     if (chrootOrUser(argc, argv, &i, &cug)) {
     } else
-    if (strcmp(argv[i], "--verbose")==0 || strcmp(argv[i], "-v")==0) {
-      ++verbose;
+    if (strcmp(argv[i], "--handoff")==0) {
+      handoff = true;
+    } else
+    if (logOption(argc, argv, &i)) {
     } else
     if (strcmp(argv[i], "--help")==0) {
       usage();
@@ -135,10 +207,16 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  if (statsfile && !mapStats(statsfile, "send"))
+    LOG(LEVEL_ERROR, "mailgrave-send: continuing without statistics\n");
+  handle_latency = statHistogram("handleMail");
+  queue_delay = statHistogram("delay");
+
   // change root, uid, gid
   if (!setChrootUidGid(&cug))
     return EXIT_FAILURE;
 
+  logStart();
   status_t *status = mapStatus();
   
   unsigned long long head, tail;
@@ -148,10 +226,10 @@ main(int argc, char **argv)
   tail = status->tail;
   unlockStatus();
   
-  printf("mailgrave-send started: head: %llu, tail: %llu, size: %llu\n",
-         head, 
-         tail,
-         head<=tail ? tail-head : ULLONG_MAX-head+tail);
+  LOG(LEVEL_INFO, "mailgrave-send started: head: %llu, tail: %llu, size: %llu\n",
+                  head, 
+                  tail,
+                  head<=tail ? tail-head : ULLONG_MAX-head+tail);
 
   timeval t0, t1;
   gettimeofday(&t0, NULL);
@@ -167,13 +245,21 @@ main(int argc, char **argv)
     
     unsigned long long i = timeout ? head : oldtail;
     bool error = false;
+    // mailgrave-remote creates the file
+    if (!health)
+      health = mapHealth(healthfile, false);
     while(i != tail) {
 //      printf("%s: handle mail %llu\n", argv[0], i);
-      if (handleMail(i)) {
-        if (!error)
-          head = i+1; // advance head
-      } else {
+      if (skipMail(i)) {
         error = true;
+      } else {
+        uint64_t started = statClock();
+        bool handled = handleMail(i);
+        statRecord(handle_latency, statClock() - started);
+        if (!handled)
+          error = true;
+        else if (!error)
+          head = i+1; // advance head
       }
       if (i == ULLONG_MAX)
         i = 0;
@@ -181,6 +267,7 @@ main(int argc, char **argv)
         ++i;
     }
     timeout = false;
+    queueStats(head, tail);
     
     fd_set rd;
     FD_ZERO(&rd);
@@ -193,23 +280,27 @@ main(int argc, char **argv)
     while(t1.tv_sec >= t0.tv_sec)
       t0.tv_sec += 30 * 60; 
     t1.tv_usec = 0;
-    t1.tv_sec = t0.tv_sec - t1.tv_sec;
+    time_t retry = healthNextRetry(t1.tv_sec);
+    if (retry && retry < t0.tv_sec)
+      t1.tv_sec = retry - t1.tv_sec;
+    else
+      t1.tv_sec = t0.tv_sec - t1.tv_sec;
     
-    printf("%s: waiting for socket (head=%llu, tail=%llu, %lus)\n",
-           argv[0], head, tail, t1.tv_sec);
+    LOG(LEVEL_INFO, "%s: waiting for socket (head=%llu, tail=%llu, %lus)\n",
+                    argv[0], head, tail, t1.tv_sec);
 
     int r;
     while(true) {
       r = select(sock+1, &rd, 0, 0, &t1);
       if (r>=0)
         break;
-      printf("%s: select error: %s\n", argv[0], strerror(errno));
+      LOG(LEVEL_ERROR, "%s: select error: %s\n", argv[0], strerror(errno));
     }
     if (r==0) {
-      printf("%s: awoke because of timeout\n", argv[0]);
+      LOG(LEVEL_INFO, "%s: awoke because of timeout\n", argv[0]);
       timeout = true;
     } else {
-      printf("%s: awoke because of signal\n", argv[0]);
+      LOG(LEVEL_INFO, "%s: awoke because of signal\n", argv[0]);
       struct sockaddr_un addr;
       socklen_t addrlen = sizeof(addr);
       int client = accept(sock, (struct sockaddr*) &addr, &addrlen);
@@ -226,12 +317,60 @@ main(int argc, char **argv)
   unmapStatus();
 }
 
+/**
+ * Tell mailgrave-stat the number of messages in the queue and since when
+ * the oldest one waits.
+ */
+static void
+queueStats(unsigned long long head, unsigned long long tail)
+{
+  statSet(&stats->depth, head<=tail ? tail-head : ULLONG_MAX-head+tail);
+  uint64_t oldest = 0;
+  struct stat st;
+  char datname[64];
+  for(unsigned long long i=head; i!=tail; i = i==ULLONG_MAX ? 0 : i+1) {
+    // the messages before 'head' are gone, a hole is one sent meanwhile
+    snprintf(datname, sizeof(datname), "%020llX.dat", i);
+    if (stat(datname, &st)==0) {
+      oldest = st.st_mtime;
+      break;
+    }
+  }
+  statSet(&stats->oldest, oldest);
+}
+
+/**
+ * Return 'true' when the mail's destination is known to be down. The
+ * destination is only known after handleMail() has seen the envelope
+ * once, the relay is known in advance.
+ */
+static bool
+skipMail(unsigned long long id)
+{
+  if (!health)
+    return false;
+  const char *name = healthRelay();
+  if (!name) {
+    map<unsigned long long, string>::iterator p = hosts.find(id);
+    if (p==hosts.end() || p->second.empty())
+      return false;
+    name = p->second.c_str();
+  }
+  if (!healthDown(name, time(0)))
+    return false;
+  LOG(LEVEL_VERBOSE, "skip %020llX, '%s' is down\n", id, name);
+  return true;
+}
+
 /**
  * handle a mail
  * returns 'true' when the mail was removed from the queue.
  *
- * we're also not keeping track of the number of retries. this information
- * could be placed at the head of the .env file.
+ * Only the recipients still marked with 'T' are handed to
+ * mailgrave-remote, the records of those which are settled afterwards are
+ * updated in place. The mail is removed once no 'T' is left.
+ *
+ * The attempts are counted in the envtrace_t of envelopes with ENV_TRACE.
  */
 static bool
 handleMail(unsigned long long id)
@@ -239,9 +378,20 @@ handleMail(unsigned long long id)
   int state = 0;
   int type;
   string user, user1, domain;
-  vector<char *> args;
-  FILE *envf, *out;
-  int sock;
+  string envelope, host, sender;
+  bool samedomain = true;
+  unsigned count = 0;
+  off_t pos = ENV_HEADER_SIZE, record = 0;
+  vector<off_t> records;  // offsets of the 'T' records sent
+  vector<string> rcpts;
+  vector<string> bounced; // recipients marked 'X', for the bounce
+  vector<unsigned char> result;
+  size_t n = 0;
+  unsigned deferred = 0, delivered = 0, failed = 0;
+  envtrace_t stamps;
+  uint64_t now;
+  FILE *envf, *out = 0;
+  int sock = -1;
   const char *name = ::out;
 
   char datname[64];
@@ -250,37 +400,53 @@ handleMail(unsigned long long id)
   snprintf(envname, sizeof(envname), "%020llX.env", id);
 
   int datfd = open(datname, O_RDONLY);
-  envf = fopen(envname, "r");
+  envf = fopen(envname, "r+");
   if (datfd<0 && envf==0) {
-    printf("skip %020llX, already sent\n", id);
+    LOG(LEVEL_INFO, "skip %020llX, already sent\n", id);
     return true;
   }
   if (datfd<0) {
-    printf("failed to open data file '%s': %s\n", datname, strerror(errno));
+    LOG(LEVEL_ERROR, "failed to open data file '%s': %s\n", datname, strerror(errno));
     goto error;
   }
   if (envf==0) {
-    printf("failed to open envelope file '%s': %s\n", envname, strerror(errno));
+    LOG(LEVEL_ERROR, "failed to open envelope file '%s': %s\n", envname, strerror(errno));
     goto error;
   }
 
-  printf("transmit %020llX\n", id);
+  LOG(LEVEL_INFO, "transmit %020llX\n", id);
 
-  fseek(envf, 8, SEEK_SET);
+  unsigned char header[ENV_HEADER_SIZE];
+  if (fread(header, ENV_HEADER_SIZE, 1, envf)!=1) {
+    LOG(LEVEL_ERROR, "failed to read envelope header '%s'\n", envname);
+    goto error;
+  }
+  memset(&stamps, 0, sizeof(stamps));
+  if (header[0] & ENV_TRACE) {
+    if (fread(&stamps, sizeof(stamps), 1, envf)!=1) {
+      LOG(LEVEL_ERROR, "failed to read envelope header '%s'\n", envname);
+      goto error;
+    }
+    pos += sizeof(stamps);
+  }
 
-  // the code below is a bit oversized in the moment but it will be
-  // used to implement the decision where a package will be delivered
-  // to, thus the parsing of the addresses
-  
-  // open connection to mailgrave-remote
-  sock = openUNIXSocket(name);
-  if (sock<0) {
-    perror("failed to connect to socket");
-    return false;
+  // the first attempt, how long did the message wait for it?
+  now = traceClock();
+  if (header[0] & ENV_TRACE) {
+    if (stamps.first==0)
+      statRecord(queue_delay, now>stamps.stored ? now - stamps.stored : 0);
+  } else
+  if (hosts.find(id)==hosts.end()) {
+    struct stat st;
+    if (fstat(datfd, &st)==0) {
+      uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000 +
+                       st.st_mtim.tv_nsec / 1000;
+      statRecord(queue_delay, now>mtime ? now - mtime : 0);
+    }
   }
-  out = fdopen(sock, "w");
-  
-  putc_unlocked(0, out); // empty hostname for now
+
+  // the host field tells mailgrave-remote the recipients' domain, it
+  // stays empty when they are in different domains
 
   // parse envelope file
   while(state!=100) {
@@ -289,12 +455,15 @@ handleMail(unsigned long long id)
       case 0:
         user.clear();
         domain.clear();
+        record = pos;
         switch(c) {
           case EOF:
             state = 100;
             break;
           case 'T':
           case 'F':
+          case 'D':
+          case 'X':
             type = c;
             state = 1;
             break;
@@ -318,52 +487,183 @@ handleMail(unsigned long long id)
             break;
           case '\0':
             user = user1 + user;
+            if (type=='F' && user.empty() && domain.empty()) {
+              // the null reverse-path of a bounce, RFC 5321, 4.5.5
+              envelope += '\0';
+              state = 0;
+              break;
+            }
             if (user.empty()) {
               user = domain;
               domain = "localhost";
             }
-            printf("  found '%c' '%s' @ '%s'\n",
-                   type, user.c_str(), domain.c_str());
+            LOG(LEVEL_INFO, "  found '%c' '%s' @ '%s'\n",
+                            type, user.c_str(), domain.c_str());
             state = 0;
-            fwrite(user.c_str(), user.size(), 1, out);
-            putc('@', out);
-            fwrite(domain.c_str(), domain.size()+1, 1, out);
+            if (type=='X')
+              bounced.push_back(user + '@' + domain);
+            if (type=='D' || type=='X')
+              break;
+            if (type=='F')
+              sender = user + '@' + domain;
+            envelope += user;
+            envelope += '@';
+            envelope += domain;
+            envelope += '\0';
+            if (type=='T') {
+              if (count==0)
+                host = domain;
+              else if (strcasecmp(host.c_str(), domain.c_str())!=0)
+                samedomain = false;
+              ++count;
+              records.push_back(record);
+              rcpts.push_back(user + '@' + domain);
+            }
             break;
           default:
             domain += c;
         }
     }
+    ++pos;
+  }
+
+  if (count==0) {
+    LOG(LEVEL_INFO, "all recipients of %020llX are settled\n", id);
+    goto done;
   }
   
-  putc(0, out); // end of envelope marker
+  envelope += '\0'; // end of envelope marker
+  if (!samedomain)
+    host.clear();
+  envelope.insert(0, 1, '\0');
+  envelope.insert(0, host);
+  hosts[id] = host;
 
-  if (!copyfile(out, datfd)) {
-    goto error;
+  ++stamps.attempts;
+  if (stamps.first==0)
+    stamps.first = now;
+  stamps.last = now;
+  if ((header[0] & ENV_TRACE) &&
+      pwrite(fileno(envf), &stamps, sizeof(stamps), ENV_HEADER_SIZE)!=sizeof(stamps))
+  {
+    LOG(LEVEL_ERROR, "mailgrave-send: failed to update '%s': %s\n",
+                     envname, strerror(errno));
   }
-  fflush(out);
-  if (shutdown(sock, SHUT_WR)==-1) {
-    perror("mailgrave-send: shutdown");
+  trace(id, TRACE_ATTEMPT, now, stamps.attempts);
+
+  // open connection to mailgrave-remote
+  sock = openUNIXSocket(name, handoff ? SOCK_SEQPACKET : SOCK_STREAM);
+  if (sock<0) {
+    perror("failed to connect to socket");
     goto error;
   }
+
+  if (handoff) {
+    // mailgrave-remote reads the message straight from the queue file
+    if (!sendHandoff(sock, datfd, header[0], count, envelope))
+      goto error;
+  } else {
+    out = fdopen(sock, "w");
+    fwrite(envelope.data(), envelope.size(), 1, out);
+    // mailgrave-remote will apply the dot-stuffing itself
+    if (!copyfile(out, datfd, (header[0] & (ENV_WIRE|ENV_NODOTS))==ENV_WIRE)) {
+      goto error;
+    }
+    fflush(out);
+    if (shutdown(sock, SHUT_WR)==-1) {
+      perror("mailgrave-send: shutdown");
+      goto error;
+    }
+  }
+  {
+    struct stat st;
+    if (fstat(datfd, &st)==0)
+      statAdd(&stats->bytes_out, st.st_size);
+  }
   
-  char result;
-  if (read(sock, &result, 1)!=1) {
-    perror("mailgrave-send: unabled to read delivery process result\n");
+  // one status per recipient, a short answer defers the remaining ones
+  result.resize(count);
+  while(n<count) {
+    ssize_t l = read(sock, &result[n], count-n);
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<0)
+      perror("mailgrave-send: unabled to read delivery process result");
+    if (l<=0)
+      break;
+    n += l;
+  }
+  if (n==0) {
+    LOG(LEVEL_ERROR, "mailgrave-send: delivery process failed\n");
     goto error;
   }
-  if (!result) {
-    printf("mailgrave-send: delivery process failed\n");
+
+  for(unsigned i=0; i<count; ++i) {
+    char mark;
+    switch(i<n ? result[i] : RCPT_DEFERRED) {
+      case RCPT_DONE:
+        mark = 'D';
+        ++delivered;
+        statAdd(&stats->delivered, 1);
+        break;
+      case RCPT_FAILED:
+        LOG(LEVEL_ERROR, "mailgrave-send: delivery to '%s' failed\n", rcpts[i].c_str());
+        mark = 'X';
+        ++failed;
+        bounced.push_back(rcpts[i]);
+        statAdd(&stats->failed, 1);
+        break;
+      default:
+        ++deferred;
+        statAdd(&stats->deferred, 1);
+        continue;
+    }
+    if (pwrite(fileno(envf), &mark, 1, records[i])!=1) {
+      LOG(LEVEL_ERROR, "mailgrave-send: failed to update '%s': %s\n",
+                       envname, strerror(errno));
+      goto error;
+    }
+  }
+  now = traceClock();
+  if (delivered)
+    trace(id, TRACE_DELIVERED, now, delivered);
+  if (failed)
+    trace(id, TRACE_FAILED, now, failed);
+  if (deferred)
+    trace(id, TRACE_DEFERRED, now, deferred);
+  if (deferred) {
+    LOG(LEVEL_INFO, "mailgrave-send: delivery to %u of %u recipients deferred\n",
+                    deferred, count);
     goto error;
   }
 
-  fclose(out);
+  if (out)
+    fclose(out);
+  else
+    close(sock);
+  out = 0;
+  sock = -1;
 
+done:
+  // permanent failures are final, the sender learns about them before the
+  // message is gone
+  if (!bounced.empty()) {
+    if (sender.empty()) {
+      LOG(LEVEL_ERROR, "mailgrave-send: %020llX failed for %u recipients, not bouncing a bounce\n",
+                       id, (unsigned)bounced.size());
+    } else
+    if (!bounce(id, datfd, sender, bounced)) {
+      goto error;
+    }
+  }
   if (datfd>=0)
     close(datfd);
   if (envf!=0)
     fclose(envf);
   unlink(datname);
   unlink(envname);
+  hosts.erase(id);
+  trace(id, TRACE_DONE, traceClock(), stamps.attempts);
   return true;
   
 error:
@@ -371,22 +671,150 @@ error:
     close(datfd);
   if (envf!=0)
     fclose(envf);
-  fclose(out);
+  if (out)
+    fclose(out);
+  else if (sock>=0)
+    close(sock);
   return false;
 }
 
+/**
+ * Hand a bounce for the recipients which failed permanently to
+ * mailgrave-queue, with the null reverse-path so that it can't cause
+ * another bounce. It carries the header of the original message.
+ *
+ * \param datfd
+ *   the original message
+ * \param sender
+ *   the original message's sender, who receives the bounce
+ * \param failed
+ *   the recipients marked 'X'
+ */
+bool
+bounce(unsigned long long id, int datfd, const string &sender,
+       const vector<string> &failed)
+{
+  char host[MAXHOSTNAMELEN];
+  if (gethostname(host, sizeof(host))!=0)
+    strcpy(host, "localhost");
+  host[sizeof(host)-1] = 0;
+
+  char date[256];
+  time_t now = time(NULL);
+  if (strftime(date, sizeof(date), "%a, %d %b %Y %T %z", localtime(&now)) == 0)
+    date[0] = 0;
+
+  char line[1024];
+  string message;
+  message += "F";
+  message += '\0';
+  message += "T" + sender;
+  message += '\0';
+  message += '\0';
+  snprintf(line, sizeof(line),
+    "From: MAILER-DAEMON@%s\n"
+    "To: %s\n"
+    "Subject: failure notice\n"
+    "Date: %s\n"
+    "Message-Id: <%lu.%lu.%llX.bounce@%s>\n"
+    "Auto-Submitted: auto-replied\n"
+    "\n"
+    "This is mailgrave-send at %s.\n"
+    "The message could not be delivered to the following recipients,\n"
+    "their mail servers rejected it permanently:\n"
+    "\n",
+    host, sender.c_str(), date, (u_long)now, (u_long)getpid(), id, host, host);
+  message += line;
+  for(size_t i=0; i<failed.size(); ++i)
+    message += "  <" + failed[i] + ">\n";
+  message += "\n--- Below this line is the header of the message.\n\n";
+
+  // the header ends with the first empty line
+  char buffer[4096];
+  off_t pos = 0;
+  bool bol = true, header = true;
+  while(header) {
+    ssize_t l = pread(datfd, buffer, sizeof(buffer), pos);
+    if (l<0) {
+      LOG(LEVEL_ERROR, "mailgrave-send: bounce: %s\n", strerror(errno));
+      return false;
+    }
+    if (l==0)
+      break;
+    pos += l;
+    for(ssize_t i=0; i<l; ++i) {
+      char c = buffer[i];
+      if (c=='\r')
+        continue;
+      if (bol && c=='\n') {
+        header = false;
+        break;
+      }
+      message += c;
+      bol = c=='\n';
+    }
+  }
+
+  int sock = openUNIXSocket(queue);
+  if (sock<0) {
+    LOG(LEVEL_ERROR, "mailgrave-send: failed to connect to '%s' to bounce %020llX\n",
+                     queue, id);
+    return false;
+  }
+  bool queued = false;
+  size_t n = 0;
+  while(n<message.size()) {
+    ssize_t l = write(sock, message.data()+n, message.size()-n);
+    if (l<0 && errno==EINTR)
+      continue;
+    if (l<=0)
+      break;
+    n += l;
+  }
+  char answer = 0;
+  if (n==message.size() && shutdown(sock, SHUT_WR)==0 &&
+      read(sock, &answer, 1)==1 && answer==1)
+  {
+    queued = true;
+  }
+  close(sock);
+  if (!queued) {
+    LOG(LEVEL_ERROR, "mailgrave-send: failed to queue the bounce of %020llX\n", id);
+    return false;
+  }
+  LOG(LEVEL_INFO, "mailgrave-send: bounced %020llX to '%s' for %u recipients\n",
+                  id, sender.c_str(), (unsigned)failed.size());
+  return true;
+}
+
+/**
+ * Copy the message file to the socket.
+ *
+ * \param unstuff
+ *   the file is in wire format, remove the doubled '.' at the beginning of
+ *   lines
+ */
 bool
-copyfile(FILE *out, int in)
+copyfile(FILE *out, int in, bool unstuff)
 {
   char buffer[4096];
+  bool bol = true;
   while(true) {
     ssize_t l = read(in, buffer, sizeof(buffer));
     if (l==0)
       return true;
     if (l<0) {
-      printf("mailgrave-send: copyfile: %s\n", strerror(errno));
+      LOG(LEVEL_ERROR, "mailgrave-send: copyfile: %s\n", strerror(errno));
       return false;
     }
-    fwrite(buffer, l, 1, out);
+    if (!unstuff) {
+      fwrite(buffer, l, 1, out);
+      continue;
+    }
+    for(const char *p = buffer; p != buffer + l; ++p) {
+      if (!(bol && *p=='.'))
+        putc_unlocked(*p, out);
+      bol = *p=='\n';
+    }
   }
 }
@@ -20,6 +20,11 @@
 // RFC 1830: SMTP Service Extensions for Transmission of Large and Binary MIME Messages
 
 #include "cug.hh"
+#include "deadline.hh"
+#include "tls.hh"
+#include "stats.hh"
+#include "log.hh"
+#include "trace.hh"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -31,15 +36,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <sys/param.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include <string>
 using std::string;
 
 static bool slow = false;
 
+// STARTTLS, RFC 3207, offered when a certificate was given
+static SSL_CTX *tlsctx = 0;
+static SSL *tls = 0;
+static bool ktls_recv = false, ktls_send = false;
+
+// a handshake takes a few round trips, a client needing longer is stalling
+static const unsigned tls_timeout = 10;
+
 // RFC 2821: 4.5.3.1 Size limits and minimums
 static const size_t local_part_maxsize = 64;
 static const size_t domain_maxsize = 255;
@@ -48,18 +65,26 @@ static const size_t cmdline_maxsize = 512;
 static const size_t replyline_maxsize = 512;
 static const size_t textline_maxsize = 1000;
 
+// latencies for mailgrave-stat: commands other than DATA, and DATA
+static histogram_t *command_latency, *queue_latency;
+
 enum {
   CMD_HELO,
   CMD_EHLO,
   CMD_MAIL_FROM,
   CMD_RCPT_TO,
   CMD_DATA,
-  CMD_QUIT
+  CMD_QUIT,
+  CMD_STARTTLS
 };
 
 static void handleClient(int argc, char** argv, int client);
 static bool queueMessage(int client, const string &fromToList);
 static bool copyData(FILE *out, int client);
+static bool startTLS(int client);
+static void closeClient(int client);
+static ssize_t clientRead(int fd, void *buffer, size_t n);
+static ssize_t clientWrite(int fd, const void *buffer, size_t n);
 
 static const char* getline(int fd);
 static bool getAddress(const char *line, char c, string *result);
@@ -84,6 +109,16 @@ usage()
     "    TCP port to listen on, default is 25\n"
     "  --out <socket>\n"
     "    UNIX domain socket of mailgrave-queue. Defaults to 'queue.ctrl'.\n"
+    "  --tls-cert <file>\n"
+    "    PEM file with the certificate chain, enables STARTTLS\n"
+    "  --tls-key <file>\n"
+    "    PEM file with the private key, defaults to the certificate file\n"
+    "  --ktls\n"
+    "    let the kernel encrypt and decrypt after the TLS handshake\n"
+    "  --stats <file>\n"
+    "    count sessions, messages and bytes in this file for mailgrave-stat\n"
+    "  --log-level error|info|verbose\n"
+    "    log only up to this level, default is info\n"
     "  --chroot <directory>\n"
     "    change root directory after setup\n"
     "  --user <user>[:<group>]\n"
@@ -99,12 +134,13 @@ const char *out = "queue.ctrl";
 int
 main(int argc, char **argv)
 {
-  setvbuf(stdout, 0, _IONBF, 0);
-
   cug_t cug;
   int port = 25;
   in_addr_t addr = INADDR_ANY;
-  
+  const char *tls_cert = 0, *tls_key = 0;
+  const char *statsfile = 0;
+  bool ktls = false;
+
   // parse argument list
   for(int i=1; i<argc; ++i) {
     if (strcmp(argv[i], "--bind")==0) {
@@ -140,6 +176,30 @@ main(int argc, char **argv)
       }
       out = argv[++i];
     } else
+    if (strcmp(argv[i], "--tls-cert")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      tls_cert = argv[++i];
+    } else
+    if (strcmp(argv[i], "--tls-key")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      tls_key = argv[++i];
+    } else
+    if (strcmp(argv[i], "--ktls")==0) {
+      ktls = true;
+    } else
+    if (strcmp(argv[i], "--stats")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      statsfile = argv[++i];
+    } else
     if (strcmp(argv[i], "--slow")==0) {
       slow = true;
     } else
@@ -148,6 +208,8 @@ main(int argc, char **argv)
       return EXIT_SUCCESS;
     } else
     if (chrootOrUser(argc, argv, &i, &cug)) {
+    } else
+    if (logOption(argc, argv, &i)) {
     } else {
       fprintf(stderr, "%s: unknown argument %s, please try --help\n",
                       argv[0], argv[i]);
@@ -160,12 +222,28 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  // load the certificate before chroot
+  if (tls_cert) {
+    tlsctx = tlsServerContext(tls_cert, tls_key ? tls_key : tls_cert, ktls);
+    if (!tlsctx)
+      return EXIT_FAILURE;
+  }
+
   int sock = createSocket(addr, port);
 
+  if (statsfile && !mapStats(statsfile, "smtpd"))
+    LOG(LEVEL_ERROR, "mailgrave-smtpd: continuing without statistics\n");
+  command_latency = statHistogram("command");
+  queue_latency = statHistogram("queueMessage");
+
   // change root, uid, gid
   if (!setChrootUidGid(&cug))
     return EXIT_FAILURE;
-  
+
+  // the processes handling clients aren't waited for
+  signal(SIGCHLD, SIG_IGN);
+
+  logStart();
   while(true) {
     sockaddr_in cname;
     socklen_t clen = sizeof(cname);
@@ -174,7 +252,22 @@ main(int argc, char **argv)
       perror("accept");
       continue;
     }
+    statAdd(&stats->sessions, 1);
+    // each client gets a process of its own, thus one which stalls, e.g.
+    // in the middle of the TLS handshake, holds only its own session
+    pid_t pid = fork();
+    if (pid<0) {
+      perror("fork");
+      handleClient(argc, argv, client);
+      continue;
+    }
+    if (pid>0) {
+      close(client);
+      continue;
+    }
+    close(sock);
     handleClient(argc, argv, client);
+    exit(EXIT_SUCCESS);
   }
   return EXIT_SUCCESS;
 }
@@ -186,21 +279,11 @@ main(int argc, char **argv)
 void
 handleClient(int argc, char** argv, int client)
 {
-  bool forked = false;
-//  pid_t pid = fork();
-  if (false/*pid==0*/) {
-    close(client);
-    return;
-  }
-
-  // fcntl(client, F_SETFL, O_NONBLOCK);
-  //close(STDIN_FILENO);
-  //close(STDOUT_FILENO);
-  //close(STDERR_FILENO);
   string fromToList;
   const char *line = 0;
   unsigned state = 0;
   int cmd = 0;
+  uint64_t received = 0;  // statClock() when the command was read
   while(true) {
     switch(state) {
       case 0: {
@@ -210,71 +293,93 @@ handleClient(int argc, char** argv, int client)
         }
         char buffer[4096];
         snprintf(buffer, sizeof(buffer), "220 %s ESMTP MailGrave\r\n", hostname);
-        if (write(client, buffer, strlen(buffer))==-1) {
+        if (clientWrite(client, buffer, strlen(buffer))==-1) {
           perror("write");
-          close(client);
+          closeClient(client);
           return;
         }
         state = 1;
       } break;
       case 1:
+        if (cmd==CMD_EHLO && tlsctx && !tls) {
+          clientWrite(client, "250-welcome\r\n250 STARTTLS\r\n", 27);
+          state = 2;
+        } else
         if (cmd==CMD_HELO || cmd==CMD_EHLO) {
-          write(client, "250 welcome\r\n", 13);
+          clientWrite(client, "250 welcome\r\n", 13);
           state = 2;
         } else {
-          write(client, "503 bad sequence of commands\r\n", 30);
+          clientWrite(client, "503 bad sequence of commands\r\n", 30);
         }
         break;
       case 2:
+        if (cmd==CMD_STARTTLS && !tls) {
+          // RFC 3207 4.2: forget everything learned from the client
+          clientWrite(client, "220 Ready to start TLS\r\n", 24);
+          if (!startTLS(client)) {
+            closeClient(client);
+            return;
+          }
+          fromToList.clear();
+          state = 1;
+        } else
         if (cmd==CMD_MAIL_FROM) {
           if (getAddress(line+10, 'F', &fromToList)) {
-            write(client, "250 ok\r\n", 8);
+            clientWrite(client, "250 ok\r\n", 8);
             state = 3;
           } else {
-            write(client, "501 missing or malformed local part\r\n", 37);
+            clientWrite(client, "501 missing or malformed local part\r\n", 37);
           }
         } else {
-          write(client, "503 bad sequence of commands\r\n", 30);
+          clientWrite(client, "503 bad sequence of commands\r\n", 30);
         }
         break;
       case 3:
         if (cmd==CMD_RCPT_TO) {
           if (getAddress(line+8, 'T', &fromToList)) {
-            write(client, "250 ok\r\n", 8);
+            clientWrite(client, "250 ok\r\n", 8);
             state = 4;
           } else {
-            write(client, "501 missing or malformed local part\r\n", 37);
+            clientWrite(client, "501 missing or malformed local part\r\n", 37);
           }
         } else {
-          write(client, "503 bad sequence of commands\r\n", 30);
+          clientWrite(client, "503 bad sequence of commands\r\n", 30);
         }
         break;
       case 4:
         if (cmd==CMD_RCPT_TO) {
           if (getAddress(line+8, 'T', &fromToList)) {
-            write(client, "250 ok\r\n", 8);
+            clientWrite(client, "250 ok\r\n", 8);
           } else {
-            write(client, "501 missing or malformed local part\r\n", 37);
+            clientWrite(client, "501 missing or malformed local part\r\n", 37);
           }
         } else
         if (cmd==CMD_DATA) {
 //fprintf(stderr, "%s:%d\n", __FILE__, __LINE__);
-          write(client, "354 Start mail input; end with <CRLF>.<CRLF>\r\n", 46);
-          if (queueMessage(client, fromToList)) {
+          clientWrite(client, "354 Start mail input; end with <CRLF>.<CRLF>\r\n", 46);
+          uint64_t t0 = statClock();
+          bool queued = queueMessage(client, fromToList);
+          statRecord(queue_latency, statClock() - t0);
+          received = 0;
+          if (queued) {
 //fprintf(stderr, "%s:%d\n", __FILE__, __LINE__);
-            write(client, "250 queued\r\n", 12);
+            statAdd(&stats->queued, 1);
+            clientWrite(client, "250 queued\r\n", 12);
           } else {
 //fprintf(stderr, "%s:%d\n", __FILE__, __LINE__);
           }
           state = 2;
         } else {
-          write(client, "503 bad sequence of commands\r\n", 30);
+          clientWrite(client, "503 bad sequence of commands\r\n", 30);
         }
         break;
     }
+    if (received)
+      statRecord(command_latency, statClock() - received);
     while(true) {
 //fprintf(stderr, "%s: wait for client\n", argv[0]);
       line = getline(client);
+      received = statClock();
 //fprintf(stderr, "%s: got from client '%s'\n", argv[0], line);
       if (!line)
         break;
@@ -288,26 +393,25 @@ handleClient(int argc, char** argv, int client)
         cmd = CMD_RCPT_TO;
       else if (strcmp(line, "DATA")==0)
         cmd = CMD_DATA;
+      else if (tlsctx && strcmp(line, "STARTTLS")==0)
+        cmd = CMD_STARTTLS;
       else if (strncmp(line, "QUIT", 4)==0) {
-        write(client, "221 Bye\r\n", 9);
-        close(client);
-        if (forked)
-          exit(EXIT_SUCCESS);
-        else {
-          return;
-        }
+        clientWrite(client, "221 Bye\r\n", 9);
+        closeClient(client);
+        return;
       } else {
-        write(client, "500 unknown command\r\n", 21);
-        printf("received unknown command: ");
-        const char *p = line;
-        while(*p) {
-          if (*p>=32)
-            printf("%c", *p);
-          else
-            printf("\\x%02x", *p);
-          ++p;
+        clientWrite(client, "500 unknown command\r\n", 21);
+        string shown;
+        for(const char *p = line; *p; ++p) {
+          if (*p>=32) {
+            shown += *p;
+          } else {
+            char hex[16];
+            snprintf(hex, sizeof(hex), "\\x%02x", *p);
+            shown += hex;
+          }
         }
-        printf("\n");
+        LOG(LEVEL_INFO, "received unknown command: %s\n", shown.c_str());
         continue;
       }
       break;
@@ -315,7 +419,151 @@ handleClient(int argc, char** argv, int client)
     if (!line)
       break;
   }
+  closeClient(client);
+}
+
+static unsigned long long
+monotonicUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Perform the TLS handshake after STARTTLS.
+ *
+ * The socket is non-blocking during the handshake and every wait is
+ * bounded by a deadline, thus a client stalling in the middle of the
+ * handshake can't hold the server.
+ *
+ * With kTLS the kernel decrypts and encrypts afterwards and the connection
+ * is read and written like a cleartext one.
+ */
+bool
+startTLS(int client)
+{
+  deadline_t deadline;
+  armDeadline(&deadline, tls_timeout);
+  unsigned long long start = monotonicUs();
+  int flags = fcntl(client, F_GETFL);
+  fcntl(client, F_SETFL, flags | O_NONBLOCK);
+
+  tls = SSL_new(tlsctx);
+  if (!tls || !SSL_set_fd(tls, client)) {
+    tlsError("SSL_new");
+    goto error;
+  }
+  while(true) {
+    int r = SSL_accept(tls);
+    if (r==1)
+      break;
+    pollfd pfd;
+    pfd.fd = client;
+    pfd.revents = 0;
+    switch(SSL_get_error(tls, r)) {
+      case SSL_ERROR_WANT_READ:
+        pfd.events = POLLIN;
+        break;
+      case SSL_ERROR_WANT_WRITE:
+        pfd.events = POLLOUT;
+        break;
+      default:
+        tlsError("SSL_accept");
+        goto error;
+    }
+    int timeout = deadlineRemaining(&deadline);
+    if (timeout==0) {
+      LOG(LEVEL_INFO, "TLS handshake timed out\n");
+      goto error;
+    }
+    if (poll(&pfd, 1, timeout)<0 && errno!=EINTR) {
+      perror("poll");
+      goto error;
+    }
+  }
+  fcntl(client, F_SETFL, flags);
+  ktls_recv = tlsKernelReceive(tls);
+  ktls_send = tlsKernelSend(tls);
+
+  {
+    unsigned long long us = monotonicUs() - start;
+    bool resumed = SSL_session_reused(tls);
+    if (resumed) {
+      statAdd(&stats->tls_resumed, 1);
+      statAdd(&stats->tls_resumed_us, us);
+    } else {
+      statAdd(&stats->tls_full, 1);
+      statAdd(&stats->tls_full_us, us);
+    }
+    LOG(LEVEL_INFO, "%s %s handshake in %.2f ms%s%s\n",
+                    SSL_get_version(tls), resumed ? "resumed" : "full", us / 1000.0,
+                    ktls_send ? ", kTLS send" : "", ktls_recv ? ", kTLS receive" : "");
+  }
+  return true;
+
+error:
+  statAdd(&stats->tls_failed, 1);
+  fcntl(client, F_SETFL, flags);
+  return false;
+}
+
+/**
+ * Close the connection with the client, shutting down TLS first.
+ */
+void
+closeClient(int client)
+{
+  if (tls) {
+    if (SSL_is_init_finished(tls))
+      SSL_shutdown(tls);
+    SSL_free(tls);
+    tls = 0;
+    ktls_recv = ktls_send = false;
+  }
   close(client);
+  statAdd(&stats->sessions, -1);
+}
+
+/**
+ * Read from the client, decrypting once STARTTLS was given.
+ */
+ssize_t
+clientRead(int fd, void *buffer, size_t n)
+{
+  if (!tls || ktls_recv)
+    return read(fd, buffer, n);
+  int r = SSL_read(tls, buffer, n);
+  if (r>0)
+    return r;
+  switch(SSL_get_error(tls, r)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      return r==0 ? 0 : -1;
+    default:
+      tlsError("SSL_read");
+      errno = EIO;
+      return -1;
+  }
+}
+
+/**
+ * Write to the client, encrypting once STARTTLS was given.
+ */
+ssize_t
+clientWrite(int fd, const void *buffer, size_t n)
+{
+  if (!tls || ktls_send)
+    return write(fd, buffer, n);
+  int r = SSL_write(tls, buffer, n);
+  if (r>0)
+    return r;
+  if (SSL_get_error(tls, r)!=SSL_ERROR_SYSCALL) {
+    tlsError("SSL_write");
+    errno = EIO;
+  }
+  return -1;
 }
 
 /**
@@ -327,17 +575,18 @@ handleClient(int argc, char** argv, int client)
 bool
 queueMessage(int client, const string &fromToList)
 {
+  uint64_t accepted = traceClock();
   struct sockaddr_un control;
   control.sun_family = AF_UNIX;
   if (strlen(out) >= sizeof(control.sun_path)) {
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     fprintf(stderr, "path name for control socket is too long.\n");
     return false;
   }
   strcpy(control.sun_path, out);
   int sock = socket(AF_UNIX, SOCK_STREAM, 0);
   if (sock<0) {
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     perror ("failed to create unix domain socket");
     return false;
   }
@@ -346,7 +595,7 @@ queueMessage(int client, const string &fromToList)
               strlen(control.sun_path)) < 0)
   {
     close(sock);
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     perror("failed to connect to socket");
     return false;
   }
@@ -354,12 +603,14 @@ queueMessage(int client, const string &fromToList)
   FILE *out = fdopen(sock, "w");
   if (!out) {
     close(sock);
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     perror("fdopen failed");
     return false;
   }
   
   // 1st: stuff the envelope data into the socket
+  fprintf(out, "A%llu", (unsigned long long)accepted);
+  putc_unlocked(0, out);
   fwrite(fromToList.data(), 1, fromToList.size(), out);
   putc_unlocked(0, out);
   
@@ -373,17 +624,17 @@ queueMessage(int client, const string &fromToList)
   char result;
   if (shutdown(sock, SHUT_WR)==-1) {
     perror("mailgrave-smtpd: shutdown");
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     r = false;
   } else
   if (read(sock, &result, 1)!=1) {
     perror("mailgrave-smtpd: unabled to read queue process result\n");
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     r = false;
   } else
   if (!result) {
-    printf("mailgrave-send: delivery to queue failed\n");
-    write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+    LOG(LEVEL_ERROR, "mailgrave-send: delivery to queue failed\n");
+    clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
     r = false;
   }
 
@@ -399,15 +650,16 @@ copyData(FILE *out, int client)
   unsigned state = 0;
   while(true) {
     char buffer[4096];
-    ssize_t l = read(client, buffer, sizeof(buffer));
+    ssize_t l = clientRead(client, buffer, sizeof(buffer));
     if (l<0) {
       if (errno==EINTR)
         continue;
-      write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+      clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
       perror("while reading from client");
       // TODO: append a single byte as an error code to 'out'
       return false;
     }
+    statAdd(&stats->bytes_in, l);
     for(const char *p = buffer; p != buffer + l; ++p) {
       int c = *p;
       switch(state) {
@@ -466,7 +718,7 @@ copyData(FILE *out, int client)
           switch(*p) {
             case '\n':
               if (p+1 != buffer+l) {
-                write(client, "554 trailing data after data\r\n", 30);
+                clientWrite(client, "554 trailing data after data\r\n", 30);
                 return false;
               }
               return true;
@@ -489,7 +741,7 @@ copyData(FILE *out, int client)
       }
     }
   }
-  write(client, "451 Requested action aborted: local error in processing\r\n", 58);
+  clientWrite(client, "451 Requested action aborted: local error in processing\r\n", 58);
   return false;
 }
 
@@ -501,12 +753,12 @@ getline(int fd)
   char *p = buffer;
   ssize_t n = cmdline_maxsize+1;
   while(true) {
-    ssize_t l = read(fd, p, n);
+    ssize_t l = clientRead(fd, p, n);
     if (l<0) {
       if (errno==EINTR)
         continue;
       perror("while reading from client");
-      write(fd, "554 Transaction failed\r\n", 24);
+      clientWrite(fd, "554 Transaction failed\r\n", 24);
       return 0;
     }
     if (l==0) {
@@ -514,7 +766,7 @@ getline(int fd)
       return 0;
     }
     if (l==n) {
-      write(fd, "500 Line too long.\r\n", 20);
+      clientWrite(fd, "500 Line too long.\r\n", 20);
       return 0;
     }
     if (p[l-2]=='\r' && p[l-1]=='\n') {
@@ -0,0 +1,277 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * mailgrave-stat samples the statistics files of the daemons, see
+ * stats.hh, and prints the rates of their counters. Like vmstat, the
+ * first line of each daemon shows the averages since it started. With
+ * --latency the percentiles of the daemons' latency histograms are
+ * printed instead.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <vector>
+
+#include "stats.hh"
+
+using std::vector;
+
+static void
+usage()
+{
+  printf(
+    "mailgrave-stat\n"
+    "Copyright (C) 2006, 2007 Mark-André Hopf <mhopf@mark13.org>\n"
+    "Visit http://mark13.org/mailgrave/ for full details.\n"
+    "\n"
+    "Usage:\n"
+    "  mailgrave-stat [<options>] <file>...\n"
+    "  Print the throughput of the daemons which were started with\n"
+    "  '--stats <file>'.\n"
+    "\n"
+    "Options:\n"
+    "  --interval <seconds>\n"
+    "    Time between two samples, default is 5 seconds\n"
+    "  --count <n>\n"
+    "    Stop after n samples, default is to run until interrupted\n"
+    "  --totals\n"
+    "    Print the counters once as '<daemon>.<counter> <value>' lines\n"
+    "  --latency\n"
+    "    Print the latencies of the pipeline's stages since the daemons\n"
+    "    started: p50, p99, p999 and the maximum\n"
+    "  --help\n"
+    "    Show this help text.\n"
+  );
+}
+
+/*
+ * The counters in a sample. The first six are the columns of the rates,
+ * --totals prints all of them.
+ */
+static const struct {
+  const char *name;
+  uint64_t stats_t::*member;
+} counters[] = {
+  { "queued",         &stats_t::queued },
+  { "delivered",      &stats_t::delivered },
+  { "deferred",       &stats_t::deferred },
+  { "failed",         &stats_t::failed },
+  { "bytes_in",       &stats_t::bytes_in },
+  { "bytes_out",      &stats_t::bytes_out },
+  { "tls_full",       &stats_t::tls_full },
+  { "tls_resumed",    &stats_t::tls_resumed },
+  { "tls_failed",     &stats_t::tls_failed },
+  { "tls_full_us",    &stats_t::tls_full_us },
+  { "tls_resumed_us", &stats_t::tls_resumed_us }
+};
+
+static const unsigned COUNTERS = sizeof(counters) / sizeof(counters[0]);
+
+/*
+ * A copy of the counters taken at one moment.
+ */
+struct sample_t
+{
+  uint32_t pid;
+  uint64_t started;
+  double when;          // seconds, CLOCK_MONOTONIC
+  uint64_t counter[COUNTERS];
+};
+
+static double
+now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+takeSample(const stats_t *s, sample_t *sample)
+{
+  sample->pid = s->pid;
+  sample->started = s->started;
+  sample->when = now();
+  for(unsigned i=0; i<COUNTERS; ++i)
+    sample->counter[i] = statGet(&(s->*counters[i].member));
+}
+
+static void
+printLatency(const stats_t *s)
+{
+  for(unsigned i=0; i<HISTOGRAMS; ++i) {
+    const histogram_t *h = &s->histogram[i];
+    if (!h->name[0])
+      continue;
+    char p50[32], p99[32], p999[32], max[32];
+    printf("%-10s %-14s %10llu %9s %9s %9s %9s\n",
+           s->name, h->name, (unsigned long long)statGet(&h->count),
+           statDuration(histogramPercentile(h, 0.5), p50, sizeof(p50)),
+           statDuration(histogramPercentile(h, 0.99), p99, sizeof(p99)),
+           statDuration(histogramPercentile(h, 0.999), p999, sizeof(p999)),
+           statDuration(statGet(&h->max), max, sizeof(max)));
+  }
+}
+
+static void
+printTotals(const stats_t *s)
+{
+  for(unsigned i=0; i<COUNTERS; ++i)
+    printf("%s.%s %llu\n", s->name, counters[i].name,
+           (unsigned long long)statGet(&(s->*counters[i].member)));
+  printf("%s.sessions %llu\n", s->name,
+         (unsigned long long)statGet(&s->sessions));
+  printf("%s.depth %llu\n", s->name,
+         (unsigned long long)statGet(&s->depth));
+  uint64_t oldest = statGet(&s->oldest);
+  printf("%s.oldest %llu\n", s->name,
+         oldest ? (unsigned long long)(time(0) - oldest) : 0ULL);
+}
+
+int
+main(int argc, char **argv)
+{
+  setvbuf(stdout, 0, _IOLBF, 0);
+
+  unsigned interval = 5;
+  unsigned count = 0;
+  bool totals = false;
+  bool latency = false;
+  vector<const char*> files;
+
+  for(int i=1; i<argc; ++i) {
+    if (strcmp(argv[i], "--interval")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      interval = atoi(argv[++i]);
+      if (interval<1)
+        interval = 1;
+    } else
+    if (strcmp(argv[i], "--count")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      count = atoi(argv[++i]);
+    } else
+    if (strcmp(argv[i], "--totals")==0) {
+      totals = true;
+    } else
+    if (strcmp(argv[i], "--latency")==0) {
+      latency = true;
+    } else
+    if (strcmp(argv[i], "--help")==0) {
+      usage();
+      return EXIT_SUCCESS;
+    } else
+    if (argv[i][0]=='-') {
+      fprintf(stderr, "%s: unknown argument %s, please try --help\n",
+                      argv[0], argv[i]);
+      return EXIT_FAILURE;
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.empty()) {
+    fprintf(stderr, "%s: no stats file given, please try --help\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  vector<const stats_t*> segments;
+  for(size_t i=0; i<files.size(); ++i) {
+    const stats_t *s = readStats(files[i]);
+    if (!s)
+      return EXIT_FAILURE;
+    segments.push_back(s);
+  }
+
+  if (totals) {
+    for(size_t i=0; i<segments.size(); ++i) {
+      if (__atomic_load_n(&segments[i]->magic, __ATOMIC_ACQUIRE)==STATS_MAGIC)
+        printTotals(segments[i]);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (latency) {
+    printf("daemon     stage               count       p50       p99"
+           "      p999       max\n");
+    for(size_t i=0; i<segments.size(); ++i) {
+      if (__atomic_load_n(&segments[i]->magic, __ATOMIC_ACQUIRE)==STATS_MAGIC)
+        printLatency(segments[i]);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // the first line of a daemon compares with its start
+  vector<sample_t> last(segments.size());
+  for(size_t i=0; i<segments.size(); ++i)
+    last[i].pid = 0;
+
+  for(unsigned n=0; count==0 || n<count; ++n) {
+    if (n>0)
+      sleep(interval);
+    if (n%20==0)
+      printf("daemon        pid   queued/s   deliv/s   defer/s    fail/s"
+             "    kB/s in   kB/s out  sessions  depth  oldest\n");
+    for(size_t i=0; i<segments.size(); ++i) {
+      const stats_t *s = segments[i];
+      if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE)!=STATS_MAGIC) {
+        printf("%-10s      -  (not running)\n", files[i]);
+        last[i].pid = 0;
+        continue;
+      }
+      sample_t sample;
+      takeSample(s, &sample);
+      double seconds;
+      const uint64_t *before;
+      static const uint64_t zero[COUNTERS] = { 0 };
+      if (last[i].pid!=sample.pid || last[i].started!=sample.started) {
+        // a new daemon, its counters started at 0
+        seconds = time(0) - (double)sample.started;
+        before = zero;
+      } else {
+        seconds = sample.when - last[i].when;
+        before = last[i].counter;
+      }
+      if (seconds<1)
+        seconds = 1;
+      double rate[COUNTERS];
+      for(unsigned j=0; j<COUNTERS; ++j)
+        rate[j] = (sample.counter[j] - before[j]) / seconds;
+      uint64_t oldest = statGet(&s->oldest);
+      printf("%-10s %6u %10.1f %9.1f %9.1f %9.1f %10.1f %10.1f %9llu %6llu %7llu\n",
+             s->name, sample.pid,
+             rate[0], rate[1], rate[2], rate[3],
+             rate[4] / 1024, rate[5] / 1024,
+             (unsigned long long)statGet(&s->sessions),
+             (unsigned long long)statGet(&s->depth),
+             oldest ? (unsigned long long)(time(0) - oldest) : 0ULL);
+      last[i] = sample;
+    }
+  }
+  return EXIT_SUCCESS;
+}
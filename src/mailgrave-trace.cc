@@ -0,0 +1,284 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * mailgrave-trace reads the trace file which mailgrave-queue and
+ * mailgrave-send append to, see trace.hh. Given queue ids it prints the
+ * timeline of each message, with --summary it prints the distribution of
+ * the time the messages spent in the system and in each of its stages.
+ *
+ * mailgrave-remote doesn't know the queue ids, the time it takes is the
+ * one between an attempt and its outcome.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include "stats.hh"
+#include "trace.hh"
+
+using std::map;
+using std::vector;
+
+static void
+usage()
+{
+  printf(
+    "mailgrave-trace\n"
+    "Copyright (C) 2006, 2007 Mark-André Hopf <mhopf@mark13.org>\n"
+    "Visit http://mark13.org/mailgrave/ for full details.\n"
+    "\n"
+    "Usage:\n"
+    "  mailgrave-trace [<options>] <queue-id>...\n"
+    "  Print the way of the messages through the pipeline as recorded by\n"
+    "  the daemons started with '--trace <file>'.\n"
+    "\n"
+    "Options:\n"
+    "  --file <file>\n"
+    "    The trace file, default is 'trace'\n"
+    "  --summary\n"
+    "    Instead of timelines, print the distribution of the time the\n"
+    "    messages which left the queue spent in the system and its stages\n"
+    "  --help\n"
+    "    Show this help text.\n"
+  );
+}
+
+static const char *eventNames[] = {
+  "", "accepted", "queued", "stored", "attempt", "delivered", "failed",
+  "deferred", "done"
+};
+
+static const char*
+eventName(unsigned event)
+{
+  return event < sizeof(eventNames)/sizeof(eventNames[0]) ?
+         eventNames[event] : "unknown";
+}
+
+/*
+ * The stages of --summary, each from one stamp to the next.
+ */
+enum {
+  STAGE_TOTAL,          // accepted (or queued) until done
+  STAGE_HANDOVER,       // accepted until queued
+  STAGE_STORE,          // queued until stored
+  STAGE_WAIT,           // stored until the first attempt
+  STAGE_DELIVERY,       // the first attempt until done
+  STAGES
+};
+
+static const char *stageNames[STAGES] = {
+  "in system", "handover", "store", "wait", "delivery"
+};
+
+/*
+ * What is known about a message which hasn't left the queue yet.
+ */
+struct life_t
+{
+  uint64_t accepted, queued, stored, first;
+};
+
+/**
+ * Print one record of a timeline, relative to the first one.
+ */
+static void
+printRecord(const trace_t *t, uint64_t start)
+{
+  char offset[32];
+  printf("  +%-9s %-10s", statDuration(t->when - start, offset, sizeof(offset)),
+         eventName(t->event));
+  switch(t->event) {
+    case TRACE_STORED:
+      printf(" %llu bytes", (unsigned long long)t->arg);
+      break;
+    case TRACE_ATTEMPT:
+      printf(" #%llu", (unsigned long long)t->arg);
+      break;
+    case TRACE_DELIVERED:
+    case TRACE_FAILED:
+    case TRACE_DEFERRED:
+      printf(" %llu recipients", (unsigned long long)t->arg);
+      break;
+    case TRACE_DONE:
+      printf(" after %llu attempts", (unsigned long long)t->arg);
+      break;
+  }
+  printf(" (pid %u)\n", t->pid);
+}
+
+/**
+ * Print the timelines of the given messages. A queue id is used again
+ * once its message left the queue, thus each life of an id gets a
+ * timeline of its own.
+ */
+static void
+timeline(FILE *in, const vector<uint64_t> &ids)
+{
+  map<uint64_t, trace_t> begin;   // the first record of each id
+  map<uint64_t, unsigned> last;   // the last event of each id
+  trace_t t;
+  while(fread(&t, sizeof(t), 1, in)==1) {
+    bool wanted = false;
+    for(size_t i=0; i<ids.size(); ++i)
+      wanted |= ids[i]==t.id;
+    if (!wanted)
+      continue;
+    map<uint64_t, unsigned>::iterator p = last.find(t.id);
+    if (p==last.end() || t.event==TRACE_ACCEPTED ||
+        (t.event==TRACE_QUEUED && p->second!=TRACE_ACCEPTED))
+    {
+      begin[t.id] = t;
+      time_t sec = t.when / 1000000;
+      char date[64];
+      strftime(date, sizeof(date), "%Y-%m-%d %T", localtime(&sec));
+      printf("%020llX %s.%06u\n", (unsigned long long)t.id, date,
+             (unsigned)(t.when % 1000000));
+    }
+    last[t.id] = t.event;
+    printRecord(&t, begin[t.id].when);
+  }
+}
+
+static void
+record(histogram_t *h, uint64_t from, uint64_t to)
+{
+  if (from && to)
+    statRecord(h, to>from ? to - from : 0);
+}
+
+/**
+ * Print the distribution of the time in system and in each stage of the
+ * messages which left the queue.
+ */
+static void
+summary(FILE *in)
+{
+  histogram_t stage[STAGES];
+  memset(stage, 0, sizeof(stage));
+  map<uint64_t, life_t> queue;
+  uint64_t attempts = 0;
+  trace_t t;
+  while(fread(&t, sizeof(t), 1, in)==1) {
+    life_t *l = &queue[t.id];
+    switch(t.event) {
+      case TRACE_ACCEPTED:
+        memset(l, 0, sizeof(*l));
+        l->accepted = t.when;
+        break;
+      case TRACE_QUEUED:
+        if (l->queued)
+          memset(l, 0, sizeof(*l));
+        l->queued = t.when;
+        break;
+      case TRACE_STORED:
+        l->stored = t.when;
+        break;
+      case TRACE_ATTEMPT:
+        if (!l->first)
+          l->first = t.when;
+        break;
+      case TRACE_DONE:
+        record(&stage[STAGE_TOTAL], l->accepted ? l->accepted : l->queued, t.when);
+        record(&stage[STAGE_HANDOVER], l->accepted, l->queued);
+        record(&stage[STAGE_STORE], l->queued, l->stored);
+        record(&stage[STAGE_WAIT], l->stored, l->first);
+        record(&stage[STAGE_DELIVERY], l->first, t.when);
+        attempts += t.arg;
+        queue.erase(t.id);
+        break;
+    }
+  }
+
+  uint64_t done = stage[STAGE_TOTAL].count;
+  printf("%llu messages left the queue after %.2f attempts on average, "
+         "%llu remain\n",
+         (unsigned long long)done, done ? (double)attempts / done : 0.0,
+         (unsigned long long)queue.size());
+  printf("stage               count       p50       p99      p999       max\n");
+  for(unsigned i=0; i<STAGES; ++i) {
+    const histogram_t *h = &stage[i];
+    char p50[32], p99[32], p999[32], max[32];
+    printf("%-14s %10llu %9s %9s %9s %9s\n",
+           stageNames[i], (unsigned long long)h->count,
+           statDuration(histogramPercentile(h, 0.5), p50, sizeof(p50)),
+           statDuration(histogramPercentile(h, 0.99), p99, sizeof(p99)),
+           statDuration(histogramPercentile(h, 0.999), p999, sizeof(p999)),
+           statDuration(h->max, max, sizeof(max)));
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *file = "trace";
+  bool sum = false;
+  vector<uint64_t> ids;
+
+  for(int i=1; i<argc; ++i) {
+    if (strcmp(argv[i], "--file")==0) {
+      if (i+1 >= argc) {
+        fprintf(stderr, "%s: not enough arguments for %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+      file = argv[++i];
+    } else
+    if (strcmp(argv[i], "--summary")==0) {
+      sum = true;
+    } else
+    if (strcmp(argv[i], "--help")==0) {
+      usage();
+      return EXIT_SUCCESS;
+    } else
+    if (argv[i][0]=='-') {
+      fprintf(stderr, "%s: unknown argument %s, please try --help\n",
+                      argv[0], argv[i]);
+      return EXIT_FAILURE;
+    } else {
+      char *end;
+      ids.push_back(strtoull(argv[i], &end, 16));
+      if (*end) {
+        fprintf(stderr, "%s: invalid queue id %s\n", argv[0], argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (!sum && ids.empty()) {
+    fprintf(stderr, "%s: no queue id given, please try --help\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *in = fopen(file, "r");
+  if (!in) {
+    perror(file);
+    return EXIT_FAILURE;
+  }
+  if (sum)
+    summary(in);
+  else
+    timeline(in, ids);
+  fclose(in);
+  return EXIT_SUCCESS;
+}
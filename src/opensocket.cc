@@ -26,8 +26,10 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 
+#include "opensocket.hh"
+
 int
-openUNIXSocket(const char *name)
+openUNIXSocket(const char *name, int type)
 {
   struct sockaddr_un control;
   control.sun_family = AF_UNIX;
@@ -36,7 +38,7 @@ openUNIXSocket(const char *name)
     return -1;
   }
   strcpy(control.sun_path, name);
-  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  int sock = socket(AF_UNIX, type, 0);
   if (sock<0) {
 //    perror ("failed to create unix domain socket");
     return -1;
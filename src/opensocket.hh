@@ -17,4 +17,6 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-int openUNIXSocket(const char *name);
+#include <sys/socket.h>
+
+int openUNIXSocket(const char *name, int type = SOCK_STREAM);
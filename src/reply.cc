@@ -0,0 +1,295 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "reply.hh"
+
+/**
+ * Parse the reply line at the beginning of 'p'.
+ *
+ * \param p, e
+ *   begin and end of the buffered input
+ * \param reply
+ *   out: the reply line, its text points into the buffer
+ * \param next
+ *   out: the beginning of the next line
+ * \return
+ *   1 when a line was parsed, 0 when the line is incomplete and -1 when it
+ *   is malformed
+ */
+int
+parseReply(const char *p, const char *e, reply_t *reply, const char **next)
+{
+  const char *nl = (const char*)memchr(p, '\n', e-p);
+  if (!nl)
+    return 0;
+  *next = nl + 1;
+
+  if (nl-p < 4 || nl[-1]!='\r')
+    return -1;
+  if (!isdigit(p[0]) || !isdigit(p[1]) || !isdigit(p[2]))
+    return -1;
+  reply->code = (p[0]-'0')*100 + (p[1]-'0')*10 + (p[2]-'0');
+  reply->more = false;
+  switch(p[3]) {
+    case '-':
+      reply->more = true;
+    case ' ':
+      reply->text = p + 4;
+      reply->len = nl - 1 - reply->text;
+      break;
+    case '\r':
+      reply->text = p + 3;
+      reply->len = 0;
+      break;
+    default:
+      return -1;
+  }
+  return 1;
+}
+
+struct keyword_t
+{
+  const char *name;
+  size_t len;
+  unsigned flag;
+};
+
+static const keyword_t extensions[] = {
+  { "PIPELINING",          10, CAP_PIPELINING },
+  { "SIZE",                 4, CAP_SIZE },
+  { "CHUNKING",             8, CAP_CHUNKING },
+  { "BINARYMIME",          10, CAP_BINARYMIME },
+  { "8BITMIME",             8, CAP_8BITMIME },
+  { "STARTTLS",             8, CAP_STARTTLS },
+  { "AUTH",                 4, CAP_AUTH },
+  { "ENHANCEDSTATUSCODES", 19, CAP_ENHANCEDSTATUSCODES },
+  { "DSN",                  3, CAP_DSN },
+  { "SMTPUTF8",             8, CAP_SMTPUTF8 },
+  { 0, 0, 0 }
+};
+
+static const keyword_t mechanisms[] = {
+  { "PLAIN",       5, AUTH_PLAIN },
+  { "LOGIN",       5, AUTH_LOGIN },
+  { "CRAM-MD5",    8, AUTH_CRAM_MD5 },
+  { "DIGEST-MD5", 10, AUTH_DIGEST_MD5 },
+  { "XOAUTH2",     7, AUTH_XOAUTH2 },
+  { 0, 0, 0 }
+};
+
+static inline char
+upper(char c)
+{
+  return c>='a' && c<='z' ? c - 'a' + 'A' : c;
+}
+
+/*
+ * The first two letters of the keywords above differ enough to place
+ * each in its own slot of a table with 16 entries.
+ */
+static inline unsigned
+slot(const char *word)
+{
+  return (2 * upper(word[0]) + upper(word[1])) & 15;
+}
+
+static const keyword_t *extensionSlots[16];
+static const keyword_t *mechanismSlots[16];
+
+static void
+initSlots()
+{
+  for(const keyword_t *k = extensions; k->name; ++k)
+    extensionSlots[slot(k->name)] = k;
+  for(const keyword_t *k = mechanisms; k->name; ++k)
+    mechanismSlots[slot(k->name)] = k;
+}
+
+static unsigned
+lookup(const keyword_t **slots, const char *word, size_t len)
+{
+  if (len<2)
+    return 0;
+  const keyword_t *k = slots[slot(word)];
+  if (!k || k->len!=len)
+    return 0;
+  for(size_t i=0; i<len; ++i) {
+    if (k->name[i]!=upper(word[i]))
+      return 0;
+  }
+  return k->flag;
+}
+
+/**
+ * Add the service extension announced in one line of the EHLO reply to
+ * 'caps'. Unknown extensions are ignored.
+ */
+void
+parseCapability(caps_t *caps, const char *text, size_t len)
+{
+  if (!extensionSlots[slot("AUTH")])
+    initSlots();
+
+  const char *e = text + len;
+  const char *p = text;
+  while(p!=e && *p!=' ')
+    ++p;
+  unsigned flag = lookup(extensionSlots, text, p-text);
+  caps->flags |= flag;
+
+  switch(flag) {
+    case CAP_SIZE:
+      // RFC 1870, 4: SIZE without a parameter or 0 means no fixed limit
+      caps->size = 0;
+      while(p!=e && *p==' ')
+        ++p;
+      while(p!=e && isdigit(*p)) {
+        caps->size = caps->size * 10 + (*p - '0');
+        ++p;
+      }
+      break;
+    case CAP_AUTH:
+      while(p!=e) {
+        while(p!=e && *p==' ')
+          ++p;
+        const char *q = p;
+        while(p!=e && *p!=' ')
+          ++p;
+        caps->auth |= lookup(mechanismSlots, q, p-q);
+      }
+      break;
+  }
+}
+
+#ifdef BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+using std::string;
+
+// a typical EHLO reply of a large provider
+static const char ehlo[] =
+  "250-mx.example.com at your service, [192.0.2.1]\r\n"
+  "250-SIZE 157286400\r\n"
+  "250-8BITMIME\r\n"
+  "250-STARTTLS\r\n"
+  "250-ENHANCEDSTATUSCODES\r\n"
+  "250-PIPELINING\r\n"
+  "250-AUTH LOGIN PLAIN XOAUTH2\r\n"
+  "250-CHUNKING\r\n"
+  "250 SMTPUTF8\r\n";
+
+static double
+now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The former way: copy every line into a string, then compare and split
+ * it to find the interesting extensions.
+ */
+static unsigned
+copying(const char *p, const char *e)
+{
+  unsigned caps = 0;
+  string text;
+  while(p!=e) {
+    const char *nl = (const char*)memchr(p, '\n', e-p);
+    text.assign(p+4, nl-1);
+    p = nl + 1;
+    if (text=="STARTTLS") {
+      caps |= CAP_STARTTLS;
+    } else
+    if (text=="CHUNKING") {
+      caps |= CAP_CHUNKING;
+    } else
+    if (text.compare(0, 5, "AUTH ", 5)==0) {
+      string::size_type i0 = 5, i1;
+      while(true) {
+        i1 = text.find(' ', i0);
+        string name = text.substr(i0, i1-i0);
+        if (name=="PLAIN")
+          caps |= CAP_AUTH;
+        if (i1==string::npos)
+          break;
+        i0 = i1 + 1;
+      }
+    }
+  }
+  return caps;
+}
+
+static unsigned
+viewing(const char *p, const char *e)
+{
+  caps_t caps;
+  reply_t reply;
+  while(parseReply(p, e, &reply, &p)==1)
+    parseCapability(&caps, reply.text, reply.len);
+  return caps.flags;
+}
+
+int
+main()
+{
+  const char *e = ehlo + sizeof(ehlo) - 1;
+  caps_t caps;
+  reply_t reply;
+  const char *p = ehlo;
+  unsigned lines = 0;
+  while(parseReply(p, e, &reply, &p)==1) {
+    parseCapability(&caps, reply.text, reply.len);
+    ++lines;
+  }
+  if (lines!=9 || reply.code!=250 || reply.more ||
+      caps.size!=157286400 ||
+      caps.auth!=(AUTH_LOGIN|AUTH_PLAIN|AUTH_XOAUTH2) ||
+      caps.flags!=(CAP_SIZE|CAP_8BITMIME|CAP_STARTTLS|CAP_ENHANCEDSTATUSCODES|
+                   CAP_PIPELINING|CAP_AUTH|CAP_CHUNKING|CAP_SMTPUTF8))
+  {
+    printf("reply-bench: the EHLO reply was parsed wrong\n");
+    return EXIT_FAILURE;
+  }
+
+  const unsigned rounds = 1000000;
+  unsigned sum = 0;
+  double t0 = now();
+  for(unsigned i=0; i<rounds; ++i)
+    sum += copying(ehlo, e);
+  double t1 = now();
+  for(unsigned i=0; i<rounds; ++i)
+    sum += viewing(ehlo, e);
+  double t2 = now();
+
+  printf("string copies: %6.1f ns per line\n", (t1-t0) * 1e9 / rounds / lines);
+  printf("views        : %6.1f ns per line\n", (t2-t1) * 1e9 / rounds / lines);
+  return sum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+
+/*
+ * Parser for the replies of SMTP servers, RFC 5321, 4.2. The parser works
+ * on the connection's read buffer and doesn't copy anything: the text of
+ * a reply line is returned as a pointer into the buffer.
+ */
+
+struct reply_t
+{
+  unsigned code;
+  bool more;          // the line is followed by more lines of the reply
+  const char *text;   // text after the code, not terminated
+  size_t len;
+};
+
+int parseReply(const char *p, const char *e, reply_t *reply, const char **next);
+
+/*
+ * Service extensions announced in the EHLO reply.
+ */
+
+static const unsigned CAP_PIPELINING          = 0x0001; // RFC 2920
+static const unsigned CAP_SIZE                = 0x0002; // RFC 1870
+static const unsigned CAP_CHUNKING            = 0x0004; // RFC 3030
+static const unsigned CAP_BINARYMIME          = 0x0008; // RFC 3030
+static const unsigned CAP_8BITMIME            = 0x0010; // RFC 6152
+static const unsigned CAP_STARTTLS            = 0x0020; // RFC 3207
+static const unsigned CAP_AUTH                = 0x0040; // RFC 4954
+static const unsigned CAP_ENHANCEDSTATUSCODES = 0x0080; // RFC 2034
+static const unsigned CAP_DSN                 = 0x0100; // RFC 3461
+static const unsigned CAP_SMTPUTF8            = 0x0200; // RFC 6531
+
+// SASL mechanisms listed with AUTH
+static const unsigned AUTH_PLAIN      = 0x01;
+static const unsigned AUTH_LOGIN      = 0x02;
+static const unsigned AUTH_CRAM_MD5   = 0x04;
+static const unsigned AUTH_DIGEST_MD5 = 0x08;
+static const unsigned AUTH_XOAUTH2    = 0x10;
+
+struct caps_t
+{
+  caps_t() {
+    clear();
+  }
+  void clear() {
+    flags = 0;
+    auth = 0;
+    size = 0;
+  }
+  unsigned flags;           // CAP_*
+  unsigned auth;            // AUTH_*
+  unsigned long long size;  // SIZE limit, 0 when there is none
+};
+
+void parseCapability(caps_t *caps, const char *text, size_t len);
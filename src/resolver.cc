@@ -0,0 +1,549 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <map>
+
+#include "resolver.hh"
+#include "deadline.hh"
+#include "log.hh"
+
+using std::string;
+using std::vector;
+using std::map;
+
+// RFC 1035: Domain Names - Implementation and Specification
+// RFC 2308: Negative Caching of DNS Queries
+// RFC 3596: DNS Extensions to Support IP Version 6
+// RFC 6891: Extension Mechanisms for DNS (EDNS(0))
+
+static const unsigned timeout_query = 2;  // seconds per attempt
+static const unsigned max_tries = 3;
+static const unsigned ttl_max = 86400;
+static const unsigned ttl_negative = 300; // when the answer has no SOA
+static const unsigned ttl_fail = 30;      // don't hammer a failing server
+static const size_t udp_size = 1232;
+static const size_t cache_max = 16384;    // entries
+static const unsigned ttl_sweep = 60;     // seconds between cache sweeps
+
+struct waiter_t
+{
+  dnscallback_t cb;
+  void *data;
+};
+
+struct query_t
+{
+  string key;
+  string name;
+  int type;
+  unsigned short id;
+  unsigned tries;
+  deadline_t deadline;
+  string packet;
+  vector<waiter_t> waiters;
+};
+
+struct cacheentry_t
+{
+  unsigned long long expires; // monotonicMs()
+  dnsresult_t result;
+};
+
+static int sock = -1;
+static sockaddr_storage server;
+static socklen_t serverlen;
+static map<string, cacheentry_t> cache;
+static map<string, query_t*> pending;     // by key
+static map<unsigned short, query_t*> ids; // by query id
+static unsigned long long swept = 0;      // monotonicMs() of the last sweep
+
+static bool sendQuery(query_t *q);
+static void finishQuery(query_t *q, dnsresult_t *result, unsigned cachettl);
+static void sweepCache(unsigned long long now);
+static void parseAnswer(const unsigned char *msg, size_t len);
+static bool readName(const unsigned char *msg, size_t len, size_t *pos, string *name);
+static string lowercase(const string &name);
+
+/**
+ * Open the socket to the name server.
+ *
+ * \param name
+ *   "<address>" or "<IPv4 address>:<port>" of the name server, the first
+ *   'nameserver' of /etc/resolv.conf is used when 0
+ */
+bool
+initResolver(const char *name)
+{
+  char buffer[256];
+  string host, port = "53";
+
+  if (name) {
+    host = name;
+  } else {
+    FILE *f = fopen("/etc/resolv.conf", "r");
+    if (f) {
+      while(fgets(buffer, sizeof(buffer), f)) {
+        char addr[sizeof(buffer)];
+        if (sscanf(buffer, " nameserver %255s", addr)==1) {
+          host = addr;
+          break;
+        }
+      }
+      fclose(f);
+    }
+    if (host.empty())
+      host = "127.0.0.1";
+  }
+  string::size_type i = host.find(':');
+  if (i!=string::npos && host.find(':', i+1)==string::npos) {
+    port = host.substr(i+1);
+    host.erase(i);
+  }
+
+  addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  hints.ai_socktype = SOCK_DGRAM;
+  int r = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+  if (r!=0) {
+    LOG(LEVEL_ERROR, "resolver: invalid name server address '%s': %s\n",
+                     host.c_str(), gai_strerror(r));
+    return false;
+  }
+  memcpy(&server, ai->ai_addr, ai->ai_addrlen);
+  serverlen = ai->ai_addrlen;
+  freeaddrinfo(ai);
+
+  sock = socket(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock<0) {
+    perror("resolver: socket");
+    return false;
+  }
+  return true;
+}
+
+int
+resolverFd()
+{
+  return sock;
+}
+
+/**
+ * Milliseconds until the next query needs to be retransmitted, -1 when
+ * no query is pending.
+ */
+int
+resolverTimeout()
+{
+  int timeout = -1;
+  for(map<string, query_t*>::iterator p = pending.begin();
+      p != pending.end();
+      ++p)
+  {
+    int t = deadlineRemaining(&p->second->deadline);
+    if (t>=0 && (timeout<0 || t<timeout))
+      timeout = t;
+  }
+  return timeout;
+}
+
+/**
+ * Look up the records of 'type' for 'name' and pass them to 'cb'.
+ */
+void
+resolve(const string &aName, int type, dnscallback_t cb, void *data)
+{
+  string name = lowercase(aName);
+  if (!name.empty() && name[name.size()-1]=='.')
+    name.erase(name.size()-1);
+  char key[16];
+  snprintf(key, sizeof(key), "%d:", type);
+  string k = key + name;
+
+  waiter_t w;
+  w.cb = cb;
+  w.data = data;
+
+  map<string, cacheentry_t>::iterator c = cache.find(k);
+  if (c!=cache.end()) {
+    unsigned long long now = monotonicMs();
+    if (c->second.expires > now) {
+      dnsresult_t result = c->second.result;
+      result.ttl = (c->second.expires - now) / 1000;
+      cb(data, &result);
+      return;
+    }
+    cache.erase(c);
+  }
+
+  map<string, query_t*>::iterator p = pending.find(k);
+  if (p!=pending.end()) {
+    p->second->waiters.push_back(w);
+    return;
+  }
+
+  query_t *q = new query_t;
+  q->key = k;
+  q->name = name;
+  q->type = type;
+  q->tries = 0;
+  q->waiters.push_back(w);
+  do {
+    if (getrandom(&q->id, sizeof(q->id), 0)!=sizeof(q->id))
+      q->id = random();
+  } while(ids.find(q->id)!=ids.end());
+
+  // header: id, RD, one question, one additional record
+  static const unsigned char header[10] = { 1, 0, 0, 1, 0, 0, 0, 0, 0, 1 };
+  q->packet += (char)(q->id >> 8);
+  q->packet += (char)(q->id & 0xff);
+  q->packet.append((const char*)header, sizeof(header));
+  // an empty or too long label can't be encoded, the query would ask for
+  // a different name
+  bool valid = name.size() <= 253 &&
+               (name.empty() || name[name.size()-1]!='.');
+  string::size_type i0 = 0;
+  while(valid && i0 < name.size()) {
+    string::size_type i1 = name.find('.', i0);
+    if (i1==string::npos)
+      i1 = name.size();
+    if (i1-i0 == 0 || i1-i0 > 63) {
+      valid = false;
+      break;
+    }
+    q->packet += (char)(i1-i0);
+    q->packet.append(name, i0, i1-i0);
+    i0 = i1 + 1;
+  }
+  q->packet += '\0';
+  q->packet += (char)(type >> 8);
+  q->packet += (char)(type & 0xff);
+  q->packet.append("\0\1", 2); // class IN
+  // EDNS(0) OPT record announcing our UDP payload size
+  q->packet.append("\0\0\x29", 3);
+  q->packet += (char)(udp_size >> 8);
+  q->packet += (char)(udp_size & 0xff);
+  q->packet.append("\0\0\0\0\0\0", 6);
+
+  pending[k] = q;
+  ids[q->id] = q;
+  if (!valid) {
+    LOG(LEVEL_INFO, "resolver: invalid name '%s'\n", name.c_str());
+    dnsresult_t result;
+    result.status = DNS_FAIL;
+    finishQuery(q, &result, 0);
+    return;
+  }
+  if (!sendQuery(q)) {
+    dnsresult_t result;
+    result.status = DNS_FAIL;
+    finishQuery(q, &result, 0);
+  }
+}
+
+bool
+sendQuery(query_t *q)
+{
+  ++q->tries;
+  armDeadline(&q->deadline, timeout_query * q->tries);
+  if (sendto(sock, q->packet.data(), q->packet.size(), 0,
+             (sockaddr*)&server, serverlen) < 0)
+  {
+    if (errno==EAGAIN)
+      return true; // handled like a lost packet
+    perror("resolver: sendto");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Remove the query, cache the result and run the callbacks.
+ */
+void
+finishQuery(query_t *q, dnsresult_t *result, unsigned cachettl)
+{
+  pending.erase(q->key);
+  ids.erase(q->id);
+  if (cachettl > ttl_max)
+    cachettl = ttl_max;
+  result->ttl = cachettl;
+  if (cachettl>0) {
+    unsigned long long now = monotonicMs();
+    sweepCache(now);
+    cacheentry_t &c = cache[q->key];
+    c.expires = now + (unsigned long long)cachettl * 1000;
+    c.result = *result;
+  }
+  for(size_t i=0; i<q->waiters.size(); ++i)
+    q->waiters[i].cb(q->waiters[i].data, result);
+  delete q;
+}
+
+/**
+ * Entries are only replaced when their name is looked up again. Remove
+ * the expired ones now and then, and when the cache is full the one which
+ * expires first, to make room for a new entry.
+ */
+void
+sweepCache(unsigned long long now)
+{
+  if (now - swept >= ttl_sweep * 1000ULL || cache.size() >= cache_max) {
+    swept = now;
+    map<string, cacheentry_t>::iterator c = cache.begin();
+    while(c!=cache.end()) {
+      if (c->second.expires <= now)
+        cache.erase(c++);
+      else
+        ++c;
+    }
+  }
+  if (cache.size() >= cache_max) {
+    map<string, cacheentry_t>::iterator first = cache.begin();
+    for(map<string, cacheentry_t>::iterator c = cache.begin();
+        c != cache.end();
+        ++c)
+    {
+      if (c->second.expires < first->second.expires)
+        first = c;
+    }
+    cache.erase(first);
+  }
+}
+
+/**
+ * Read the answers which have arrived and retransmit queries which
+ * timed out.
+ */
+void
+resolverEvent()
+{
+  unsigned char msg[udp_size];
+  while(true) {
+    sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n = recvfrom(sock, msg, sizeof(msg), 0, (sockaddr*)&from, &fromlen);
+    if (n<0) {
+      if (errno==EINTR)
+        continue;
+      if (errno!=EAGAIN)
+        perror("resolver: recvfrom");
+      break;
+    }
+    if (fromlen!=serverlen || memcmp(&from, &server, serverlen)!=0)
+      continue;
+    parseAnswer(msg, n);
+  }
+
+  vector<query_t*> expired;
+  for(map<string, query_t*>::iterator p = pending.begin();
+      p != pending.end();
+      ++p)
+  {
+    if (deadlineExpired(&p->second->deadline))
+      expired.push_back(p->second);
+  }
+  for(size_t i=0; i<expired.size(); ++i) {
+    query_t *q = expired[i];
+    if (q->tries < max_tries && sendQuery(q))
+      continue;
+    LOG(LEVEL_INFO, "resolver: no answer for '%s'\n", q->name.c_str());
+    dnsresult_t result;
+    result.status = DNS_FAIL;
+    finishQuery(q, &result, ttl_fail);
+  }
+}
+
+static inline unsigned
+get16(const unsigned char *p)
+{
+  return (p[0]<<8) | p[1];
+}
+
+static inline unsigned
+get32(const unsigned char *p)
+{
+  return (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+void
+parseAnswer(const unsigned char *msg, size_t len)
+{
+  if (len<12)
+    return;
+  map<unsigned short, query_t*>::iterator p = ids.find(get16(msg));
+  if (p==ids.end())
+    return;
+  query_t *q = p->second;
+  if (!(msg[2] & 0x80))
+    return; // not a response
+
+  // the question must be ours
+  size_t pos = 12;
+  string name;
+  if (get16(msg+4)!=1 || !readName(msg, len, &pos, &name) || pos+4>len)
+    return;
+  if (lowercase(name)!=q->name || (int)get16(msg+pos)!=q->type)
+    return;
+  pos += 4;
+
+  dnsresult_t result;
+  unsigned rcode = msg[3] & 0x0f;
+  // a truncated answer may lack records, a short MX list would send mail
+  // to the wrong hosts; there is no TCP fallback so it counts as a failure
+  if ((rcode!=0 && rcode!=3) || (msg[2] & 0x02)) {
+    result.status = DNS_FAIL;
+    finishQuery(q, &result, ttl_fail);
+    return;
+  }
+
+  unsigned ancount = get16(msg+6);
+  unsigned nscount = get16(msg+8);
+  unsigned ttl = ttl_max;
+  unsigned negttl = ttl_negative;
+  for(unsigned i=0; i<ancount+nscount; ++i) {
+    if (!readName(msg, len, &pos, &name) || pos+10>len)
+      break;
+    unsigned type = get16(msg+pos);
+    unsigned rrttl = get32(msg+pos+4);
+    size_t rdlen = get16(msg+pos+8);
+    pos += 10;
+    if (pos+rdlen>len)
+      break;
+    size_t next = pos + rdlen;
+    if (i>=ancount) {
+      // RFC 2308, 5: the SOA in the authority section limits the
+      // time a negative answer may be cached
+      if (type==6) {
+        string mname, rname;
+        if (readName(msg, len, &pos, &mname) &&
+            readName(msg, len, &pos, &rname) &&
+            pos+20<=next)
+        {
+          unsigned minimum = get32(msg+pos+16);
+          negttl = rrttl < minimum ? rrttl : minimum;
+        }
+      }
+    } else
+    if ((int)type==q->type) {
+      dnsrecord_t rr;
+      rr.type = type;
+      rr.pref = 0;
+      memset(rr.addr, 0, sizeof(rr.addr));
+      bool ok = false;
+      switch(type) {
+        case DNS_A:
+          if ((ok = rdlen==4))
+            memcpy(rr.addr, msg+pos, 4);
+          break;
+        case DNS_AAAA:
+          if ((ok = rdlen==16))
+            memcpy(rr.addr, msg+pos, 16);
+          break;
+        case DNS_MX:
+          if (rdlen>=3) {
+            rr.pref = get16(msg+pos);
+            pos += 2;
+            ok = readName(msg, len, &pos, &rr.name);
+            rr.name = lowercase(rr.name);
+          }
+          break;
+      }
+      if (ok) {
+        result.records.push_back(rr);
+        if (rrttl<ttl)
+          ttl = rrttl;
+      }
+    }
+    pos = next;
+  }
+
+  if (!result.records.empty()) {
+    result.status = DNS_OK;
+  } else {
+    result.status = rcode==3 ? DNS_NXDOMAIN : DNS_NODATA;
+    ttl = negttl;
+  }
+  finishQuery(q, &result, ttl);
+}
+
+/**
+ * Read a possibly compressed domain name from a DNS message.
+ *
+ * \param pos
+ *   in: offset of the name, out: offset behind the name
+ */
+bool
+readName(const unsigned char *msg, size_t len, size_t *pos, string *name)
+{
+  size_t p = *pos;
+  bool jumped = false;
+  unsigned hops = 0;
+  name->clear();
+  while(true) {
+    if (p>=len)
+      return false;
+    unsigned l = msg[p];
+    if ((l & 0xc0)==0xc0) {
+      if (p+1>=len || ++hops>16)
+        return false;
+      if (!jumped)
+        *pos = p + 2;
+      jumped = true;
+      p = ((l & 0x3f)<<8) | msg[p+1];
+      continue;
+    }
+    if (l & 0xc0)
+      return false;
+    ++p;
+    if (l==0)
+      break;
+    if (p+l>len)
+      return false;
+    if (!name->empty())
+      *name += '.';
+    name->append((const char*)msg+p, l);
+    p += l;
+  }
+  if (!jumped)
+    *pos = p;
+  return true;
+}
+
+string
+lowercase(const string &name)
+{
+  string result(name);
+  for(size_t i=0; i<result.size(); ++i)
+    result[i] = tolower((unsigned char)result[i]);
+  return result;
+}
@@ -0,0 +1,67 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string>
+#include <vector>
+
+/*
+ * A non-blocking stub resolver for the records needed to deliver mail.
+ * Queries are sent via UDP to a single recursive name server and answers,
+ * including negative ones, are cached for their TTL.
+ */
+
+enum {
+  DNS_A    = 1,
+  DNS_MX   = 15,
+  DNS_AAAA = 28
+};
+
+enum {
+  DNS_OK,
+  DNS_NXDOMAIN, // the name doesn't exist
+  DNS_NODATA,   // the name exists but has no records of the type
+  DNS_FAIL      // server failure or timeout
+};
+
+struct dnsrecord_t
+{
+  unsigned short type;
+  unsigned short pref;      // DNS_MX: preference
+  std::string name;         // DNS_MX: the mail exchanger
+  unsigned char addr[16];   // DNS_A: 4 bytes, DNS_AAAA: 16 bytes
+};
+
+struct dnsresult_t
+{
+  int status;
+  unsigned ttl;             // seconds the result remains valid
+  std::vector<dnsrecord_t> records;
+};
+
+/**
+ * Called once for every resolve(). When the answer is cached this
+ * happens before resolve() returns.
+ */
+typedef void (*dnscallback_t)(void *data, const dnsresult_t *result);
+
+bool initResolver(const char *server);
+void resolve(const std::string &name, int type, dnscallback_t cb, void *data);
+int resolverFd();
+int resolverTimeout();
+void resolverEvent();
@@ -17,22 +17,29 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <string>
-#include <stdio.h>
+#include "rfc822-address.hh"
+
 #include <stdlib.h>
+#include <string.h>
 
 using std::string;
+using std::string_view;
 
 static const int TKN_ATOM = -2;
 static const int TKN_QUOTED_STRING = -3;
 static const int TKN_DOMAIN_LITERAL = -4;
 static const int TKN_EOH = -5;
-static string yytext;
-
-static bool parse_address(FILE *in);
-static int lex(FILE *in);
+static const int TKN_ERROR = -6;
 
-static bool eoh = false;
+// characters of an atom: any CHAR except specials, SPACE and CTLs
+static struct atomChars_t
+{
+  atomChars_t() {
+    for(unsigned c=0; c<256; ++c)
+      set[c] = c>32 && c<=127 && !strchr("()<>@,;:\\\".[]", c);
+  }
+  bool set[256];
+} atomChars;
 
 /*
  * For just fetching the email addresses from the header lines, the 
@@ -45,212 +52,190 @@ static bool eoh = false;
  * domain := sub-domain *("." sub-domain)
  * sub-domain  :=  atom | domain-literal
  *
+ * An address is the sequence of tokens from its first to its last token.
+ * Usually there is nothing between them and the address is a span of the
+ * buffer. Otherwise 'cfws' is set and appendAddress() drops the whitespace
+ * and comments in between.
  */
 
-static string address;
-static char hchar = 'T';
-static unsigned count; 
-static bool zero = false;
-static string *orig = 0;
-
 /**
- * \param in
- * \param r
- *   string which takes the addresses in the form of
- *   (('T'|'F') address '\0')*
- * \param c
- *   'T' or 'F'
- * \param z
- *   append a zero ('\0') to each address copied to r
- * \param o
+ * \param field
+ *   The header field's body, the part after the colon, including the
+ *   line break and the continuation lines. It may be followed by further
+ *   header fields.
  */
-unsigned
-parseAddress(FILE *in, string *r, char c, bool z, string *o)
-{
-//printf("----------- start parse -------------\n");
-  count = 0;
-  zero = z;
-  hchar = c;
-  orig = o;
-  address.clear();
-  parse_address(in);
-  *r += address;
-  orig = 0;
-//printf("------------- end parse --------------\n");
-  return count;
-}
-
-static void
-gotOne(const string &s)
+addressParser_t::addressParser_t(string_view field)
 {
-  if (s.empty())
-    return;
-//printf("ADDRESS: '%s'\n", s.c_str());
-  address += hchar;
-  address += s;
-  if (zero) {
-    address += '\0';
-  }
-  ++count;
+  error = 0;
+  end = 0;
+  buffer = field.data();
+  size = field.size();
+  state = 0;
+  ingroup = inroute = done = false;
+  begin = last = 0;
+  cfws = false;
+  token = token_end = 0;
+  token_cfws = false;
 }
 
+/**
+ * Fetch the next address.
+ *
+ * \param address
+ *   the address, a span of the buffer
+ * \return
+ *   'false' at the end of the header field or on a syntax error
+ */
 bool
-parse_address(FILE *in)
+addressParser_t::next(address_t *address)
 {
-  string address;
-  eoh = false;
-  bool ingroup, inroute;
-  ingroup = inroute = false;
+  bool found = false;
 
-  int state = 0;
-  while(true) {
-    int c = lex(in);
-//printf("top : %i '%c' (%i) -> '%s' '%s', ingroup=%i, inroute=%i\n", state, c, c, address.c_str(), yytext.c_str(),ingroup,inroute);
+// the address collected so far
+#define APPEND() { \
+  if (!begin) begin = token; \
+  else if (token != last) cfws = true; \
+  if (token_cfws) cfws = true; \
+  last = token_end; }
+#define CLEAR() { begin = 0; cfws = false; }
+#define FOUND(l) if (begin) { \
+  address->text = string_view(begin, last-begin); \
+  address->cfws = cfws; \
+  address->local = l; \
+  found = true; }
+#define FAIL(msg) { error = msg; done = true; return false; }
+
+  while(!done) {
+    int c = lex();
+    if (c==TKN_ERROR) {
+      done = true;
+      return false;
+    }
     switch(state) {
       case 0:
         switch(c) {
           case TKN_QUOTED_STRING:
           case TKN_ATOM:
-            address += yytext;
+            APPEND();
             state = 1;
             break;
           case TKN_EOH:
-            return true;
+            done = true;
+            break;
           case ',':
-            address.clear();
+            CLEAR();
             break;
           default:
-            printf("unexpected character: '%c'\n", c);
-            exit(1);
-            break;
+            FAIL("unexpected character");
         }
         break;
       case 1:
         switch(c) {
           case '.':
-            address += c;
+            APPEND();
             state = 2;
             break;
           case '@':
-            address += c;
+            APPEND();
             state = 4;
             break;
           case '<':
             state = 7;
             break;
           case ':':
-            address.clear();
+            CLEAR();
             ingroup = true;
             state = 6;
             break;
           case TKN_QUOTED_STRING:
           case TKN_ATOM:
-            address += yytext;
-            // state = 6;
+            APPEND();
             break;
           case TKN_EOH:
-            address += "@localhost";
-            gotOne(address);
-            return true;
+            FOUND(true);
+            done = true;
+            break;
         }
         break;
       case 2:
         switch(c) {
           case TKN_QUOTED_STRING:
           case TKN_ATOM:
-            address += yytext;
+            APPEND();
             state = 3;
             break;
           case TKN_EOH:
-          case EOF:
-//            printf("end of header\n");
-            return true;
+            done = true;
+            break;
           default:
-            fprintf(stderr, "expected text after dot '.' or colon ':', got %i\n", c);
-            exit(EXIT_FAILURE);
+            FAIL("expected text after dot '.' or colon ':'");
         }
         break;
       case 3:
         switch(c) {
           case '.':
-            address += c;
+            APPEND();
             state = 2;
             break;
           case '@':
-            address += c;
+            APPEND();
             state = 4;
             break;
           default:
-            fprintf(stderr, "expected '@' or '.' after word\n");
-            exit(EXIT_FAILURE);
+            FAIL("expected '@' or '.' after word");
         }
         break;
       case 4:
         switch(c) {
           case TKN_DOMAIN_LITERAL:
           case TKN_ATOM:
-            address += yytext;
+            APPEND();
             state = 5;
             break;
           case ',':
-            gotOne(address);
-            address.clear();
+            FOUND(false);
+            CLEAR();
             state = 0;
             break;
           default:
-            fprintf(stderr, "expected atom/domain-literal after '@' or '.'\n");
-            exit(EXIT_FAILURE);
+            FAIL("expected atom/domain-literal after '@' or '.'");
         }
         break;
       case 5:
         switch(c) {
           case '.':
-            address += c;
+            APPEND();
             state = 4;
             break;
           case ';':
-            if (ingroup) {
-              gotOne(address);
-              address.clear();
-              state = 0;
-              ingroup = false;
-              break;
-            } else {
-              fprintf(stderr, "unexpected end of group\n");
-              exit(EXIT_FAILURE);
-            }
+            if (!ingroup)
+              FAIL("unexpected end of group");
+            FOUND(false);
+            CLEAR();
+            state = 0;
+            ingroup = false;
             break;
           case '>':
-            gotOne(address);
-            address.clear();
+            FOUND(false);
+            CLEAR();
             if (inroute) {
               inroute = false;
-              if (ingroup)
-                state = 6;
-              else
-                state = 0;
-              break;
+              state = ingroup ? 6 : 0;
             }
             break;
           case ',':
-            gotOne(address);
-            address.clear();
-            if (ingroup)
-              state = 6;
-            else
-              state = 0;
-            break;
+            FOUND(false);
+            CLEAR();
+            state = ingroup ? 6 : 0;
             break;
           case TKN_EOH:
-            if (ingroup || inroute) {
-              fprintf(stderr, "unexpected end of header\n");
-              exit(EXIT_FAILURE);
-            }
-            gotOne(address);
-            return true;
+            if (ingroup || inroute)
+              FAIL("unexpected end of header");
+            FOUND(false);
+            done = true;
+            break;
           default:
-            fprintf(stderr, "expected dot '.' after atom/domain-literal: %i\n", c);
-            exit(EXIT_FAILURE);
+            FAIL("expected dot '.' after atom/domain-literal");
         }
         break;
         
@@ -258,40 +243,32 @@ parse_address(FILE *in)
         switch(c) {
           case TKN_QUOTED_STRING:
           case TKN_ATOM:
-            address += yytext;
+            APPEND();
             state = 1;
             break;
           case '<':
-            address.clear();
+            CLEAR();
             state = 7;
             break;
           case ':':
-            if (ingroup) {
-              fprintf(stderr, "group inside group\n");
-              exit(EXIT_FAILURE);
-            }
-            address.clear();
+            if (ingroup)
+              FAIL("group inside group");
+            CLEAR();
             ingroup = true;
             break;
           case ';':
-            if (!ingroup) {
-              fprintf(stderr, "unexpected end of group\n");
-              exit(EXIT_FAILURE);
-            }
+            if (!ingroup)
+              FAIL("unexpected end of group");
             ingroup = false;
             state = 0;
             break;
           case ',':
-            if (!ingroup) {
-              fprintf(stderr, "unexpected ,\n");
-              exit(EXIT_FAILURE);
-            }
+            if (!ingroup)
+              FAIL("unexpected ,");
             state = 0;
             break;
           default:
-            printf("character    : '%c'\n", c);
-            exit(1);
-          break;
+            FAIL("unexpected character");
         }
         break;
         
@@ -303,41 +280,59 @@ parse_address(FILE *in)
           case TKN_ATOM:
           case TKN_QUOTED_STRING:
             inroute = true;
-            address = yytext;
+            CLEAR();
+            APPEND();
             state = 3;
             break;
           default:
-            fprintf(stderr, "malformed address\n");
-            exit(EXIT_FAILURE);
+            FAIL("malformed address");
         }
         break;
       case 8:
         if (c==':') {
-          address.clear();
+          CLEAR();
           inroute = true;
           state = 2;
         }
         break;
     }
+    if (found)
+      return true;
   }
+  return false;
+
+#undef APPEND
+#undef CLEAR
+#undef FOUND
+#undef FAIL
 }
 
 // return single character, atom, quoted-string, domain-literal and
 // end-of-headerline, skip comments and compress whitespace
 int
-lex(FILE *in)
+addressParser_t::lex()
 {
-//printf("begin lex/n");
   int comment = 0;
-  int cstate;
+  int cstate = 0;
   int state = 0;
-  yytext.clear();
+  token_cfws = false;
   while(true) {
-    int c = fgetc(in); // don't compress blanks inside strings
-    if (orig) {
-      *orig += c;
+    if (end==size) {
+      // the end of the buffer ends the header field
+      switch(state) {
+        case 3:
+          token_end = buffer + end;
+          return TKN_ATOM;
+        case 0:
+        case 8:
+        case 9:
+          return TKN_EOH;
+        default:
+          error = "unexpected end of header";
+          return TKN_ERROR;
+      }
     }
-//printf("lex : %i '%c' (%i)\n", state, c<32?'?':c, c);
+    int c = (unsigned char)buffer[end++];
     switch(state) {
       case 0:
         switch(c) {
@@ -351,7 +346,7 @@ lex(FILE *in)
             state = 9;
             break;
           case '\"':
-            yytext += c;
+            token = buffer + end - 1;
             state = 1;
             break;
           case ')':
@@ -364,10 +359,11 @@ lex(FILE *in)
           case '\\':
           case '.':
           case ']':
+            token = buffer + end - 1;
+            token_end = buffer + end;
             return c;
-            break;
           case '[':
-            yytext += c;
+            token = buffer + end - 1;
             state = 4;
             break;
           case '(':
@@ -378,7 +374,9 @@ lex(FILE *in)
           default:
             if (c<=32 || c>127)
               return c;
-            yytext += c;
+            token = buffer + end - 1;
+            while(end!=size && atomChars.set[(unsigned char)buffer[end]])
+              ++end;
             state = 3;
             break;
         }
@@ -391,15 +389,11 @@ lex(FILE *in)
             state = 2;
             break;
           case '\"':
-            yytext += c;
+            token_end = buffer + end;
             return TKN_QUOTED_STRING;
-          default:
-            yytext += c;
-            break;
         }
         break;
       case 2: // "..\?
-        yytext += c;
         state = 1;
         break;
 
@@ -407,13 +401,12 @@ lex(FILE *in)
       case 3:
         switch(c) {
           case '(':
+            // the comment is a part of the atom's span
             ++comment;
             cstate = state;
             state = 6;
+            token_cfws = true;
             break;
-          case TKN_EOH:
-          case EOF:
-            return TKN_EOH;
           case '\"':
           case ')':
           case '<':
@@ -426,42 +419,32 @@ lex(FILE *in)
           case '.':
           case '[':
           case ']':
-            ungetc(c, in);
-            if (orig && !orig->empty()) {
-              orig->erase(orig->size()-1);
-            }
+            token_end = buffer + --end;
             return TKN_ATOM;
           default:
             if (c<=32 || c>127) {
-              ungetc(c, in);
-              if (orig && !orig->empty()) {
-                orig->erase(orig->size()-1);
-              }
+              token_end = buffer + --end;
               return TKN_ATOM;
             }
-            yytext += c;
             break;
         }
         break;
       
+      // domain literal
       case 4:
         switch(c) {
           case '[':
-            fprintf(stderr, "unexpected '['\n");
-            exit(EXIT_FAILURE);
+            error = "unexpected '['";
+            return TKN_ERROR;
           case ']':
-            yytext += c;
+            token_end = buffer + end;
             return TKN_DOMAIN_LITERAL;
-            break;
           case '\\':
             state = 5;
             break;
-          default:
-            yytext += c;
         }
         break;
       case 5:
-        yytext += c;
         state = 4;
         break;
       
@@ -479,21 +462,10 @@ lex(FILE *in)
           case '\\':
             state = 7;
             break;
-          case EOF:
-            fprintf(stderr, "unexpected end of header\n");
-            exit(EXIT_FAILURE);
-            break;
         }
         break;
       case 7:
-        switch(c) {
-          case EOF:
-            fprintf(stderr, "unexpected end of header\n");
-            exit(EXIT_FAILURE);
-            break;
-          default:
-            state = 6;
-        }
+        state = 6;
         break;
       
       // end of line
@@ -503,10 +475,7 @@ lex(FILE *in)
             state = 9;
             break;
           default:
-            ungetc(c, in);
-            if (orig && !orig->empty()) {
-              orig->erase(orig->size()-1);
-            }
+            --end;
             return '\r';
         }
         break;
@@ -517,16 +486,124 @@ lex(FILE *in)
             state = 0;
             break;
           default:
-            ungetc(c, in);
-            if (orig && !orig->empty()) {
-              orig->erase(orig->size()-1);
-            }
+            --end;
             return TKN_EOH;
         }
     }
   }
 }
 
+/**
+ * Append the address to 'r', dropping the whitespace and comments
+ * between its tokens.
+ */
+void
+appendAddress(const address_t &address, string *r)
+{
+  if (!address.cfws) {
+    r->append(address.text);
+  } else {
+    const char *p = address.text.data();
+    const char *e = p + address.text.size();
+    while(p!=e) {
+      switch(*p) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+          ++p;
+          break;
+        case '(': {
+          int comment = 0;
+          do {
+            if (*p=='\\' && p+1!=e)
+              ++p;
+            else if (*p=='(')
+              ++comment;
+            else if (*p==')')
+              --comment;
+            ++p;
+          } while(comment && p!=e);
+        } break;
+        case '\"':
+        case '[': {
+          const char *q = p;
+          char close = *p=='\"' ? '\"' : ']';
+          for(++q; q!=e && *q!=close; ++q) {
+            if (*q=='\\' && q+1!=e)
+              ++q;
+          }
+          if (q!=e)
+            ++q;
+          r->append(p, q-p);
+          p = q;
+        } break;
+        default:
+          *r += *p++;
+      }
+    }
+  }
+  if (address.local)
+    r->append("@localhost");
+}
+
+/**
+ * Read a header field's body from 'in' and append its addresses to 'r'.
+ *
+ * \param in
+ *   positioned after the colon of the header field
+ * \param r
+ *   string which takes the addresses in the form of
+ *   (('T'|'F') address '\0')*
+ * \param c
+ *   'T' or 'F'
+ * \param z
+ *   append a zero ('\0') to each address copied to r
+ * \param o
+ *   when not 0, the header field's body is appended to it
+ * \param error
+ *   out: the reason when the header field couldn't be parsed
+ * \return
+ *   the number of addresses found or -1 on a syntax error
+ */
+int
+parseAddress(FILE *in, string *r, char c, bool z, string *o, const char **error)
+{
+  // the header field ends with a line not starting with whitespace
+  string field;
+  int ch;
+  while((ch=getc_unlocked(in))!=EOF) {
+    field += ch;
+    if (ch=='\n') {
+      ch = getc_unlocked(in);
+      if (ch!=' ' && ch!='\t') {
+        ungetc(ch, in);
+        break;
+      }
+      field += ch;
+    }
+  }
+  if (o)
+    *o += field;
+
+  int count = 0;
+  addressParser_t parser(field);
+  address_t address;
+  while(parser.next(&address)) {
+    *r += c;
+    appendAddress(address, r);
+    if (z)
+      *r += '\0';
+    ++count;
+  }
+  if (parser.error) {
+    if (error)
+      *error = parser.error;
+    return -1;
+  }
+  return count;
+}
+
 #if 0
 /*
 <word>
@@ -575,6 +652,23 @@ address := mailbox | group
 void
 test(unsigned t, const char *in, const char *out)
 {
+  // the parser on the buffer
+  string result;
+  addressParser_t parser(in);
+  address_t address;
+  while(parser.next(&address)) {
+    result += 'T';
+    appendAddress(address, &result);
+  }
+  if (parser.error || result != out || parser.end != strlen(in)) {
+    printf("test %u failed:\n"
+           "expected '%s'\n"
+           "but got  '%s' %s\n", t, out, result.c_str(),
+           parser.error ? parser.error : "");
+    exit(EXIT_FAILURE);
+  }
+
+  // and through a file
   FILE *f = fopen("test.tmp", "w+");
   if (!f) {
     perror("fopen");
@@ -584,14 +678,15 @@ test(unsigned t, const char *in, const char *out)
   fclose(f);
   
   f = fopen("test.tmp", "r");
-  address.clear();
-  parse_address(f);
+  result.clear();
+  string o;
+  parseAddress(f, &result, 'T', false, &o);
   fclose(f);
   
-  if (address != out) {
+  if (result != out || o != in) {
     printf("test %u failed:\n"
            "expected '%s'\n"
-           "but got  '%s'\n", t, out, address.c_str());
+           "but got  '%s'\n", t, out, result.c_str());
     exit(EXIT_FAILURE);
   }
   printf("test %u okay!\n", t);
@@ -650,6 +745,142 @@ main()
            "TWilt.Chamberlain@NBA.US");
   test(19, "getrud@arschkrampen.de, \"gürgen\" <oliver@kalkofe.de>\r\n",
            "Tgetrud@arschkrampen.deToliver@kalkofe.de");
+  test(20, "\"a \\\"b\\\"\"@c (\\) d), x@[1.2 .3.4],\r\n"
+           " x . \"y z\" @ d\r\n",
+           "T\"a \\\"b\\\"\"@cTx@[1.2 .3.4]Tx.\"y z\"@d");
+
+  // a parser stops at the end of the header field
+  const char *header = "a@b, c@d\r\nSubject: x\r\n";
+  addressParser_t parser(header);
+  address_t address;
+  unsigned n = 0;
+  while(parser.next(&address))
+    ++n;
+  if (n!=2 || strcmp(header + parser.end, "Subject: x\r\n")!=0) {
+    printf("test 21 failed\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("test 21 okay!\n");
+}
+
+#endif
+
+#ifdef BENCHMARK
+
+#include <time.h>
+
+// header field bodies as found in mailing list traffic
+static const char *corpus[] = {
+  " linux-kernel@vger.kernel.org\r\n",
+  " \"Doe, John\" <john.doe@example.com>\r\n",
+  " Jane Roe <jane.roe@mail.example.org>, bob@example.net,\r\n"
+  "\t\"Smith, Alice (Engineering)\" <alice.smith@corp.example.com>\r\n",
+  " =?UTF-8?Q?J=C3=BCrgen_M=C3=BCller?= <juergen.mueller@example.de>\r\n",
+  " Greg Kroah-Hartman <gregkh@linuxfoundation.org>, stable@vger.kernel.org,\r\n"
+  " patches@lists.linux.dev, Sasha Levin <sashal@kernel.org>,\r\n"
+  " linux-kernel@vger.kernel.org, torvalds@linux-foundation.org,\r\n"
+  " akpm@linux-foundation.org, linux@roeck-us.net, shuah@kernel.org\r\n",
+  " undisclosed-recipients:;\r\n",
+  " support@example.com (Example Support Team)\r\n",
+  " \"announce\" <announce-list@lists.example.org>\r\n",
+  " postmaster@[192.0.2.25]\r\n",
+  " Team: alice@example.com, bob@example.com, carol@example.com;\r\n",
+};
+
+static double
+now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main()
+{
+  // the corpus and a large Cc: header with 1000 recipients
+  string cc;
+  for(unsigned i=0; i<1000; ++i) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s\"User %u\" <user%u@host%u.example.com>",
+             i ? ",\r\n " : " ", i, i, i % 17);
+    cc += buffer;
+  }
+  cc += "\r\n";
+  const unsigned n = sizeof(corpus)/sizeof(corpus[0]);
+  string_view fields[n+1];
+  size_t bytes = 0;
+  for(unsigned i=0; i<n; ++i)
+    fields[i] = corpus[i];
+  fields[n] = cc;
+  for(unsigned i=0; i<=n; ++i)
+    bytes += fields[i].size();
+
+  // both ways have to agree
+  unsigned addresses = 0;
+  for(unsigned i=0; i<=n; ++i) {
+    string a, b;
+    FILE *f = fmemopen((void*)fields[i].data(), fields[i].size(), "r");
+    addresses += parseAddress(f, &a, 'T', true, 0);
+    fclose(f);
+    addressParser_t parser(fields[i]);
+    address_t address;
+    while(parser.next(&address)) {
+      b += 'T';
+      appendAddress(address, &b);
+      b += '\0';
+    }
+    if (a!=b || parser.error) {
+      printf("rfc822-address-bench: field %u was parsed differently\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const unsigned rounds = 2000;
+  size_t sum = 0;
+  double t0 = now();
+  for(unsigned r=0; r<rounds; ++r) {
+    for(unsigned i=0; i<=n; ++i) {
+      string a;
+      FILE *f = fmemopen((void*)fields[i].data(), fields[i].size(), "r");
+      parseAddress(f, &a, 'T', true, 0);
+      fclose(f);
+      sum += a.size();
+    }
+  }
+  double t1 = now();
+  string a;
+  for(unsigned r=0; r<rounds; ++r) {
+    for(unsigned i=0; i<=n; ++i) {
+      a.clear();
+      addressParser_t parser(fields[i]);
+      address_t address;
+      while(parser.next(&address))
+        appendAddress(address, &a);
+      sum += a.size();
+    }
+  }
+  double t2 = now();
+  for(unsigned r=0; r<rounds; ++r) {
+    for(unsigned i=0; i<=n; ++i) {
+      addressParser_t parser(fields[i]);
+      address_t address;
+      while(parser.next(&address))
+        sum += address.text.size();
+    }
+  }
+  double t3 = now();
+
+  double mb = (double)bytes * rounds / 1e6;
+  double total = (double)addresses * rounds;
+  printf("%u addresses in %zu bytes\n", addresses, bytes);
+  printf("FILE and string: %7.1f MB/s, %6.1f ns per address\n",
+         mb / (t1-t0), (t1-t0) * 1e9 / total);
+  printf("buffer, copied : %7.1f MB/s, %6.1f ns per address\n",
+         mb / (t2-t1), (t2-t1) * 1e9 / total);
+  printf("buffer, spans  : %7.1f MB/s, %6.1f ns per address\n",
+         mb / (t3-t2), (t3-t2) * 1e9 / total);
+  return sum ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 #endif
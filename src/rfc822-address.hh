@@ -0,0 +1,74 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+
+#include <string>
+#include <string_view>
+
+/*
+ * Parser for the address lists in the From:, To:, Cc: and Bcc: header
+ * fields, RFC 822, 6.
+ *
+ * The parser works on a buffer holding the header field's body and
+ * doesn't copy anything: the addresses are returned as spans of the
+ * buffer. All the state is kept in the parser object, several parsers may
+ * be used at the same time.
+ */
+
+struct address_t
+{
+  std::string_view text; // the first to the last token of the address
+  bool cfws;             // 'text' contains whitespace or comments to be dropped
+  bool local;            // there is no domain, '@localhost' is implied
+};
+
+struct addressParser_t
+{
+  addressParser_t(std::string_view field);
+
+  bool next(address_t *address);
+
+  // set when next() returned 'false' because of a syntax error
+  const char *error;
+
+  // when done: the offset of the first byte after the header field
+  size_t end;
+
+  private:
+    int lex();
+
+    const char *buffer;
+    size_t size;
+    int state;
+    bool ingroup, inroute, done;
+
+    // the address collected so far
+    const char *begin, *last;
+    bool cfws;
+
+    // the last token
+    const char *token, *token_end;
+    bool token_cfws;
+};
+
+void appendAddress(const address_t &address, std::string *r);
+
+int parseAddress(FILE *in, std::string *r, char c, bool z, std::string *o,
+                 const char **error = 0);
@@ -0,0 +1,184 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.hh"
+
+static stats_t unmapped;
+stats_t *stats = &unmapped;
+
+/**
+ * Map the daemon's statistics file into memory and start counting from 0.
+ * Must be called before the daemon changes its root directory.
+ *
+ * \param name
+ *   the daemon, as shown by mailgrave-stat
+ * \return
+ *   false when the file can't be mapped, the caller continues without
+ */
+bool
+mapStats(const char *file, const char *name)
+{
+  int fd = open(file, O_RDWR|O_CREAT, 00644);
+  if (fd<0) {
+    perror("failed to open stats file");
+    return false;
+  }
+  if (ftruncate(fd, STATS_SIZE)!=0) {
+    perror("failed to resize stats file");
+    close(fd);
+    return false;
+  }
+  void *p = mmap(0, STATS_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED) {
+    perror("failed to mmap stats file");
+    return false;
+  }
+  stats = (stats_t*)p;
+  // a reader seeing another pid or start time knows the counters were reset
+  __atomic_store_n(&stats->magic, 0, __ATOMIC_RELEASE);
+  memset((char*)stats + sizeof(stats->magic), 0,
+         sizeof(stats_t) - sizeof(stats->magic));
+  strncpy(stats->name, name, sizeof(stats->name)-1);
+  stats->pid = getpid();
+  stats->started = time(0);
+  __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * Map a statistics file read-only for mailgrave-stat.
+ *
+ * \return
+ *   0 when the file can't be mapped
+ */
+const stats_t*
+readStats(const char *file)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd<0) {
+    fprintf(stderr, "failed to open '%s': %s\n", file, strerror(errno));
+    return 0;
+  }
+  // a file which is too short would raise SIGBUS
+  struct stat st;
+  if (fstat(fd, &st)!=0 || st.st_size<(off_t)STATS_SIZE) {
+    fprintf(stderr, "'%s' is no stats file\n", file);
+    close(fd);
+    return 0;
+  }
+  void *p = mmap(0, STATS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED) {
+    fprintf(stderr, "failed to mmap '%s': %s\n", file, strerror(errno));
+    return 0;
+  }
+  return (const stats_t*)p;
+}
+
+/**
+ * The histogram for the stage 'name' of the daemon, called once per stage
+ * after mapStats().
+ */
+histogram_t*
+statHistogram(const char *name)
+{
+  for(unsigned i=0; i<HISTOGRAMS; ++i) {
+    histogram_t *h = &stats->histogram[i];
+    if (!h->name[0]) {
+      strncpy(h->name, name, sizeof(h->name)-1);
+      return h;
+    }
+    if (strcmp(h->name, name)==0)
+      return h;
+  }
+  // more stages than slots is a programming error
+  fprintf(stderr, "no histogram left for '%s'\n", name);
+  abort();
+}
+
+/**
+ * Microseconds on the monotonic clock.
+ */
+uint64_t
+statClock()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * The latency which a fraction 'p' of the recorded values don't exceed,
+ * given as the largest value of its bucket.
+ */
+uint64_t
+histogramPercentile(const histogram_t *h, double p)
+{
+  // the daemon keeps counting, work on a copy
+  uint64_t bucket[HISTOGRAM_BUCKETS];
+  uint64_t count = 0;
+  for(unsigned i=0; i<HISTOGRAM_BUCKETS; ++i) {
+    bucket[i] = statGet(&h->bucket[i]);
+    count += bucket[i];
+  }
+  if (count==0)
+    return 0;
+  uint64_t rank = (uint64_t)(p * count + 0.999999);
+  if (rank<1)
+    rank = 1;
+  uint64_t max = statGet(&h->max);
+  uint64_t seen = 0;
+  for(unsigned i=0; i<HISTOGRAM_BUCKETS; ++i) {
+    seen += bucket[i];
+    if (seen<rank)
+      continue;
+    if (i<16)
+      return i;
+    unsigned shift = i/8 - 1;
+    uint64_t top = ((uint64_t)(i%8 + 9) << shift) - 1;
+    return top<max ? top : max;
+  }
+  return max;
+}
+
+/**
+ * Print a latency in microseconds with a unit fitting its size.
+ */
+const char*
+statDuration(uint64_t us, char *buffer, size_t size)
+{
+  if (us<1000)
+    snprintf(buffer, size, "%lluus", (unsigned long long)us);
+  else if (us<1000000)
+    snprintf(buffer, size, "%.1fms", us / 1e3);
+  else
+    snprintf(buffer, size, "%.2fs", us / 1e6);
+  return buffer;
+}
@@ -0,0 +1,141 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Counters of one daemon, kept in a file which the daemon maps into
+ * memory and updates as it works. mailgrave-stat maps the files of the
+ * daemons read-only and samples them, the queue directory isn't looked
+ * at.
+ *
+ * Only the daemon owning the file, including its forked children,
+ * writes to it. All fields are updated with atomic operations, thus
+ * readers need no lock.
+ */
+
+/*
+ * The latency of one stage of the pipeline in microseconds. The buckets
+ * grow logarithmically: values below 16 have a bucket of their own, above
+ * that each power of two is split into 8 buckets, thus a value is known
+ * within 12.5%. Values from 2^32 (71 minutes) on share the last bucket.
+ */
+
+static const unsigned HISTOGRAM_BUCKETS = 240;
+static const unsigned HISTOGRAMS = 6;
+
+struct histogram_t
+{
+  char name[16];        // the stage, empty when the slot is unused
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t bucket[HISTOGRAM_BUCKETS];
+};
+
+struct stats_t
+{
+  uint32_t magic;
+  uint32_t pid;         // the daemon writing the file
+  uint64_t started;     // time() the daemon started, counters begin at 0
+  char name[16];        // 'smtpd', 'queue', 'send' or 'remote'
+
+  // counters
+  uint64_t queued;      // messages placed into the queue
+  uint64_t delivered;   // recipients
+  uint64_t deferred;    // recipients
+  uint64_t failed;      // recipients
+  uint64_t bytes_in;    // message data received
+  uint64_t bytes_out;   // message data sent
+
+  // gauges
+  uint64_t sessions;    // open SMTP sessions
+  uint64_t depth;       // messages in the queue
+  uint64_t oldest;      // time() the oldest of them was queued, 0 if none
+
+  // STARTTLS handshakes, counted by smtpd
+  uint64_t tls_full;        // without session resumption
+  uint64_t tls_resumed;
+  uint64_t tls_failed;
+  uint64_t tls_full_us;     // time spent in full handshakes
+  uint64_t tls_resumed_us;  // time spent in resumed handshakes
+
+  histogram_t histogram[HISTOGRAMS];
+};
+
+static const uint32_t STATS_MAGIC = 0x4d475354; // "MGST"
+static const size_t STATS_SIZE = 16384;
+
+static_assert(sizeof(stats_t) <= STATS_SIZE, "stats_t doesn't fit");
+
+// never 0, points to private memory when no file is mapped
+extern stats_t *stats;
+
+bool mapStats(const char *file, const char *name);
+const stats_t* readStats(const char *file);
+histogram_t* statHistogram(const char *name);
+uint64_t statClock();
+uint64_t histogramPercentile(const histogram_t *h, double p);
+const char* statDuration(uint64_t us, char *buffer, size_t size);
+
+static inline void
+statAdd(uint64_t *counter, uint64_t n)
+{
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void
+statSet(uint64_t *gauge, uint64_t value)
+{
+  __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+statGet(const uint64_t *value)
+{
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned
+histogramBucket(uint64_t us)
+{
+  if (us<16)
+    return us;
+  if (us>>32)
+    return HISTOGRAM_BUCKETS-1;
+  unsigned shift = 60 - __builtin_clzll(us); // keeps the top 4 bits
+  return 8*shift + (us>>shift);
+}
+
+/**
+ * Count a latency of 'us' microseconds, see statClock().
+ */
+static inline void
+statRecord(histogram_t *h, uint64_t us)
+{
+  statAdd(&h->bucket[histogramBucket(us)], 1);
+  statAdd(&h->count, 1);
+  statAdd(&h->sum, us);
+  uint64_t max = statGet(&h->max);
+  while(us>max &&
+        !__atomic_compare_exchange_n(&h->max, &max, us, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
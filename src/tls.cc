@@ -0,0 +1,134 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <openssl/err.h>
+
+#include "tls.hh"
+#include "log.hh"
+
+/**
+ * Create the context for outgoing connections.
+ *
+ * Mail exchangers are rarely set up for authentication, thus the server's
+ * certificate isn't verified: encryption is opportunistic, RFC 7435.
+ *
+ * \param ktls
+ *   let the kernel take over the encryption once the handshake is done
+ */
+SSL_CTX*
+tlsClientContext(bool ktls)
+{
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    tlsError("SSL_CTX_new");
+    return 0;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, 0);
+  // the output buffer may move between two calls of SSL_write()
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+  if (ktls)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  return ctx;
+}
+
+/**
+ * Create the context for incoming connections.
+ *
+ * Sessions are resumed with stateless tickets, RFC 5077 and RFC 8446 4.6.1:
+ * the server keeps no session cache, the state travels encrypted with the
+ * client. The ticket key is created at startup, thus tickets become invalid
+ * when the server is restarted.
+ *
+ * \param cert
+ *   PEM file with the certificate chain
+ * \param key
+ *   PEM file with the private key
+ * \param ktls
+ *   let the kernel take over the encryption once the handshake is done
+ */
+SSL_CTX*
+tlsServerContext(const char *cert, const char *key, bool ktls)
+{
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx) {
+    tlsError("SSL_CTX_new");
+    return 0;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert)!=1) {
+    tlsError(cert);
+    goto error;
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM)!=1) {
+    tlsError(key);
+    goto error;
+  }
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  // one ticket is enough, clients resume with the latest one
+  SSL_CTX_set_num_tickets(ctx, 1);
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+  if (ktls)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  return ctx;
+
+error:
+  SSL_CTX_free(ctx);
+  return 0;
+}
+
+/**
+ * Return 'true' when the kernel encrypts data written to the connection.
+ */
+bool
+tlsKernelSend(SSL *ssl)
+{
+  return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+/**
+ * Return 'true' when the kernel decrypts data read from the connection.
+ */
+bool
+tlsKernelReceive(SSL *ssl)
+{
+  return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+/**
+ * Print 'what' and the errors queued by OpenSSL.
+ */
+void
+tlsError(const char *what)
+{
+  unsigned long e = ERR_get_error();
+  if (!e) {
+    LOG(LEVEL_ERROR, "%s: failed\n", what);
+    return;
+  }
+  while(e) {
+    char buffer[256];
+    ERR_error_string_n(e, buffer, sizeof(buffer));
+    LOG(LEVEL_ERROR, "%s: %s\n", what, buffer);
+    e = ERR_get_error();
+  }
+}
@@ -0,0 +1,37 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <openssl/ssl.h>
+
+/*
+ * STARTTLS support, RFC 3207, on top of OpenSSL.
+ *
+ * The handshakes are non-blocking, the callers drive SSL_connect() and
+ * SSL_accept() from their event loops.
+ *
+ * With kTLS the kernel encrypts what is written to the socket. Then
+ * write(), writev() and sendfile() may be used on the descriptor just like
+ * on a cleartext connection.
+ */
+
+SSL_CTX* tlsClientContext(bool ktls);
+SSL_CTX* tlsServerContext(const char *cert, const char *key, bool ktls);
+bool tlsKernelSend(SSL *ssl);
+bool tlsKernelReceive(SSL *ssl);
+void tlsError(const char *what);
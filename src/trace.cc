@@ -0,0 +1,77 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.hh"
+
+static int trace_fd = -1;
+
+/**
+ * Open the trace file for appending. Must be called before the daemon
+ * changes its root directory.
+ *
+ * \return
+ *   false when the file can't be opened, the caller continues without
+ */
+bool
+openTrace(const char *file)
+{
+  trace_fd = open(file, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 00644);
+  if (trace_fd<0) {
+    perror("failed to open trace file");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Append a record, when a trace file was opened. Each record is written
+ * with a single write() to a file opened with O_APPEND, thus records of
+ * several processes don't mix.
+ */
+void
+trace(uint64_t id, unsigned event, uint64_t when, uint64_t arg)
+{
+  if (trace_fd<0)
+    return;
+  trace_t t;
+  t.id = id;
+  t.when = when;
+  t.event = event;
+  t.pid = getpid();
+  t.arg = arg;
+  while(write(trace_fd, &t, sizeof(t))<0 && errno==EINTR)
+    ;
+}
+
+/**
+ * Microseconds on the wall clock.
+ */
+uint64_t
+traceClock()
+{
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
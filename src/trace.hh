@@ -0,0 +1,55 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+
+/*
+ * The way of each message through the pipeline, recorded as fixed size
+ * records which mailgrave-queue and mailgrave-send append to a trace file
+ * shared by both. 'mailgrave-trace' turns them into timelines and
+ * distributions.
+ *
+ * The times are microseconds on the wall clock: a message may stay in the
+ * queue longer than the system is up, while the monotonic clock starts
+ * anew with each boot.
+ */
+
+enum {
+  TRACE_ACCEPTED = 1, // a client began to hand the message over
+  TRACE_QUEUED,       // mailgrave-queue began to store it
+  TRACE_STORED,       // it was written to the queue, 'arg' bytes, no fsync()
+  TRACE_ATTEMPT,      // mailgrave-send handed it over, 'arg' is the attempt
+  TRACE_DELIVERED,    // 'arg' recipients were delivered
+  TRACE_FAILED,       // 'arg' recipients failed permanently
+  TRACE_DEFERRED,     // 'arg' recipients have to be tried again
+  TRACE_DONE          // it left the queue after 'arg' attempts
+};
+
+struct trace_t
+{
+  uint64_t id;          // the queue id
+  uint64_t when;        // traceClock()
+  uint32_t event;
+  uint32_t pid;         // the process writing the record
+  uint64_t arg;
+};
+
+bool openTrace(const char *file);
+void trace(uint64_t id, unsigned event, uint64_t when, uint64_t arg);
+uint64_t traceClock();
@@ -0,0 +1,346 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wire.hh"
+
+/**
+ * Return the first '\r' or '\n' in [p, e) or 'e' when there is none.
+ */
+static inline const char*
+findBreak(const char *p, const char *e)
+{
+#ifdef __SSE2__
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while(e-p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                   _mm_cmpeq_epi8(v, lf)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while(p!=e && *p!='\r' && *p!='\n')
+    ++p;
+  return p;
+}
+
+static inline void
+emit(struct iovec *iov, size_t *k, const char *p, size_t n)
+{
+  if (n==0)
+    return;
+  iov[*k].iov_base = (void*)p;
+  iov[*k].iov_len = n;
+  ++*k;
+}
+
+/**
+ * Convert a block of the message into the wire format.
+ *
+ * \param p, n
+ *   the block
+ * \param state
+ *   in/out: WIRE_BOL at the beginning of the message, carried from one
+ *   block to the next
+ * \param stuff
+ *   double the '.' at the beginning of lines, BDAT doesn't want this
+ * \param iov, maxiov
+ *   out: the converted data, which points into the block
+ * \param niov
+ *   out: the number of iovecs used
+ * \return
+ *   the number of bytes of the block which were converted, less than 'n'
+ *   when 'maxiov' didn't suffice
+ */
+size_t
+wireSpans(const char *p, size_t n, unsigned *state, bool stuff,
+          struct iovec *iov, size_t maxiov, size_t *niov)
+{
+  const char *b = p;
+  const char *e = p + n;
+  const char *span = p; // unchanged input not yet emitted
+  unsigned st = *state;
+  size_t k = 0;
+
+  // each step emits at most two iovecs, the final span one more
+  while(p!=e && k+3 <= maxiov) {
+    if (st==WIRE_BOL && stuff && *p=='.') {
+      emit(iov, &k, span, p-span);
+      emit(iov, &k, ".", 1);
+      span = p;
+      st = WIRE_LINE;
+      ++p;
+      continue;
+    }
+    const char *q = findBreak(p, e);
+    if (q!=p)
+      st = WIRE_LINE;
+    if (q==e) {
+      p = e;
+      break;
+    }
+    p = q + 1;
+    if (*q=='\r') {
+      st = WIRE_CR;
+      continue;
+    }
+    if (st!=WIRE_CR) {
+      emit(iov, &k, span, q-span);
+      emit(iov, &k, "\r", 1);
+      span = q;
+    }
+    st = WIRE_BOL;
+  }
+  emit(iov, &k, span, p-span);
+
+  *state = st;
+  *niov = k;
+  return p - b;
+}
+
+/**
+ * Return what has to be appended at the end of the message so that it
+ * ends with "\r\n".
+ */
+const char*
+wireTail(unsigned state)
+{
+  switch(state) {
+    case WIRE_LINE:
+      return "\r\n";
+    case WIRE_CR:
+      return "\n";
+  }
+  return "";
+}
+
+#ifdef BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+using std::string;
+
+static int verbose = 0;
+
+static void
+io_putc(string *out, int c)
+{
+  if (verbose>0)
+    putc_unlocked(c, stdout);
+  *out += c;
+}
+
+/**
+ * The former conversion, one character at a time.
+ */
+static void
+stuffBlock(string *out, unsigned *bodystate, const char *p, size_t n)
+{
+  unsigned state = *bodystate;
+  for(const char *e = p + n; p != e; ++p) {
+    int c = (unsigned char)*p;
+    switch(state) {
+      case 0: // BOL
+        switch(c) {
+          case '\n':
+            io_putc(out, '\r');
+            io_putc(out, c);
+            break;
+          case '\r':
+            io_putc(out, c);
+            state = 2;
+            break;
+          case '.':
+            io_putc(out, '.');
+            io_putc(out, c);
+            state = 1;
+            break;
+          default:
+            io_putc(out, c);
+            state = 1;
+        }
+        break;
+      case 1: // behind BOL
+        switch(c) {
+          case '\n':
+            io_putc(out, '\r');
+            io_putc(out, c);
+            state = 0;
+            break;
+          case '\r':
+            io_putc(out, c);
+            state = 2;
+            break;
+          default:
+            io_putc(out, c);
+        }
+        break;
+      case 2: // behind '\r'
+        io_putc(out, c);
+        switch(c) {
+          case '\n':
+            state = 0;
+            break;
+          case '\r':
+            break;
+          default:
+            state = 1;
+        }
+        break;
+    }
+  }
+  *bodystate = state;
+}
+
+static void
+bytewise(string *out, const string &msg, size_t block)
+{
+  unsigned state = 0;
+  for(size_t i=0; i<msg.size(); i+=block)
+    stuffBlock(out, &state, msg.data()+i, msg.size()-i < block ? msg.size()-i : block);
+  out->append(wireTail(state));
+}
+
+/**
+ * Convert the message and copy the spans into 'out', which is what
+ * mailgrave-remote does when the socket doesn't take the data at once.
+ */
+static void
+spanwise(string *out, const string &msg, size_t block)
+{
+  unsigned state = WIRE_BOL;
+  struct iovec iov[256];
+  for(size_t i=0; i<msg.size(); i+=block) {
+    const char *p = msg.data() + i;
+    size_t n = msg.size()-i < block ? msg.size()-i : block;
+    while(n) {
+      size_t niov;
+      size_t l = wireSpans(p, n, &state, true, iov, 256, &niov);
+      for(size_t j=0; j<niov; ++j)
+        out->append((const char*)iov[j].iov_base, iov[j].iov_len);
+      p += l;
+      n -= l;
+    }
+  }
+  out->append(wireTail(state));
+}
+
+/**
+ * Only convert the message, which is what mailgrave-remote does when
+ * writev() takes all of it.
+ */
+static size_t
+scanonly(const string &msg, size_t block)
+{
+  unsigned state = WIRE_BOL;
+  struct iovec iov[256];
+  size_t total = 0;
+  for(size_t i=0; i<msg.size(); i+=block) {
+    const char *p = msg.data() + i;
+    size_t n = msg.size()-i < block ? msg.size()-i : block;
+    while(n) {
+      size_t niov;
+      size_t l = wireSpans(p, n, &state, true, iov, 256, &niov);
+      for(size_t j=0; j<niov; ++j)
+        total += iov[j].iov_len;
+      p += l;
+      n -= l;
+    }
+  }
+  return total + strlen(wireTail(state));
+}
+
+static double
+now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main()
+{
+  // compare both conversions on random messages made of the interesting
+  // characters, in blocks of varying size
+  srand(1);
+  static const char alphabet[] = "ab.\r\n";
+  for(unsigned t=0; t<10000; ++t) {
+    string msg;
+    size_t len = rand() % 64;
+    for(size_t i=0; i<len; ++i)
+      msg += alphabet[rand() % 5];
+    size_t block = 1 + rand() % 8;
+    string a, b;
+    bytewise(&a, msg, block);
+    spanwise(&b, msg, block);
+    if (a!=b || scanonly(msg, block)!=a.size()) {
+      printf("wire-bench: conversions differ for block size %lu\n",
+             (unsigned long)block);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // a 16 MB message with lines of typical length, some starting with a dot
+  string msg;
+  while(msg.size() < 16*1024*1024) {
+    if (rand() % 50 == 0)
+      msg += '.';
+    msg.append(40 + rand() % 36, 'x');
+    msg += '\n';
+  }
+  const size_t block = 16384;
+  const unsigned rounds = 5;
+  double t0 = now();
+  size_t sum = 0;
+  for(unsigned i=0; i<rounds; ++i) {
+    string out;
+    bytewise(&out, msg, block);
+    sum += out.size();
+  }
+  double t1 = now();
+  for(unsigned i=0; i<rounds; ++i) {
+    string out;
+    spanwise(&out, msg, block);
+    sum += out.size();
+  }
+  double t2 = now();
+  for(unsigned i=0; i<rounds; ++i)
+    sum += scanonly(msg, block);
+  double t3 = now();
+
+  double mb = (double)msg.size() * rounds / (1024*1024);
+  printf("byte-wise       : %7.1f MB/s\n", mb / (t1-t0));
+  printf("spans, copied   : %7.1f MB/s\n", mb / (t2-t1));
+  printf("spans, zero-copy: %7.1f MB/s\n", mb / (t3-t2));
+  return sum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
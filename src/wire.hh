@@ -0,0 +1,41 @@
+/*
+ * MailGrave -- a simple smtpd daemon influenced by qmail
+ * Copyright (C) 2006, 2007 by Mark-André Hopf <mhopf@mark13.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or   
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Conversion of a message into the SMTP wire format, RFC 5321, 2.3.8 and
+ * 4.5.2: a bare '\n' becomes "\r\n" and, within DATA, a '.' at the
+ * beginning of a line is doubled.
+ *
+ * The message is scanned block-wise. The result is a list of iovecs which
+ * point to the unchanged spans of the block and to the few characters
+ * inserted in between, ready for writev().
+ */
+
+enum {
+  WIRE_BOL,   // at the beginning of a line
+  WIRE_LINE,  // within a line
+  WIRE_CR     // behind a '\r'
+};
+
+size_t wireSpans(const char *p, size_t n, unsigned *state, bool stuff,
+                 struct iovec *iov, size_t maxiov, size_t *niov);
+const char* wireTail(unsigned state);
@@ -44,7 +44,13 @@ main(int argc, char **argv)
   inet_aton("127.0.0.1", &ia);
   name.sin_addr.s_addr = ia.s_addr;
   name.sin_family = AF_INET;
-  name.sin_port   = htons(2525);
+  int port = 2525;
+  int first = 1;
+  if (argc>2 && strcmp(argv[1], "--port")==0) {
+    port = atoi(argv[2]);
+    first = 3;
+  }
+  name.sin_port   = htons(port);
   if (connect(s, (sockaddr*) &name, sizeof(sockaddr_in)) < 0) {
     perror("client: connect");
     exit(1);
@@ -54,7 +60,7 @@ main(int argc, char **argv)
   mygets(buffer, sizeof(buffer), s);
   printf("client received '%s'\n", buffer);
 
-  for(int i=1; i<argc; ++i) {
+  for(int i=first; i<argc; ++i) {
     if (strcmp(argv[i], "helo")==0) {
       ++i;
       write(s, "HELO ", 5);
@@ -85,6 +91,15 @@ main(int argc, char **argv)
     } else
     if (strcmp(argv[i], "quit")==0) {
       write(s, "QUIT\r\n", 6);
+    } else
+    if (strcmp(argv[i], "starttls")==0) {
+      write(s, "STARTTLS\r\n", 10);
+    } else
+    if (strcmp(argv[i], "sleep")==0) {
+      // e.g. to stall in the middle of a TLS handshake
+      ++i;
+      sleep(atoi(argv[i]));
+      continue;
     } else {
       fprintf(stderr, "unknown option '%s'\n", argv[i]);
       exit(1);
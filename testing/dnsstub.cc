@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+
+using std::string;
+
+/*
+ * A name server answering from the command line for mailgrave-remote's
+ * resolver:
+ *
+ *   dnsstub <port> <name> A <address> <name> MX '<pref> <host>' ...
+ *
+ * Every query is printed on stdout. Unknown names get NXDOMAIN.
+ */
+
+static void
+putName(string *out, const char *name)
+{
+  while(*name) {
+    const char *dot = strchr(name, '.');
+    size_t l = dot ? dot-name : strlen(name);
+    *out += (char)l;
+    out->append(name, l);
+    name += l;
+    if (*name)
+      ++name;
+  }
+  *out += '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc<2) {
+    fprintf(stderr, "usage: dnsstub <port> [<name> <type> <value>]...\n");
+    exit(1);
+  }
+  int s=socket(AF_INET, SOCK_DGRAM, 0);
+  if (s<0) {
+    perror("dnsstub: socket");
+    exit(1);
+  }
+  sockaddr_in name;
+  memset(&name, 0, sizeof(name));
+  inet_aton("127.0.0.1", &name.sin_addr);
+  name.sin_family = AF_INET;
+  name.sin_port   = htons(atoi(argv[1]));
+  if (bind(s, (sockaddr*) &name, sizeof(sockaddr_in)) < 0) {
+    perror("dnsstub: bind");
+    exit(1);
+  }
+  setvbuf(stdout, 0, _IONBF, 0);
+
+  while(true) {
+    unsigned char msg[512];
+    sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n = recvfrom(s, msg, sizeof(msg), 0, (sockaddr*)&from, &fromlen);
+    if (n<12)
+      continue;
+
+    // the question
+    string qname;
+    ssize_t pos = 12;
+    while(pos<n && msg[pos]) {
+      if (!qname.empty())
+        qname += '.';
+      qname.append((char*)msg+pos+1, msg[pos]);
+      pos += msg[pos] + 1;
+    }
+    ++pos;
+    if (pos+4>n)
+      continue;
+    unsigned qtype = (msg[pos]<<8) | msg[pos+1];
+    pos += 4;
+    printf("dnsstub: query %s %u\n", qname.c_str(), qtype);
+
+    string answer((char*)msg, pos);
+    answer[2] = 0x81; // QR, RD
+    answer[3] = 0x80; // RA
+    answer[6] = answer[7] = 0;
+    answer[8] = answer[9] = answer[10] = answer[11] = 0;
+
+    bool known = false;
+    unsigned count = 0;
+    for(int i=2; i+2<argc; i+=3) {
+      if (strcasecmp(argv[i], qname.c_str())!=0)
+        continue;
+      known = true;
+      string rdata;
+      unsigned type;
+      if (strcmp(argv[i+1], "A")==0) {
+        type = 1;
+        in_addr ia;
+        inet_aton(argv[i+2], &ia);
+        rdata.append((char*)&ia, 4);
+      } else
+      if (strcmp(argv[i+1], "MX")==0) {
+        type = 15;
+        char host[256];
+        unsigned pref;
+        if (sscanf(argv[i+2], "%u %255s", &pref, host)!=2)
+          continue;
+        rdata += (char)(pref>>8);
+        rdata += (char)(pref&0xff);
+        putName(&rdata, host);
+      } else {
+        continue;
+      }
+      if (type!=qtype)
+        continue;
+      answer.append("\xc0\x0c", 2);
+      answer += (char)0;
+      answer += (char)type;
+      answer.append("\0\1\0\0\1\x2c", 6); // IN, TTL 300
+      answer += (char)(rdata.size()>>8);
+      answer += (char)(rdata.size()&0xff);
+      answer += rdata;
+      ++count;
+    }
+    answer[7] = count;
+    if (!known)
+      answer[3] |= 3; // NXDOMAIN
+    sendto(s, answer.data(), answer.size(), 0, (sockaddr*)&from, fromlen);
+  }
+}
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <string>
+
+#include "../src/inject.hh"
+
+using std::string;
+
+/*
+ * An application queuing messages with libmailgrave-inject:
+ *
+ *   injector <count> <pause> <file>
+ *
+ * Queues the message in <file> <count> times, waiting <pause> seconds
+ * between two messages, over one connection to mailgrave-queue.
+ */
+
+int
+main(int argc, char **argv)
+{
+  if (argc!=4) {
+    fprintf(stderr, "usage: injector <count> <pause> <file>\n");
+    exit(1);
+  }
+  setvbuf(stdout, 0, _IONBF, 0);
+  FILE *f = fopen(argv[3], "r");
+  if (!f) {
+    perror("injector: fopen");
+    exit(1);
+  }
+  string message;
+  int c;
+  while((c=getc(f))!=EOF)
+    message += c;
+  fclose(f);
+
+  inject_t inject;
+  unsigned count = atoi(argv[1]);
+  unsigned failed = 0;
+  for(unsigned i=0; i<count; ++i) {
+    if (i)
+      sleep(atoi(argv[2]));
+    timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bool ok = injectMessage(&inject, message.data(), message.size());
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    if (ok) {
+      printf("injector: message %u queued in %ld us\n", i, us);
+    } else {
+      printf("injector: message %u failed: %s\n", i, inject.error);
+      ++failed;
+    }
+  }
+  return failed ? 1 : 0;
+}
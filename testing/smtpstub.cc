@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/*
+ * An SMTP server offering the extensions given on the command line to
+ * mailgrave-remote:
+ *
+ *   smtpstub [--parallel] [--reply <range> <command> <reply>]... <port> [<extension>]...
+ *
+ * e.g. 'smtpstub 2527 CHUNKING'. Every command is printed on stdout, the
+ * bytes of the n-th message received with DATA or BDAT are stored in
+ * 'msg.<n>'. One connection is served at a time, with --parallel each one
+ * is served by a thread of its own.
+ *
+ * --reply answers the commands beginning with <command> with <reply>
+ * instead, when they are within <range>: 'n' for the n-th of them, 'n-m'
+ * or 'n-' for the n-th onwards, counted over all connections. The
+ * connection is closed after a 421 reply.
+ *
+ * AUTH PLAIN and AUTH LOGIN accept any credentials and print them decoded,
+ * with NUL bytes written as '\0'.
+ *
+ * When STARTTLS is offered it is accepted, but the connection is closed
+ * instead of doing the handshake.
+ */
+
+struct reader_t
+{
+  int fd;
+  char buffer[65536];
+  size_t pos, len;
+};
+
+/**
+ * Read 'n' bytes, false on EOF.
+ */
+static bool
+readBytes(reader_t *r, string *out, size_t n)
+{
+  while(n) {
+    if (r->pos==r->len) {
+      ssize_t l = read(r->fd, r->buffer, sizeof(r->buffer));
+      if (l<=0)
+        return false;
+      r->pos = 0;
+      r->len = l;
+    }
+    size_t m = r->len - r->pos < n ? r->len - r->pos : n;
+    out->append(r->buffer + r->pos, m);
+    r->pos += m;
+    n -= m;
+  }
+  return true;
+}
+
+/**
+ * Read a line including its CRLF, false on EOF.
+ */
+static bool
+readLine(reader_t *r, string *line)
+{
+  line->clear();
+  while(line->empty() || (*line)[line->size()-1]!='\n') {
+    if (!readBytes(r, line, 1))
+      return false;
+  }
+  return true;
+}
+
+static void
+reply(int fd, const char *text)
+{
+  write(fd, text, strlen(text));
+}
+
+/**
+ * Decode base64 and escape NUL bytes as '\0'.
+ */
+static string
+decode(const char *in)
+{
+  static const char *alphabet =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string out;
+  unsigned bits = 0, n = 0;
+  for(; *in && *in!='='; ++in) {
+    const char *p = strchr(alphabet, *in);
+    if (!p)
+      break;
+    bits = (bits << 6) | (p - alphabet);
+    n += 6;
+    if (n>=8) {
+      n -= 8;
+      char c = (bits >> n) & 0xff;
+      if (c)
+        out += c;
+      else
+        out += "\\0";
+    }
+  }
+  return out;
+}
+
+struct rule_t
+{
+  unsigned first, last;
+  const char *command;
+  const char *reply;
+  unsigned seen;
+};
+
+static vector<const char*> extensions;
+static vector<rule_t> rules;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+offers(const char *extension)
+{
+  for(size_t i=0; i<extensions.size(); ++i) {
+    if (strcasecmp(extensions[i], extension)==0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * The reply of the first rule 'cmd' falls into, or 0.
+ */
+static const char*
+ruled(const string &cmd)
+{
+  const char *result = 0;
+  pthread_mutex_lock(&lock);
+  for(size_t i=0; i<rules.size(); ++i) {
+    rule_t *rule = &rules[i];
+    if (strncasecmp(cmd.c_str(), rule->command, strlen(rule->command))!=0)
+      continue;
+    ++rule->seen;
+    if (!result && rule->seen >= rule->first && rule->seen <= rule->last)
+      result = rule->reply;
+  }
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+static unsigned messages = 0;
+
+static void
+save(const string &message)
+{
+  char name[32];
+  pthread_mutex_lock(&lock);
+  snprintf(name, sizeof(name), "msg.%u", ++messages);
+  pthread_mutex_unlock(&lock);
+  FILE *f = fopen(name, "w");
+  if (!f) {
+    perror("smtpstub: fopen");
+    return;
+  }
+  fwrite(message.data(), 1, message.size(), f);
+  fclose(f);
+  printf("smtpstub: saved %s, %lu bytes\n", name, (unsigned long)message.size());
+}
+
+static void
+serve(int fd)
+{
+  reader_t r;
+  r.fd = fd;
+  r.pos = r.len = 0;
+  string line, message;
+  reply(fd, "220 smtpstub\r\n");
+  while(readLine(&r, &line)) {
+    string cmd = line.substr(0, line.size() - (line.size()>1 && line[line.size()-2]=='\r' ? 2 : 1));
+    printf("smtpstub: %s\n", cmd.c_str());
+    const char *text = ruled(cmd);
+    if (text) {
+      printf("smtpstub: replied %s\n", text);
+      reply(fd, text);
+      reply(fd, "\r\n");
+      if (strncmp(text, "421", 3)==0)
+        break;
+    } else
+    if (strncasecmp(cmd.c_str(), "EHLO", 4)==0) {
+      string text = "250";
+      text += extensions.empty() ? " " : "-";
+      text += "smtpstub\r\n";
+      for(size_t i=0; i<extensions.size(); ++i) {
+        text += "250";
+        text += i+1<extensions.size() ? "-" : " ";
+        text += extensions[i];
+        text += "\r\n";
+      }
+      reply(fd, text.c_str());
+    } else
+    if (strncasecmp(cmd.c_str(), "DATA", 4)==0) {
+      reply(fd, "354 go ahead\r\n");
+      message.clear();
+      while(readLine(&r, &line) && line!=".\r\n")
+        message += line[0]=='.' ? line.substr(1) : line;
+      save(message);
+      message.clear();
+      reply(fd, "250 ok\r\n");
+    } else
+    if (strncasecmp(cmd.c_str(), "BDAT ", 5)==0) {
+      unsigned long n = strtoul(cmd.c_str()+5, 0, 10);
+      if (!readBytes(&r, &message, n))
+        break;
+      if (strstr(cmd.c_str(), " LAST")) {
+        save(message);
+        message.clear();
+      }
+      reply(fd, "250 ok\r\n");
+    } else
+    if (strncasecmp(cmd.c_str(), "AUTH PLAIN ", 11)==0) {
+      printf("smtpstub: AUTH PLAIN %s\n", decode(cmd.c_str()+11).c_str());
+      reply(fd, "235 ok\r\n");
+    } else
+    if (strncasecmp(cmd.c_str(), "AUTH LOGIN", 10)==0) {
+      string user, pass;
+      reply(fd, "334 VXNlcm5hbWU6\r\n");
+      if (!readLine(&r, &line))
+        break;
+      user = decode(line.c_str());
+      reply(fd, "334 UGFzc3dvcmQ6\r\n");
+      if (!readLine(&r, &line))
+        break;
+      pass = decode(line.c_str());
+      printf("smtpstub: AUTH LOGIN %s %s\n", user.c_str(), pass.c_str());
+      reply(fd, "235 ok\r\n");
+    } else
+    if (strncasecmp(cmd.c_str(), "STARTTLS", 8)==0 && offers("STARTTLS")) {
+      reply(fd, "220 go ahead\r\n");
+      break;
+    } else
+    if (strncasecmp(cmd.c_str(), "QUIT", 4)==0) {
+      reply(fd, "221 bye\r\n");
+      break;
+    } else {
+      reply(fd, "250 ok\r\n");
+    }
+  }
+  close(fd);
+}
+
+static void*
+serveThread(void *fd)
+{
+  serve((int)(long)fd);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  bool parallel = false;
+  int i = 1;
+  for(; i<argc && strncmp(argv[i], "--", 2)==0; ++i) {
+    if (strcmp(argv[i], "--parallel")==0) {
+      parallel = true;
+    } else
+    if (strcmp(argv[i], "--reply")==0 && i+3 < argc) {
+      rule_t rule;
+      char *end;
+      rule.first = rule.last = strtoul(argv[i+1], &end, 10);
+      if (*end=='-')
+        rule.last = end[1] ? strtoul(end+1, 0, 10) : ~0U;
+      rule.command = argv[i+2];
+      rule.reply = argv[i+3];
+      rule.seen = 0;
+      rules.push_back(rule);
+      i += 3;
+    } else {
+      break;
+    }
+  }
+  if (i>=argc || strncmp(argv[i], "--", 2)==0) {
+    fprintf(stderr, "usage: smtpstub [--parallel] [--reply <range> <command> <reply>]... <port> [<extension>]...\n");
+    exit(1);
+  }
+  const char *port = argv[i];
+  extensions.assign(argv+i+1, argv+argc);
+  int s=socket(AF_INET, SOCK_STREAM, 0);
+  if (s<0) {
+    perror("smtpstub: socket");
+    exit(1);
+  }
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in name;
+  memset(&name, 0, sizeof(name));
+  inet_aton("127.0.0.1", &name.sin_addr);
+  name.sin_family = AF_INET;
+  name.sin_port   = htons(atoi(port));
+  if (bind(s, (sockaddr*) &name, sizeof(sockaddr_in)) < 0) {
+    perror("smtpstub: bind");
+    exit(1);
+  }
+  if (listen(s, 5) < 0) {
+    perror("smtpstub: listen");
+    exit(1);
+  }
+  setvbuf(stdout, 0, _IONBF, 0);
+
+  while(true) {
+    int fd = accept(s, 0, 0);
+    if (fd<0) {
+      perror("smtpstub: accept");
+      continue;
+    }
+    pthread_t thread;
+    if (!parallel || pthread_create(&thread, 0, serveThread, (void*)(long)fd)!=0) {
+      serve(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}